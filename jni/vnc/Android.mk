@@ -9,6 +9,7 @@ LIBVNCSERVER_SRC_FILES:= \
 	$(LIBVNCSERVER_ROOT)/libvncserver/rfbregion.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/auth.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/sockets.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/sendqueue.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/stats.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/corre.c \
 	$(LIBVNCSERVER_ROOT)/libvncserver/rfbssl_openssl.c \
@@ -53,6 +54,9 @@ LOCAL_SRC_FILES += \
 										rotation_watcher.cpp \
 										update_screen.cpp \
 										JpgEncoder.cpp \
+										PngEncoder.cpp \
+										pixel_convert.cpp \
+										FrameRecorder.cpp \
 										droidvncserver.cpp
 
 LOCAL_C_INCLUDES += \
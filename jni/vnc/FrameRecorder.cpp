@@ -0,0 +1,482 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "FrameRecorder.hpp"
+#include "droidvncserver.hpp"
+#include "minilzo.h"
+
+struct RecordHeader {
+  uint32_t type;
+  uint32_t size;
+  uint64_t time;
+};
+
+struct FormatRecord {
+  uint32_t width, height, bpp;
+  uint16_t bitsPerPixel, depth;
+  uint16_t redMax, greenMax, blueMax;
+  uint16_t redShift, greenShift, blueShift;
+};
+
+struct RotationRecord {
+  int32_t screenRotation, imageRotation;
+};
+
+struct FrameRecordHeader {
+  uint32_t skipped;
+  uint32_t rawSize;
+};
+
+static unsigned int
+tileCount(unsigned int size, unsigned int tile) {
+  return (size + tile - 1) / tile;
+}
+
+// Bytes of the changed tile bitmap of a width x height frame
+static size_t
+bitmapSize(unsigned int width, unsigned int height, unsigned int tile) {
+  return (tileCount(width, tile) * tileCount(height, tile) + 7) / 8;
+}
+
+FrameRecorder::FrameRecorder()
+  : mFile(NULL),
+    mBusy(false),
+    mStopping(false),
+    mKeyFrame(true),
+    mWidth(0),
+    mHeight(0),
+    mBpp(0),
+    mStart(0),
+    mPendingTime(0),
+    mPendingSkipped(0),
+    mLatestTime(0),
+    mHaveLatest(false),
+    mSkipped(0),
+    mRecorded(0),
+    mSkippedTotal(0),
+    mBytes(0)
+{
+}
+
+FrameRecorder::~FrameRecorder() {
+  close();
+}
+
+bool
+FrameRecorder::open(const char *path) {
+  uint32_t header[2] = { FRAME_RECORDING_VERSION, FRAME_RECORDING_TILE };
+
+  close();
+
+  if ((mFile = fopen(path, "wb")) == NULL) {
+    return false;
+  }
+
+  if (fwrite(FRAME_RECORDING_MAGIC, 8, 1, mFile) != 1 || fwrite(header, sizeof(header), 1, mFile) != 1) {
+    fclose(mFile);
+    mFile = NULL;
+    return false;
+  }
+
+  mWorkMem.resize(LZO1X_1_MEM_COMPRESS);
+  mStart = rfbLatencyClock();
+  mBytes = 8 + sizeof(header);
+  mRecorded = mSkippedTotal = 0;
+  mSkipped = 0;
+  mHaveLatest = false;
+  mStopping = false;
+  mKeyFrame = true;
+  mThread = std::thread(&FrameRecorder::run, this);
+  return true;
+}
+
+void
+FrameRecorder::close() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFile == NULL) {
+      return;
+    }
+    mStopping = true;
+  }
+  mCond.notify_all();
+  mThread.join();
+
+  LOGD("Recorded %lu frames, left out %lu, %llu bytes", mRecorded, mSkippedTotal, (unsigned long long) mBytes);
+  fclose(mFile);
+  mFile = NULL;
+}
+
+void
+FrameRecorder::waitIdle(std::unique_lock<std::mutex> &lock) {
+  mCond.wait(lock, [this] { return !mBusy; });
+}
+
+void
+FrameRecorder::setFormat(unsigned int width, unsigned int height, unsigned int bpp, const rfbPixelFormat &format) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  FormatRecord rec;
+
+  if (mFile == NULL) {
+    return;
+  }
+  waitIdle(lock);
+
+  rec.width = width;
+  rec.height = height;
+  rec.bpp = bpp;
+  rec.bitsPerPixel = format.bitsPerPixel;
+  rec.depth = format.depth;
+  rec.redMax = format.redMax;
+  rec.greenMax = format.greenMax;
+  rec.blueMax = format.blueMax;
+  rec.redShift = format.redShift;
+  rec.greenShift = format.greenShift;
+  rec.blueShift = format.blueShift;
+  writeRecord(FRAME_RECORD_FORMAT, rfbLatencyClock() - mStart, &rec, sizeof(rec));
+
+  mWidth = width;
+  mHeight = height;
+  mBpp = bpp;
+  mPending.resize((size_t) width * height * bpp);
+  mPrevious.resize(mPending.size());
+  mLatest.resize(mPending.size());
+  mKeyFrame = true;
+}
+
+void
+FrameRecorder::setRotation(int screenRotation, int imageRotation) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  RotationRecord rec;
+
+  if (mFile == NULL) {
+    return;
+  }
+  waitIdle(lock);
+
+  rec.screenRotation = screenRotation;
+  rec.imageRotation = imageRotation;
+  writeRecord(FRAME_RECORD_ROTATION, rfbLatencyClock() - mStart, &rec, sizeof(rec));
+}
+
+void
+FrameRecorder::publish(const unsigned char *screen) {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mFile == NULL || mPending.empty()) {
+      return;
+    }
+    if (mBusy) {
+      // Still writing the last one: hold on to the newest frame only, so
+      // that the recording catches up with the screen once it can
+      if (mHaveLatest) {
+        mSkipped++;
+        mSkippedTotal++;
+      }
+      memcpy(mLatest.data(), screen, mLatest.size());
+      mLatestTime = rfbLatencyClock() - mStart;
+      mHaveLatest = true;
+      return;
+    }
+
+    memcpy(mPending.data(), screen, mPending.size());
+    mPendingTime = rfbLatencyClock() - mStart;
+    mPendingSkipped = mSkipped;
+    mSkipped = 0;
+    mBusy = true;
+  }
+  mCond.notify_all();
+}
+
+void
+FrameRecorder::run() {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true) {
+    mCond.wait(lock, [this] { return mBusy || mStopping; });
+    if (!mBusy) {
+      break;
+    }
+
+    // mPending, mPrevious and the format are ours until mBusy is cleared
+    lock.unlock();
+    recordFrame();
+    lock.lock();
+
+    if (mHaveLatest) {
+      mPending.swap(mLatest);
+      mPendingTime = mLatestTime;
+      mPendingSkipped = mSkipped;
+      mSkipped = 0;
+      mHaveLatest = false;
+      continue;
+    }
+    mBusy = false;
+    mCond.notify_all();
+  }
+}
+
+void
+FrameRecorder::recordFrame() {
+  const unsigned int tile = FRAME_RECORDING_TILE;
+  const unsigned int tilesX = tileCount(mWidth, tile), tilesY = tileCount(mHeight, tile);
+  const size_t rowBytes = (size_t) mWidth * mBpp;
+  const size_t bitmap = bitmapSize(mWidth, mHeight, tile);
+  FrameRecordHeader header;
+  unsigned char *out;
+  lzo_uint compressed;
+
+  mDelta.resize(bitmap + mPending.size());
+  memset(mDelta.data(), 0, bitmap);
+  out = mDelta.data() + bitmap;
+
+  for (unsigned int ty = 0; ty < tilesY; ty++) {
+    unsigned int rows = std::min(tile, mHeight - ty * tile);
+
+    for (unsigned int tx = 0; tx < tilesX; tx++) {
+      size_t offset = ty * tile * rowBytes + (size_t) tx * tile * mBpp;
+      size_t bytes = (size_t) std::min(tile, mWidth - tx * tile) * mBpp;
+      bool changed = mKeyFrame;
+
+      for (unsigned int y = 0; y < rows && !changed; y++) {
+        changed = memcmp(&mPending[offset + y * rowBytes], &mPrevious[offset + y * rowBytes], bytes) != 0;
+      }
+      if (!changed) {
+        continue;
+      }
+
+      unsigned int index = ty * tilesX + tx;
+      mDelta[index / 8] |= 1 << (index % 8);
+      for (unsigned int y = 0; y < rows; y++) {
+        memcpy(out, &mPending[offset + y * rowBytes], bytes);
+        out += bytes;
+      }
+    }
+  }
+
+  mPending.swap(mPrevious);
+  mKeyFrame = false;
+
+  // LZO needs up to 1/16 more than the input for incompressible data
+  header.skipped = mPendingSkipped;
+  header.rawSize = out - mDelta.data();
+  mCompressed.resize(sizeof(header) + header.rawSize + header.rawSize / 16 + 64 + 3);
+  if (lzo1x_1_compress(mDelta.data(), header.rawSize, &mCompressed[sizeof(header)], &compressed,
+                       mWorkMem.data()) != LZO_E_OK) {
+    LOGE("Could not compress recorded frame");
+    return;
+  }
+  memcpy(mCompressed.data(), &header, sizeof(header));
+
+  if (writeRecord(FRAME_RECORD_FRAME, mPendingTime, mCompressed.data(), sizeof(header) + compressed)) {
+    mRecorded++;
+  }
+}
+
+bool
+FrameRecorder::writeRecord(uint32_t type, uint64_t time, const void *data, uint32_t size) {
+  RecordHeader header = { type, size, time };
+
+  // Flushed every record, so that a recording ends with whole records
+  // however the server stops
+  if (fwrite(&header, sizeof(header), 1, mFile) != 1 || fwrite(data, size, 1, mFile) != 1 || fflush(mFile) != 0) {
+    LOGE("Could not write to the recording");
+    return false;
+  }
+  mBytes += sizeof(header) + size;
+  return true;
+}
+
+FrameReplayer::FrameReplayer()
+  : mFile(NULL),
+    mFirstRecord(0),
+    mTileSize(FRAME_RECORDING_TILE),
+    mType(FRAME_RECORD_FORMAT),
+    mTime(0),
+    mWidth(0),
+    mHeight(0),
+    mBpp(0),
+    mScreenRotation(0),
+    mImageRotation(0),
+    mSkipped(0)
+{
+  memset(&mFormat, 0, sizeof(mFormat));
+}
+
+FrameReplayer::~FrameReplayer() {
+  close();
+}
+
+bool
+FrameReplayer::open(const char *path) {
+  char magic[8];
+  uint32_t header[2];
+
+  close();
+
+  if ((mFile = fopen(path, "rb")) == NULL) {
+    return false;
+  }
+
+  if (fread(magic, sizeof(magic), 1, mFile) != 1 || memcmp(magic, FRAME_RECORDING_MAGIC, sizeof(magic)) != 0 ||
+      fread(header, sizeof(header), 1, mFile) != 1 || header[0] != FRAME_RECORDING_VERSION || header[1] == 0) {
+    LOGE("%s is not a recording this version can read", path);
+    close();
+    return false;
+  }
+
+  mTileSize = header[1];
+  mFirstRecord = ftell(mFile);
+  mWidth = mHeight = mBpp = 0;
+  return true;
+}
+
+void
+FrameReplayer::close() {
+  if (mFile != NULL) {
+    fclose(mFile);
+    mFile = NULL;
+  }
+}
+
+bool
+FrameReplayer::rewind() {
+  mWidth = mHeight = mBpp = 0;
+  return mFile != NULL && fseek(mFile, mFirstRecord, SEEK_SET) == 0;
+}
+
+bool
+FrameReplayer::next() {
+  RecordHeader header;
+
+  if (mFile == NULL || fread(&header, sizeof(header), 1, mFile) != 1) {
+    return false;
+  }
+
+  mPayload.resize(header.size);
+  if (header.size > 0 && fread(mPayload.data(), header.size, 1, mFile) != 1) {
+    // Cut off while it was being written
+    return false;
+  }
+
+  mTime = header.time;
+  switch (header.type) {
+  case FRAME_RECORD_FORMAT: {
+    FormatRecord rec;
+
+    if (header.size < sizeof(rec)) {
+      return false;
+    }
+    memcpy(&rec, mPayload.data(), sizeof(rec));
+    if (rec.width == 0 || rec.height == 0 || (rec.bpp != 1 && rec.bpp != 2 && rec.bpp != 4 && rec.bpp != 8)) {
+      return false;
+    }
+
+    mWidth = rec.width;
+    mHeight = rec.height;
+    mBpp = rec.bpp;
+    memset(&mFormat, 0, sizeof(mFormat));
+    mFormat.bitsPerPixel = rec.bitsPerPixel;
+    mFormat.depth = rec.depth;
+    mFormat.trueColour = TRUE;
+    mFormat.redMax = rec.redMax;
+    mFormat.greenMax = rec.greenMax;
+    mFormat.blueMax = rec.blueMax;
+    mFormat.redShift = rec.redShift;
+    mFormat.greenShift = rec.greenShift;
+    mFormat.blueShift = rec.blueShift;
+    mType = FRAME_RECORD_FORMAT;
+    return true;
+  }
+  case FRAME_RECORD_ROTATION: {
+    RotationRecord rec;
+
+    if (header.size < sizeof(rec)) {
+      return false;
+    }
+    memcpy(&rec, mPayload.data(), sizeof(rec));
+    mScreenRotation = rec.screenRotation;
+    mImageRotation = rec.imageRotation;
+    mType = FRAME_RECORD_ROTATION;
+    return true;
+  }
+  case FRAME_RECORD_FRAME:
+    mType = FRAME_RECORD_FRAME;
+    return readFrame();
+  default:
+    // Skip what a later version may add
+    return next();
+  }
+}
+
+bool
+FrameReplayer::readFrame() {
+  FrameRecordHeader header;
+  lzo_uint size;
+
+  if (mWidth == 0 || mPayload.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, mPayload.data(), sizeof(header));
+
+  // Never more than a bitmap and the whole frame
+  size_t bitmap = bitmapSize(mWidth, mHeight, mTileSize);
+  if (header.rawSize < bitmap || header.rawSize > bitmap + (size_t) mWidth * mHeight * mBpp) {
+    return false;
+  }
+
+  mDelta.resize(header.rawSize);
+  size = header.rawSize;
+  if (lzo1x_decompress_safe(&mPayload[sizeof(header)], mPayload.size() - sizeof(header), mDelta.data(), &size,
+                            NULL) != LZO_E_OK || size != header.rawSize) {
+    return false;
+  }
+
+  // The tiles have to add up to what is there
+  const unsigned int tilesX = tileCount(mWidth, mTileSize), tilesY = tileCount(mHeight, mTileSize);
+  size_t tiles = 0;
+  for (unsigned int ty = 0; ty < tilesY; ty++) {
+    for (unsigned int tx = 0; tx < tilesX; tx++) {
+      unsigned int index = ty * tilesX + tx;
+      if (mDelta[index / 8] & (1 << (index % 8))) {
+        tiles += (size_t) std::min(mTileSize, mWidth - tx * mTileSize) * mBpp *
+                 std::min(mTileSize, mHeight - ty * mTileSize);
+      }
+    }
+  }
+  if (bitmap + tiles != header.rawSize) {
+    return false;
+  }
+
+  mSkipped = header.skipped;
+  return true;
+}
+
+void
+FrameReplayer::applyFrame(unsigned char *screen) const {
+  const unsigned int tile = mTileSize;
+  const unsigned int tilesX = tileCount(mWidth, tile), tilesY = tileCount(mHeight, tile);
+  const size_t rowBytes = (size_t) mWidth * mBpp;
+  const unsigned char *in = mDelta.data() + bitmapSize(mWidth, mHeight, tile);
+
+  for (unsigned int ty = 0; ty < tilesY; ty++) {
+    unsigned int rows = std::min(tile, mHeight - ty * tile);
+
+    for (unsigned int tx = 0; tx < tilesX; tx++) {
+      unsigned int index = ty * tilesX + tx;
+      if (!(mDelta[index / 8] & (1 << (index % 8)))) {
+        continue;
+      }
+
+      size_t offset = ty * tile * rowBytes + (size_t) tx * tile * mBpp;
+      size_t bytes = (size_t) std::min(tile, mWidth - tx * tile) * mBpp;
+      for (unsigned int y = 0; y < rows; y++) {
+        memcpy(&screen[offset + y * rowBytes], in, bytes);
+        in += bytes;
+      }
+    }
+  }
+}
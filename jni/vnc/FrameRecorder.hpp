@@ -0,0 +1,158 @@
+#ifndef DROIDVNCSERVER_FRAME_RECORDER_HPP
+#define DROIDVNCSERVER_FRAME_RECORDER_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "rfb/rfb.h"
+
+// A recording is the header "DROIDREC", uint32 version, uint32 tile size,
+// then records of uint32 type, uint32 payload size, uint64 microseconds
+// since the recording started and the payload, all little endian:
+//
+//   FORMAT    uint32 width, height, bytes per pixel, then uint16
+//             bitsPerPixel, depth, redMax, greenMax, blueMax, redShift,
+//             greenShift, blueShift of the server pixel format
+//   ROTATION  int32 screen rotation, int32 image rotation (degrees)
+//   FRAME     uint32 published frames left out before this one, uint32
+//             uncompressed size, then LZO1X-1 compressed: one bit per tile,
+//             row major, set if the tile changed, and the rows of every
+//             changed tile. The first FRAME after a FORMAT has every tile.
+#define FRAME_RECORDING_MAGIC "DROIDREC"
+#define FRAME_RECORDING_VERSION 1
+#define FRAME_RECORDING_TILE 32
+
+enum FrameRecordType {
+  FRAME_RECORD_FORMAT = 1,
+  FRAME_RECORD_ROTATION = 2,
+  FRAME_RECORD_FRAME = 3
+};
+
+// Appends the published frames of the screen to a recording. The caller
+// only copies the frame, comparing, compressing and writing it happen on a
+// thread of the recorder's own. While that is busy only the newest frame
+// published is kept for it, the ones it replaces are left out and counted.
+class FrameRecorder {
+public:
+  FrameRecorder();
+
+  ~FrameRecorder();
+
+  bool open(const char *path);
+
+  // Write out the frame still being recorded and close the recording
+  void close();
+
+  // Start a new part of the recording with frames of this size and format,
+  // its first frame is recorded whole
+  void setFormat(unsigned int width, unsigned int height, unsigned int bpp, const rfbPixelFormat &format);
+
+  void setRotation(int screenRotation, int imageRotation);
+
+  // Record screen, width * height * bpp bytes as set by setFormat()
+  void publish(const unsigned char *screen);
+
+  unsigned long getRecordedFrames() const { return mRecorded; }
+  unsigned long getSkippedFrames() const { return mSkippedTotal; }
+  uint64_t getBytesWritten() const { return mBytes; }
+
+private:
+  FILE *mFile;
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  bool mBusy;     // the writer thread owns mPending
+  bool mStopping;
+  bool mKeyFrame; // record every tile of the next frame
+
+  unsigned int mWidth, mHeight, mBpp;
+  uint64_t mStart;
+  uint64_t mPendingTime;
+  uint32_t mPendingSkipped;
+  uint64_t mLatestTime;
+  bool mHaveLatest; // mLatest holds a frame published while mBusy
+  uint32_t mSkipped;
+
+  std::vector<unsigned char> mPending;  // frame handed to the writer thread
+  std::vector<unsigned char> mPrevious; // last frame recorded
+  std::vector<unsigned char> mLatest;   // newest frame published while busy
+  std::vector<unsigned char> mDelta;
+  std::vector<unsigned char> mCompressed;
+  std::vector<unsigned char> mWorkMem;
+
+  unsigned long mRecorded, mSkippedTotal;
+  uint64_t mBytes;
+
+  void run();
+
+  void recordFrame();
+
+  bool writeRecord(uint32_t type, uint64_t time, const void *data, uint32_t size);
+
+  void waitIdle(std::unique_lock<std::mutex> &lock);
+};
+
+// Reads a recording back, one record at a time
+class FrameReplayer {
+public:
+  FrameReplayer();
+
+  ~FrameReplayer();
+
+  bool open(const char *path);
+
+  void close();
+
+  // Go back to the first record
+  bool rewind();
+
+  // Read the next record, false at the end of the recording or if the
+  // record is damaged
+  bool next();
+
+  FrameRecordType getType() const { return mType; }
+
+  // Microseconds since the recording started
+  uint64_t getTime() const { return mTime; }
+
+  // As of the last FORMAT record
+  unsigned int getWidth() const { return mWidth; }
+  unsigned int getHeight() const { return mHeight; }
+  unsigned int getBpp() const { return mBpp; }
+  const rfbPixelFormat &getFormat() const { return mFormat; }
+
+  // As of the last ROTATION record
+  int getScreenRotation() const { return mScreenRotation; }
+  int getImageRotation() const { return mImageRotation; }
+
+  // Frames the recorder left out before the last FRAME record
+  uint32_t getSkippedFrames() const { return mSkipped; }
+
+  // Copy the tiles the last FRAME record changed onto screen, which holds
+  // the frame before it
+  void applyFrame(unsigned char *screen) const;
+
+private:
+  FILE *mFile;
+  long mFirstRecord;
+  unsigned int mTileSize;
+
+  FrameRecordType mType;
+  uint64_t mTime;
+  unsigned int mWidth, mHeight, mBpp;
+  rfbPixelFormat mFormat;
+  int mScreenRotation, mImageRotation;
+  uint32_t mSkipped;
+
+  std::vector<unsigned char> mPayload;
+  std::vector<unsigned char> mDelta;
+
+  bool readFrame();
+};
+
+#endif
@@ -1,7 +1,16 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
 #include <stdexcept>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "JpgEncoder.hpp"
 #include "droidvncserver.hpp"
+#include "pixel_convert.hpp"
 
 JpgEncoder::JpgEncoder(unsigned int prePadding, unsigned int postPadding)
   : mTjHandle(tjInitCompress()),
@@ -10,17 +19,28 @@ JpgEncoder::JpgEncoder(unsigned int prePadding, unsigned int postPadding)
     mPostPadding(postPadding),
     mMaxWidth(0),
     mMaxHeight(0),
-    mEncodedData(NULL)    
+    mEncodedData(NULL),
+    mYuvData(NULL),
+    mYuvSize(0)
 {
 }
 
 JpgEncoder::~JpgEncoder() {
   tjFree(mEncodedData);
+  free(mYuvData);
+  if (mTjHandle != NULL) {
+    tjDestroy(mTjHandle);
+  }
 }
 
 bool
 JpgEncoder::encode(unsigned char *data, unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format, unsigned int quality) {
   unsigned char* offset = getEncodedData();
+  int pixelFormat = convertFormat(bpp, format);
+
+  if (pixelFormat < 0) {
+    return encodeYuv(data, width, height, stride, bpp, format, quality);
+  }
 
   return 0 == tjCompress2(
     mTjHandle,
@@ -28,7 +48,7 @@ JpgEncoder::encode(unsigned char *data, unsigned int width, unsigned int height,
     width,
     stride * bpp,
     height,
-    convertFormat(format),
+    pixelFormat,
     &offset,
     &mEncodedSize,
     mSubsampling,
@@ -37,6 +57,69 @@ JpgEncoder::encode(unsigned char *data, unsigned int width, unsigned int height,
   );
 }
 
+// Pixels TurboJPEG can't read directly are converted to planar YUV 4:2:0
+// here, which is also what it would have turned them into
+bool
+JpgEncoder::encodeYuv(unsigned char *data, unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format, unsigned int quality) {
+  unsigned char* offset = getEncodedData();
+  // 4:2:0 planes cover the image rounded up to even dimensions
+  unsigned int planeWidth = (width + 1) & ~1U;
+  unsigned int planeHeight = (height + 1) & ~1U;
+  const unsigned char *planes[3];
+  int strides[3];
+  unsigned char *rgb0, *rgb1;
+
+  if (!reserveYuv(width, height)) {
+    return false;
+  }
+
+  planes[0] = mYuvData;
+  planes[1] = planes[0] + planeWidth * planeHeight;
+  planes[2] = planes[1] + planeWidth / 2 * planeHeight / 2;
+  strides[0] = planeWidth;
+  strides[1] = strides[2] = planeWidth / 2;
+  rgb0 = (unsigned char *) planes[2] + planeWidth / 2 * planeHeight / 2;
+  rgb1 = rgb0 + planeWidth * 3;
+
+  for (unsigned int y = 0; y < height; y += 2) {
+    const unsigned char *row = data + (size_t) y * stride * bpp;
+
+    convertRowToRgb(rgb0, row, width, bpp, format);
+    if (y + 1 < height) {
+      convertRowToRgb(rgb1, row + (size_t) stride * bpp, width, bpp, format);
+    } else {
+      memcpy(rgb1, rgb0, width * 3);
+    }
+    if (width & 1) {
+      memcpy(rgb0 + width * 3, rgb0 + width * 3 - 3, 3);
+      memcpy(rgb1 + width * 3, rgb1 + width * 3 - 3, 3);
+    }
+
+    convertRows(
+      (unsigned char *) planes[0] + y * planeWidth,
+      (unsigned char *) planes[0] + (y + 1) * planeWidth,
+      (unsigned char *) planes[1] + y / 2 * strides[1],
+      (unsigned char *) planes[2] + y / 2 * strides[2],
+      rgb0,
+      rgb1,
+      planeWidth
+    );
+  }
+
+  return 0 == tjCompressFromYUVPlanes(
+    mTjHandle,
+    planes,
+    width,
+    strides,
+    height,
+    TJSAMP_420,
+    &offset,
+    &mEncodedSize,
+    quality,
+    TJFLAG_FASTDCT | TJFLAG_NOREALLOC
+  );
+}
+
 int
 JpgEncoder::getEncodedSize() {
   return mEncodedSize;
@@ -47,10 +130,19 @@ JpgEncoder::getEncodedData() {
   return mEncodedData + mPrePadding;
 }
 
+// The buffer only grows, so screenshots of the same or a smaller size
+// reuse it
 bool
 JpgEncoder::reserveData(uint32_t width, uint32_t height) {
-  if (width == mMaxWidth && height == mMaxHeight) {
-    return 0;
+  if (width <= mMaxWidth && height <= mMaxHeight) {
+    return true;
+  }
+
+  if (width < mMaxWidth) {
+    width = mMaxWidth;
+  }
+  if (height < mMaxHeight) {
+    height = mMaxHeight;
   }
 
   tjFree(mEncodedData);
@@ -66,6 +158,7 @@ JpgEncoder::reserveData(uint32_t width, uint32_t height) {
   mEncodedData = tjAlloc(maxSize);
 
   if (mEncodedData == NULL) {
+    mMaxWidth = mMaxHeight = 0;
     return false;
   }
 
@@ -75,15 +168,72 @@ JpgEncoder::reserveData(uint32_t width, uint32_t height) {
   return true;
 }
 
+// Room for the Y, U and V planes and two rows of RGB
+bool
+JpgEncoder::reserveYuv(unsigned int width, unsigned int height) {
+  unsigned int planeWidth = (width + 1) & ~1U;
+  unsigned int planeHeight = (height + 1) & ~1U;
+  unsigned int size = planeWidth * planeHeight * 3 / 2 + planeWidth * 6;
+
+  if (size <= mYuvSize) {
+    return true;
+  }
+
+  free(mYuvData);
+
+  if ((mYuvData = (unsigned char *) malloc(size)) == NULL) {
+    mYuvSize = 0;
+    LOGE("Could not allocate %d bytes for YUV", size);
+    return false;
+  }
+
+  mYuvSize = size;
+  return true;
+}
+
+bool
+JpgEncoder::isSupported(unsigned int bpp, Minicap::Format format) {
+  switch (bpp) {
+  case 1:
+  case 2:
+  case 8:
+    return true;
+  case 3:
+    return format == Minicap::FORMAT_RGB_888;
+  case 4:
+    switch (format) {
+    case Minicap::FORMAT_RGBA_8888:
+    case Minicap::FORMAT_RGBX_8888:
+    case Minicap::FORMAT_BGRA_8888:
+    case Minicap::FORMAT_TRANSLUCENT:
+    case Minicap::FORMAT_TRANSPARENT:
+      return true;
+    default:
+      return false;
+    }
+  default:
+    return false;
+  }
+}
+
+// TurboJPEG pixel format for pixels it can read as they are, or -1
 int
-JpgEncoder::convertFormat(Minicap::Format format) {
+JpgEncoder::convertFormat(unsigned int bpp, Minicap::Format format) {
+  if (bpp == 3 && format == Minicap::FORMAT_RGB_888) {
+    return TJPF_RGB;
+  }
+
+  if (bpp != 4) {
+    return -1;
+  }
+
   switch (format) {
   case Minicap::FORMAT_RGBA_8888:
     return TJPF_RGBA;
+  case Minicap::FORMAT_TRANSLUCENT:
+  case Minicap::FORMAT_TRANSPARENT:
   case Minicap::FORMAT_RGBX_8888:
     return TJPF_RGBX;
-  case Minicap::FORMAT_RGB_888:
-    return TJPF_RGB;
   case Minicap::FORMAT_BGRA_8888:
     return TJPF_BGRA;
   default:
@@ -91,3 +241,48 @@ JpgEncoder::convertFormat(Minicap::Format format) {
   }
 }
 
+static inline unsigned char
+clampChroma(int value) {
+  return value > 255 ? 255 : value;
+}
+
+/*
+ * Convert two rows of width (even) RGB pixels into two rows of Y and one
+ * of U and V, averaging each 2x2 block for the chroma. BT.601 full range
+ * as in JFIF, with 8 bit coefficients so the NEON and C paths agree.
+ */
+void
+JpgEncoder::convertRows(unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v, const unsigned char *rgb0, const unsigned char *rgb1, unsigned int width) {
+  unsigned int j = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+  const uint8x8_t kr = vdup_n_u8(77), kg = vdup_n_u8(150), kb = vdup_n_u8(29);
+
+  for (; j + 8 <= width; j += 8) {
+    uint8x8x3_t p0 = vld3_u8(rgb0 + j * 3), p1 = vld3_u8(rgb1 + j * 3);
+    uint16x8_t s0 = vmull_u8(p0.val[0], kr), s1 = vmull_u8(p1.val[0], kr);
+
+    s0 = vmlal_u8(vmlal_u8(s0, p0.val[1], kg), p0.val[2], kb);
+    s1 = vmlal_u8(vmlal_u8(s1, p1.val[1], kg), p1.val[2], kb);
+    vst1_u8(y0 + j, vrshrn_n_u16(s0, 8));
+    vst1_u8(y1 + j, vrshrn_n_u16(s1, 8));
+  }
+#endif
+
+  for (; j < width; j++) {
+    const unsigned char *p0 = rgb0 + j * 3, *p1 = rgb1 + j * 3;
+    y0[j] = (77 * p0[0] + 150 * p0[1] + 29 * p0[2] + 128) >> 8;
+    y1[j] = (77 * p1[0] + 150 * p1[1] + 29 * p1[2] + 128) >> 8;
+  }
+
+  for (j = 0; j < width; j += 2) {
+    const unsigned char *p0 = rgb0 + j * 3, *p1 = rgb1 + j * 3;
+    int r = (p0[0] + p0[3] + p1[0] + p1[3] + 2) >> 2;
+    int g = (p0[1] + p0[4] + p1[1] + p1[4] + 2) >> 2;
+    int b = (p0[2] + p0[5] + p1[2] + p1[5] + 2) >> 2;
+
+    // offset by 128 << 8 first so the shifts stay on positive values
+    u[j / 2] = clampChroma((-43 * r - 85 * g + 128 * b + 32896) >> 8);
+    v[j / 2] = clampChroma((128 * r - 107 * g - 21 * b + 32896) >> 8);
+  }
+}
@@ -19,6 +19,9 @@ public:
 
   bool reserveData(uint32_t width, uint32_t height);
 
+  static bool
+  isSupported(unsigned int bpp, Minicap::Format format);
+
 private:
   tjhandle mTjHandle;
   int mSubsampling;
@@ -28,10 +31,18 @@ private:
   unsigned int mMaxHeight;
   unsigned char* mEncodedData;
   unsigned long mEncodedSize;
+  unsigned char* mYuvData;
+  unsigned int mYuvSize;
+
+  bool encodeYuv(unsigned char *data, unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format, unsigned int quality);
+
+  bool reserveYuv(unsigned int width, unsigned int height);
 
   static int
-  convertFormat(Minicap::Format format);
+  convertFormat(unsigned int bpp, Minicap::Format format);
+
+  static void
+  convertRows(unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v, const unsigned char *rgb0, const unsigned char *rgb1, unsigned int width);
 };
 
 #endif
-
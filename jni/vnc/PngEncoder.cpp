@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include <atomic>
+#include <thread>
+
+#include "PngEncoder.hpp"
+#include "pixel_convert.hpp"
+#include "droidvncserver.hpp"
+
+// Images with fewer strips than this are not worth the threads
+#define PNG_MIN_STRIPS 4
+// Filtered bytes per strip
+#define PNG_STRIP_BYTES (256 * 1024)
+// Deflate window primed from the end of the previous strip
+#define PNG_WINDOW 32768
+
+struct PngEncoder::Image {
+  unsigned char *data;
+  unsigned int width, height, stride, bpp;
+  Minicap::Format format;
+  int level, filters;
+};
+
+struct PngEncoder::Strip {
+  unsigned int first, rows;
+  bool last;
+  std::vector<unsigned char> out;  // raw deflate data
+  uLong adler;                     // of the filtered rows
+  bool ok;
+};
+
+PngEncoder::PngEncoder(unsigned int threads)
+  : mRow(NULL),
+    mRowSize(0),
+    mThreads(threads ? threads : std::thread::hardware_concurrency())
+{
+  if (mThreads == 0) {
+    mThreads = 1;
+  }
+}
+
+PngEncoder::~PngEncoder() {
+  free(mRow);
+}
+
+bool
+PngEncoder::reserveRow(unsigned int width) {
+  if (width * 3 <= mRowSize) {
+    return true;
+  }
+
+  free(mRow);
+
+  if ((mRow = (unsigned char *) malloc(width * 3)) == NULL) {
+    mRowSize = 0;
+    return false;
+  }
+
+  mRowSize = width * 3;
+  return true;
+}
+
+static inline unsigned char
+paeth(int a, int b, int c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  return pb <= pc ? b : c;
+}
+
+// Filter one RGB row into out (filter type byte first), choosing among the
+// allowed filters the one with the smallest sum of absolute values, as
+// libpng does. prev is the unfiltered row above, or NULL for the first.
+void
+PngEncoder::filterRow(unsigned char *out, unsigned char *scratch, const unsigned char *row, const unsigned char *prev, unsigned int rowBytes, int filters) {
+  static const int types[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH };
+  unsigned long best = ~0UL;
+  unsigned int i;
+
+  if ((filters & PNG_ALL_FILTERS) == 0) {
+    filters = PNG_FILTER_NONE;
+  }
+
+  for (int t = 0; t < 5; t++) {
+    unsigned char *f = best == ~0UL ? out : scratch;
+    unsigned long sum = 0;
+
+    if (!(filters & types[t])) {
+      continue;
+    }
+
+    f[0] = t;
+    for (i = 0; i < rowBytes; i++) {
+      int a = i >= 3 ? row[i - 3] : 0;
+      int b = prev ? prev[i] : 0;
+      int c = prev && i >= 3 ? prev[i - 3] : 0;
+      unsigned char v;
+
+      switch (t) {
+      case 0: v = row[i]; break;
+      case 1: v = row[i] - a; break;
+      case 2: v = row[i] - b; break;
+      case 3: v = row[i] - ((a + b) >> 1); break;
+      default: v = row[i] - paeth(a, b, c); break;
+      }
+      f[i + 1] = v;
+      sum += v < 128 ? v : 256 - v;
+    }
+
+    if (f == out) {
+      best = sum;
+    } else if (sum < best) {
+      best = sum;
+      memcpy(out, scratch, rowBytes + 1);
+    }
+  }
+}
+
+/*
+ * Filter and deflate the rows of one strip into a raw deflate stream that
+ * ends byte aligned (Z_SYNC_FLUSH), or finished for the last strip, so the
+ * strips can be joined into one zlib stream. Filtering only looks at the
+ * unfiltered rows, so a strip does not depend on its neighbours; the
+ * window is primed with the filtered rows just above it, as pigz does.
+ */
+bool
+PngEncoder::deflateStrip(const Image &image, Strip *strip) {
+  unsigned int rowBytes = image.width * 3;
+  unsigned int primeRows = strip->first ? (PNG_WINDOW + rowBytes) / (rowBytes + 1) : 0;
+  unsigned char *rows, *filtered, *scratch;
+  unsigned int r, first;
+  z_stream zs;
+  bool ok = true;
+
+  if (primeRows > strip->first) {
+    primeRows = strip->first;
+  }
+  first = strip->first - primeRows;
+
+  // two RGB rows, the filtered rows of the window and one filter candidate
+  rows = (unsigned char *) malloc(2 * rowBytes + (primeRows + 2) * (rowBytes + 1));
+  if (rows == NULL) {
+    return false;
+  }
+  filtered = rows + 2 * rowBytes;
+  scratch = filtered + (primeRows + 1) * (rowBytes + 1);
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, image.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(rows);
+    return false;
+  }
+
+  strip->adler = adler32(0L, Z_NULL, 0);
+  strip->out.resize(deflateBound(&zs, (uLong) strip->rows * (rowBytes + 1)) + 64);
+  zs.next_out = &strip->out[0];
+  zs.avail_out = strip->out.size();
+
+  // row r goes into slot r & 1, so the row above the first one into the other
+  if (first > 0) {
+    convertRowToRgb(rows + ((first - 1) & 1) * rowBytes, image.data + (size_t) (first - 1) * image.stride * image.bpp,
+                    image.width, image.bpp, image.format);
+  }
+
+  for (r = first; ok && r < strip->first + strip->rows; r++) {
+    unsigned char *cur = rows + (r & 1) * rowBytes, *prev = rows + ((r + 1) & 1) * rowBytes;
+    unsigned char *out = r < strip->first ? filtered + (r - first) * (rowBytes + 1) : filtered + primeRows * (rowBytes + 1);
+
+    convertRowToRgb(cur, image.data + (size_t) r * image.stride * image.bpp, image.width, image.bpp, image.format);
+    filterRow(out, scratch, cur, r > 0 ? prev : NULL, rowBytes, image.filters);
+
+    if (r + 1 == strip->first) {
+      // everything above the strip is filtered, hand its tail to deflate
+      unsigned int len = primeRows * (rowBytes + 1);
+      unsigned int dict = len < PNG_WINDOW ? len : PNG_WINDOW;
+      ok = deflateSetDictionary(&zs, filtered + len - dict, dict) == Z_OK;
+    } else if (r >= strip->first) {
+      strip->adler = adler32(strip->adler, out, rowBytes + 1);
+      zs.next_in = out;
+      zs.avail_in = rowBytes + 1;
+      while (ok && zs.avail_in > 0) {
+        if (zs.avail_out == 0) {
+          size_t used = strip->out.size();
+          strip->out.resize(used * 2);
+          zs.next_out = &strip->out[used];
+          zs.avail_out = strip->out.size() - used;
+        }
+        ok = deflate(&zs, Z_NO_FLUSH) == Z_OK;
+      }
+    }
+  }
+
+  while (ok) {
+    int err;
+    if (zs.avail_out == 0) {
+      size_t used = strip->out.size();
+      strip->out.resize(used * 2);
+      zs.next_out = &strip->out[used];
+      zs.avail_out = strip->out.size() - used;
+    }
+    err = deflate(&zs, strip->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (strip->last ? err == Z_STREAM_END : (err == Z_OK && zs.avail_out > 0)) {
+      break;
+    }
+    ok = err == Z_OK || err == Z_BUF_ERROR;
+  }
+
+  strip->out.resize(strip->out.size() - zs.avail_out);
+  deflateEnd(&zs);
+  free(rows);
+  return ok;
+}
+
+bool
+PngEncoder::Output::write(const void *buf, size_t len) {
+  if (file != NULL) {
+    return fwrite(buf, 1, len, file) == len;
+  }
+  data->insert(data->end(), (const unsigned char *) buf, (const unsigned char *) buf + len);
+  return true;
+}
+
+void
+PngEncoder::writeData(png_structp png_ptr, png_bytep data, png_size_t len) {
+  if (!((Output *) png_get_io_ptr(png_ptr))->write(data, len)) {
+    png_error(png_ptr, "Write error");
+  }
+}
+
+void
+PngEncoder::flushData(png_structp png_ptr) {
+  Output *out = (Output *) png_get_io_ptr(png_ptr);
+  if (out->file != NULL) {
+    fflush(out->file);
+  }
+}
+
+bool
+PngEncoder::writeChunk(Output *out, const char *type, const unsigned char *data, size_t len) {
+  unsigned char head[8];
+  uLong crc;
+
+  head[0] = len >> 24;
+  head[1] = len >> 16;
+  head[2] = len >> 8;
+  head[3] = len;
+  memcpy(head + 4, type, 4);
+  crc = crc32(crc32(0L, Z_NULL, 0), head + 4, 4);
+  if (len > 0) {
+    crc = crc32(crc, data, len);
+  }
+  unsigned char tail[4] = { (unsigned char) (crc >> 24), (unsigned char) (crc >> 16), (unsigned char) (crc >> 8), (unsigned char) crc };
+
+  return out->write(head, 8) &&
+    (len == 0 || out->write(data, len)) &&
+    out->write(tail, 4);
+}
+
+// Compress horizontal strips on all threads, then write them as the IDAT
+// chunks of one zlib stream
+bool
+PngEncoder::encodeParallel(Output *out, const Image &image, unsigned int rowsPerStrip) {
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  unsigned int count = (image.height + rowsPerStrip - 1) / rowsPerStrip;
+  unsigned int threads = mThreads < count ? mThreads : count;
+  std::vector<Strip> strips(count);
+  std::vector<std::thread> workers;
+  std::atomic<unsigned int> next(0);
+  unsigned char ihdr[13], header[2], trailer[4];
+  uLong adler;
+  bool ok = true;
+
+  for (unsigned int s = 0; s < count; s++) {
+    strips[s].first = s * rowsPerStrip;
+    strips[s].rows = s + 1 < count ? rowsPerStrip : image.height - strips[s].first;
+    strips[s].last = s + 1 == count;
+    strips[s].ok = false;
+  }
+
+  auto work = [&]() {
+    unsigned int s;
+    while ((s = next++) < count) {
+      strips[s].ok = deflateStrip(image, &strips[s]);
+    }
+  };
+  for (unsigned int t = 1; t < threads; t++) {
+    workers.push_back(std::thread(work));
+  }
+  work();
+  for (auto &w : workers) {
+    w.join();
+  }
+
+  // zlib header for the level, see RFC 1950
+  header[0] = 0x78;
+  header[1] = (image.level < 2 ? 0 : image.level < 6 ? 1 : image.level == 6 ? 2 : 3) << 6;
+  header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+
+  adler = adler32(0L, Z_NULL, 0);
+  for (unsigned int s = 0; s < count; s++) {
+    ok = ok && strips[s].ok;
+    adler = adler32_combine(adler, strips[s].adler, (z_off_t) strips[s].rows * (image.width * 3 + 1));
+  }
+  if (!ok) {
+    LOGE("Could not compress PNG");
+    return false;
+  }
+  trailer[0] = adler >> 24;
+  trailer[1] = adler >> 16;
+  trailer[2] = adler >> 8;
+  trailer[3] = adler;
+
+  ihdr[0] = image.width >> 24;
+  ihdr[1] = image.width >> 16;
+  ihdr[2] = image.width >> 8;
+  ihdr[3] = image.width;
+  ihdr[4] = image.height >> 24;
+  ihdr[5] = image.height >> 16;
+  ihdr[6] = image.height >> 8;
+  ihdr[7] = image.height;
+  ihdr[8] = 8;                    // bit depth
+  ihdr[9] = PNG_COLOR_TYPE_RGB;
+  ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+  ihdr[11] = PNG_FILTER_TYPE_BASE;
+  ihdr[12] = PNG_INTERLACE_NONE;
+
+  ok = out->write(signature, 8) &&
+    writeChunk(out, "IHDR", ihdr, 13) &&
+    writeChunk(out, "IDAT", header, 2);
+  for (unsigned int s = 0; ok && s < count; s++) {
+    ok = writeChunk(out, "IDAT", &strips[s].out[0], strips[s].out.size());
+  }
+  ok = ok && writeChunk(out, "IDAT", trailer, 4) &&
+    writeChunk(out, "IEND", NULL, 0);
+
+  if (!ok) {
+    LOGE("Could not write PNG");
+  }
+  return ok;
+}
+
+bool
+PngEncoder::encodeSerial(Output *out, const Image &image) {
+  png_structp png_ptr;
+  png_infop info_ptr;
+  // 4 byte pixels go to libpng as they are, which drops the fourth byte
+  bool direct = image.bpp == 4;
+
+  if (!direct && !reserveRow(image.width)) {
+    LOGE("Could not allocate PNG row");
+    return false;
+  }
+
+  if ((png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) {
+    LOGE("Could not create PNG");
+    return false;
+  }
+
+  if ((info_ptr = png_create_info_struct(png_ptr)) == NULL) {
+    png_destroy_write_struct(&png_ptr, NULL);
+    LOGE("Could not create PNG (2)");
+    return false;
+  }
+
+  // libpng jumps back here if writing fails, e.g. when a screenshot
+  // client goes away halfway through
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    LOGE("Could not write PNG");
+    return false;
+  }
+
+  png_set_write_fn(png_ptr, out, writeData, flushData);
+  png_set_compression_level(png_ptr, image.level);
+  png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, image.filters);
+  png_set_IHDR(png_ptr, info_ptr, image.width, image.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  if (direct) {
+    png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+    if (image.format == Minicap::FORMAT_BGRA_8888) {
+      png_set_bgr(png_ptr);
+    }
+  }
+
+  for (unsigned int i = 0; i < image.height; i++) {
+    unsigned char *row = image.data + (size_t) i * image.stride * image.bpp;
+    if (!direct) {
+      convertRowToRgb(mRow, row, image.width, image.bpp, image.format);
+      row = mRow;
+    }
+    png_write_row(png_ptr, row);
+  }
+
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  return true;
+}
+
+bool
+PngEncoder::encode(Output *out, const Image &image) {
+  unsigned int rowsPerStrip = PNG_STRIP_BYTES / (image.width * 3 + 1) + 1;
+
+  if (image.bpp != 1 && image.bpp != 2 && image.bpp != 4 && image.bpp != 8) {
+    LOGE("Unsupported bpp for PNG: %d", image.bpp);
+    return false;
+  }
+
+  if (mThreads > 1 && image.height >= PNG_MIN_STRIPS * rowsPerStrip) {
+    return encodeParallel(out, image, rowsPerStrip);
+  }
+  return encodeSerial(out, image);
+}
+
+bool
+PngEncoder::encode(FILE *f, unsigned char *data, unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format, int level, int filters) {
+  Image image = { data, width, height, stride, bpp, format, level, filters };
+  Output out = { f, NULL };
+
+  return encode(&out, image) && !ferror(f);
+}
+
+bool
+PngEncoder::encode(std::vector<unsigned char> *data, unsigned char *pixels, unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format, int level, int filters) {
+  Image image = { pixels, width, height, stride, bpp, format, level, filters };
+  Output out = { NULL, data };
+
+  return encode(&out, image);
+}
@@ -0,0 +1,66 @@
+#ifndef DROIDVNCSERVER_PNG_ENCODER_HPP
+#define DROIDVNCSERVER_PNG_ENCODER_HPP
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "png.h"
+#include "Minicap.hpp"
+
+class PngEncoder {
+public:
+  // threads: how many strips to compress at once, 0 for one per CPU
+  PngEncoder(unsigned int threads = 0);
+
+  ~PngEncoder();
+
+  // Write width x height pixels of data, stride pixels apart, to f as an
+  // 8 bit RGB PNG. level is the zlib level (0-9), filters a PNG_FILTER_*
+  // mask for the row filters that may be chosen from.
+  bool encode(FILE *f, unsigned char *data, unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format, int level, int filters);
+
+  // The same, appending the PNG to out
+  bool encode(std::vector<unsigned char> *out, unsigned char *data, unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format, int level, int filters);
+
+private:
+  struct Image;
+  struct Strip;
+
+  // Where the PNG goes, a file or memory
+  struct Output {
+    FILE *file;
+    std::vector<unsigned char> *data;
+
+    bool write(const void *buf, size_t len);
+  };
+
+  unsigned char* mRow;
+  unsigned int mRowSize;
+  unsigned int mThreads;
+
+  bool reserveRow(unsigned int width);
+
+  static void
+  writeData(png_structp png_ptr, png_bytep data, png_size_t len);
+
+  static void
+  flushData(png_structp png_ptr);
+
+  static bool
+  writeChunk(Output *out, const char *type, const unsigned char *data, size_t len);
+
+  bool encode(Output *out, const Image &image);
+
+  bool encodeSerial(Output *out, const Image &image);
+
+  bool encodeParallel(Output *out, const Image &image, unsigned int rowsPerStrip);
+
+  static bool
+  deflateStrip(const Image &image, Strip *strip);
+
+  static void
+  filterRow(unsigned char *out, unsigned char *scratch, const unsigned char *row, const unsigned char *prev, unsigned int rowBytes, int filters);
+};
+
+#endif
@@ -17,19 +17,31 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <limits.h>
 #include <signal.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "droidvncserver.hpp"
 #include "rotation_watcher.hpp"
 #include "update_screen.hpp"
-#include "png.h"
 
 #include "rfb/keysym.h"
 #include "libvncserver/scale.h"
 #include "Minicap.hpp"
 #include "JpgEncoder.hpp"
+#include "PngEncoder.hpp"
+#include "pixel_convert.hpp"
+#include "FrameRecorder.hpp"
 
 #define ROT_0 (1 << 0)
 #define ROT_90 (1 << 1)
@@ -37,11 +49,15 @@
 #define ROT_270 (1 << 3)
 #define ROT_ALL (ROT_0 | ROT_90 | ROT_180 | ROT_270)
 
-#define PID_FILE "/data/local/tmp/vnc.pid"
-
-#define SCREENSHOT_PNG_RGBA_WHEN_CONVENIENT 0
 #define SCREENSHOT_JPG_QUALITY 80
-#define SCREENSHOT_SIGNAL_FILE "/data/local/tmp/screen.png"
+#define SCREENSHOT_PNG_LEVEL 3
+#define SCREENSHOT_PNG_FILTERS PNG_ALL_FILTERS
+#define SCREENSHOT_FAST_FILE "/data/local/tmp/screen.png"
+#define SCREENSHOT_SOCKET "@androidvncserver-screenshot"
+#define SCREENSHOT_TIMEOUT 4 // seconds
+#define SCREENSHOT_SHELL_UID 2000 // AID_SHELL, adb shell
+#define SCREENSHOT_BURST_BUFFERS 2 // captured frames queued per burst encoder thread
+#define SCREENSHOT_CACHE_ENTRIES 4 // encoded screenshots kept by the screenshot service
 
 // Configurables
 static int serverPort = 5901; // Android already has 5900 bound natively in some devices.
@@ -56,12 +72,40 @@ static int desiredBpp = -1;
 static char *screenshotFile = NULL;
 static bool screenshotFast = false;
 static bool screenshotSkipFrame = false;
+static int screenshotCount = 1;
+static int screenshotInterval = 0; // ms between burst screenshots, 0 for every frame
+static char *screenshotRegion = NULL; // -C, as for region= below
+static char *screenshotSize = NULL;   // -T, as for size= below
+static int latencyInterval = 0; // seconds between latency reports, 0 for none
+static char *recordFile = NULL; // -W, recording of the published frames
+static char *replayFile = NULL; // -F, recording to serve instead of the screen
+
+// Held while the capture loop writes to or resizes the framebuffer
+static std::mutex screenMutex;
+// Bumped under screenMutex whenever the capture loop writes the framebuffer
+static uint64_t screenGeneration = 0;
+
+// The encoders for one screenshot at a time, kept so that repeated
+// screenshots reuse their buffers
+struct ScreenshotEncoder {
+    JpgEncoder jpg;
+    PngEncoder png;
+    std::vector<unsigned char> thumbnail;
+
+    ScreenshotEncoder(unsigned int pngThreads = 0)
+        : jpg(4, 0),
+          png(pngThreads) {
+    }
+};
+
+static ScreenshotEncoder screenshotEncoder;
 
 // Screen info
 static fb_var_screeninfo screenInfo;
 static int screenWidth = 0, screenHeight = 0;
 static int screenRotation; // Current screen rotation
 static int imageRotation; // Required frame rotation
+static bool captureScaled = false; // true if minicap already delivers frames at the -s size
 
 // shared VNC buffers and screen
 Minicap::Frame frame;
@@ -69,6 +113,9 @@ rfbScreenInfoPtr vncscr;
 // unsigned char *cmpbuf;
 unsigned char *vncbuf;
 
+// Records the published frames for -W
+static FrameRecorder recorder;
+
 // Reverse connection
 static char *rhost = NULL;
 static int rport = 5500;
@@ -89,6 +136,11 @@ void print(int logPriority, FILE* stream, const char *format, ...) {
     fprintf(stream, "\n");
 }
 
+static unsigned int scaleDimension(unsigned int size)
+{
+    return (unsigned int) (size * scaling / 100.0 + 0.5);
+}
+
 static void onClientGone(rfbClientPtr cl)
 {
     LOGD("onClientGone: Client disconnected");
@@ -97,10 +149,8 @@ static void onClientGone(rfbClientPtr cl)
 static rfbNewClientAction onClientConnect(rfbClientPtr cl)
 {
     LOGD("onClientConnect: New client connection");
-    if (scaling != 100) {
-        unsigned int scaledWidth = (unsigned int) (vncscr->width * scaling / 100.0 + 0.5);
-        unsigned int scaledHeight = (unsigned int) (vncscr->height * scaling / 100.0 + 0.5);
-        rfbScalingSetup(cl, scaledWidth, scaledHeight);
+    if (scaling != 100 && !captureScaled) {
+        rfbScalingSetup(cl, scaleDimension(vncscr->width), scaleDimension(vncscr->height));
     }
 
     // cl->enableSupportedEncodings = TRUE;
@@ -125,17 +175,22 @@ static void reinitVncServer(int width, int height, int stride, int bpp) {
     }
 
     if (vncscr->width != targetWidth || vncscr->height != targetHeight) {
-        unsigned int scaledWidth = (unsigned int) (targetWidth * scaling / 100.0 + 0.5);
-        unsigned int scaledHeight = (unsigned int) (targetHeight * scaling / 100.0 + 0.5);
+        // Resize the screen first, so that clients without libvncserver
+        // scaling find it again and just get told about the new size
+        vncscr->width = targetWidth;
+        vncscr->height = targetHeight;
+        vncscr->paddedWidthInBytes = targetWidth * bpp;
+
+        unsigned int scaledWidth = captureScaled ? targetWidth : scaleDimension(targetWidth);
+        unsigned int scaledHeight = captureScaled ? targetHeight : scaleDimension(targetHeight);
         rfbClientIteratorPtr iterator = rfbGetClientIterator(vncscr);
         rfbClientPtr cl;
         while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
-            rfbScalingSetup(cl, scaledWidth, scaledHeight);
+            // Clients that picked their own size through SetDesktopSize keep it
+            if (!cl->clientDesktopSize)
+                rfbScalingSetup(cl, scaledWidth, scaledHeight);
         }
-        
-        vncscr->width = targetWidth;
-        vncscr->height = targetHeight;
-        vncscr->paddedWidthInBytes = targetWidth * bpp;
+        rfbReleaseClientIterator(iterator);
     }
 }
 
@@ -162,6 +217,8 @@ static void initVncServer(int argc, char **argv, unsigned int width, unsigned in
     
     vncscr->bitsPerPixel = bpp * 8;
     vncscr->deferUpdateTime = 5; // 5ms
+    // hold back updates to a slow client while about one raw frame is still unsent
+    vncscr->sendQueueLimit = targetWidth * targetHeight * bpp;
     vncscr->port = serverPort;
     vncscr->desktopName = (char *) "Android";
     vncscr->frameBuffer =(char *) vncbuf;
@@ -247,15 +304,9 @@ void cleanup(int exitCode) {
     bool isServer = screenshotFile == NULL;
 
     LOGD("Cleaning up...");
-    
-    // Deleting the server PID file could be added here, but that would cause
-    // unnecessary activity on the flash memory. Leaving it is fine and would not
-    // affect screenshot signalling behavior as the kill() call will fail.
-    // if (isServer) {
-    //     deleteServerPid();
-    // }
-    
+
     stop_rotation_watcher();
+    recorder.close();
 
     if (minicap) {
         if (isServer) {
@@ -371,6 +422,7 @@ public:
     FrameWaiter()
         : mTimeout(std::chrono::milliseconds(100)),
           mPendingFrames(0),
+          mTakenAt(0),
           mStopped(false) {
     }
 
@@ -378,6 +430,7 @@ public:
         std::unique_lock<std::mutex> lock(mMutex);
         while (!mStopped) {
             if (mCondition.wait_for(lock, mTimeout, [this]{return mPendingFrames > 0;})) {
+                takeFrames(1);
                 return mPendingFrames--;
             }
         }
@@ -385,9 +438,21 @@ public:
         return 0;
     }
 
+    // waitForFrame(), but giving up at deadline
+    int waitForFrameUntil(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (mCondition.wait_until(lock, deadline, [this]{return mPendingFrames > 0;})) {
+            takeFrames(1);
+            return mPendingFrames--;
+        }
+
+        return 0;
+    }
+
     void
     reportExtraConsumption(int count) {
         std::unique_lock<std::mutex> lock(mMutex);
+        takeFrames(count);
         mPendingFrames -= count;
     }
 
@@ -395,6 +460,7 @@ public:
     onFrameAvailable() {
         std::unique_lock<std::mutex> lock(mMutex);
         mPendingFrames += 1;
+        mAvailableAt.push_back(rfbLatencyClock());
         mCondition.notify_one();
     }
 
@@ -402,9 +468,17 @@ public:
     getPendingFrames() {
         std::unique_lock<std::mutex> lock(mMutex);
         if (!mPendingFrames) return 0;
+        takeFrames(1);
         return mPendingFrames--;
     }
 
+    // When the frame last taken with one of the above became available
+    uint64_t
+    getFrameAvailableAt() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        return mTakenAt;
+    }
+
     void
     stop() {
         mStopped = true;
@@ -416,10 +490,20 @@ public:
     }
 
 private:
+    void
+    takeFrames(int count) {
+        while (count-- > 0 && !mAvailableAt.empty()) {
+            mTakenAt = mAvailableAt.front();
+            mAvailableAt.pop_front();
+        }
+    }
+
     std::mutex mMutex;
     std::condition_variable mCondition;
     std::chrono::milliseconds mTimeout;
     int mPendingFrames;
+    std::deque<uint64_t> mAvailableAt; // one rfbLatencyClock() per pending frame
+    uint64_t mTakenAt;
     bool mStopped;
 };
 
@@ -429,6 +513,14 @@ static void resetMinicapOrientation() {
     realInfo.height = desiredInfo.height = screenHeight;
     desiredInfo.orientation = screenRotation / 90;
 
+    // Let the capture source do the -s scaling, so every later stage
+    // works on the smaller frame. -S screenshots are taken unscaled, but the
+    // screenshot service (-U) shares the server's frame and so its size.
+    if (scaling != 100 && screenshotFile == NULL) {
+        desiredInfo.width = scaleDimension(screenWidth);
+        desiredInfo.height = scaleDimension(screenHeight);
+    }
+
     minicap->setRealInfo(realInfo);
 
     if (minicap->setDesiredInfo(desiredInfo) != 0)
@@ -458,234 +550,869 @@ static void printUsage(char **argv)
       "Server options:\n"
       "  -p <password>\t\t\t Password to access server\n"
       "  -e <encrypted password file>\t Use encrypted password file\n"
-      "  -P <port>\t\t\t Server port\n"      
-      "  -R <host:port>\t\t Host for reverse connection\n\n"
+      "  -P <port>\t\t\t Server port (0 for no TCP listener)\n"      
+      "  -unixsock <path>\t\t Also listen on a Unix socket ('@name' for an abstract\n"
+      "                  \t\t socket, e.g. for adb forward tcp:5901 localabstract:name)\n"
+      "  -R <host:port>\t\t Host for reverse connection\n"
+      "  -notsentlowat <bytes>\t\t Keep at most this many unsent bytes in the kernel\n"
+      "  -tcpcork\t\t\t Only send full TCP segments while writing an update\n"
+      "  -autosndbuf\t\t\t Size socket send buffers from the measured bandwidth-delay product\n"
+      "  -L <seconds>\t\t\t Log p50/p99/max latency of every stage this often\n\n"
       "Display options:\n"
       "  -d <width> <height>\t\t Specify screen dimensions\n"
       "  -r <rotation>\t\t\t Force screen rotation (degrees) (0, 90, 180, 270)\n"
       "  -o <orientation>\t\t Force screen orientation (landscape, portrait)\n"
       "  -z\t\t\t\t Rotate display another 180 degrees (for ZTE compatibility)\n"
       "  -s <scale>\t\t\t Scale percentage (0-100)\n"
+      "  -interp <filter>\t\t Filter for scaled clients (area, bilinear, lanczos2)\n"
       "  -b <bpp>\t\t\t Screen bytes per pixel (1, 2, 4, 8)\n"
-      "  -f\t\t\t\t Enable frame skipping\n\n"
+      "  -f\t\t\t\t Enable frame skipping\n"
+      "  -W <filename>\t\t\t Record the published frames to file\n"
+      "  -F <filename>\t\t\t Serve a -W recording instead of the screen\n\n"
       "Other options:\n"
       "  -S <filename>\t\t\t Write JPEG or PNG screenshot to file and quit\n"
-      "  -U \t\t\t Try to take screenshot using existing VNC server\n"
-      "     \t\t\t (Saves to " SCREENSHOT_SIGNAL_FILE ")\n"
+      "  -U \t\t\t Try to take screenshot using existing VNC server (at its -s size)\n"
+      "     \t\t\t (Saves to -S <filename> or " SCREENSHOT_FAST_FILE ")\n"
       "  -X \t\t\t Skip first frame when saving screenshot (for some Motorola devices)\n"
+      "  -C <x,y,width,height>\t Only write this region of the screen\n"
+      "  -T <width>x<height>\t\t Shrink the screenshot to a thumbnail (0 keeps the aspect ratio)\n"
+      "  -N <count>\t\t\t Write count screenshots, as <filename>-0001.png etc. or\n"
+      "            \t\t\t one MJPEG stream if <filename> ends in .mjpeg\n"
+      "  -I <ms>\t\t\t Interval between -N screenshots (default 0: every new frame)\n"
       "  -v\t\t\t\t Output version\n"
       "  -h\t\t\t\t Print this help\n", argv[0]);
 }
 
-static void writeScreenToFile(char *filename, int screenBpp) {
-    int targetWidth, targetHeight;
-    FILE *f;
-    
+// What to encode a screenshot as, and which part of the screen
+struct ScreenshotRequest {
+    bool png;
+    int quality; // JPEG quality
+    int level;   // PNG zlib level
+    int filters; // PNG_FILTER_* mask for the PNG row filters
+    int x, y, width, height; // width and height are -1 for "up to the edge"
+    int outWidth, outHeight; // size to shrink the region to, 0 to keep the aspect ratio
+};
+
+static void initScreenshotRequest(ScreenshotRequest *req, bool png) {
+    req->png = png;
+    req->quality = SCREENSHOT_JPG_QUALITY;
+    req->level = SCREENSHOT_PNG_LEVEL;
+    req->filters = SCREENSHOT_PNG_FILTERS;
+    req->x = req->y = 0;
+    req->width = req->height = -1;
+    req->outWidth = req->outHeight = 0;
+}
+
+static bool parseScreenshotRequest(char *line, ScreenshotRequest *req);
+
+// The request line for the screenshot options given on the command line
+static void formatScreenshotRequest(char *line, size_t size, bool png) {
+    snprintf(line, size, "format=%s%s%s%s%s\n", png ? "png" : "jpg",
+             screenshotRegion ? " region=" : "", screenshotRegion ? screenshotRegion : "",
+             screenshotSize ? " size=" : "", screenshotSize ? screenshotSize : "");
+}
+
+static void getScreenshotOptions(ScreenshotRequest *req, const char *filename) {
+    char line[256];
+
+    formatScreenshotRequest(line, sizeof(line), strstr(filename, ".png") != NULL);
+    if (!parseScreenshotRequest(line, req))
+        FATAL("Invalid screenshot region or size");
+}
+
+// Fill in the region and output size of req for a width x height screen,
+// false if the region doesn't fit
+static bool resolveScreenshotRequest(ScreenshotRequest *req, int width, int height) {
+    if (req->width < 0) {
+        req->width = width - req->x;
+        req->height = height - req->y;
+    }
+    if (req->width <= 0 || req->height <= 0 || req->x + req->width > width || req->y + req->height > height)
+        return false;
+
+    if (req->outWidth == 0 && req->outHeight == 0) {
+        req->outWidth = req->width;
+        req->outHeight = req->height;
+    } else if (req->outWidth == 0) {
+        req->outWidth = std::max(1, (int) ((long long) req->width * req->outHeight / req->height));
+    } else if (req->outHeight == 0) {
+        req->outHeight = std::max(1, (int) ((long long) req->height * req->outWidth / req->width));
+    }
+    // Thumbnails only ever shrink
+    req->outWidth = std::min(req->outWidth, req->width);
+    req->outHeight = std::min(req->outHeight, req->height);
+    return true;
+}
+
+// Shrink the screenshot in buf to req's output size into enc->thumbnail
+static bool scaleScreenshot(ScreenshotEncoder *enc, const ScreenshotRequest &req, unsigned char **buf, int *width, int *height,
+                            int *stride, int *screenBpp, Minicap::Format *format) {
+    if (req.outWidth <= 0 || (req.outWidth == *width && req.outHeight == *height))
+        return true;
+
+    enc->thumbnail.resize((size_t) req.outWidth * req.outHeight * 4);
+    if (!scaleArea(&enc->thumbnail[0], req.outWidth, req.outHeight, *buf, *width, *height, *stride, *screenBpp, *format)) {
+        LOGE("Could not scale screenshot to %dx%d", req.outWidth, req.outHeight);
+        return false;
+    }
+
+    *buf = &enc->thumbnail[0];
+    *width = *stride = req.outWidth;
+    *height = req.outHeight;
+    *screenBpp = 4;
+    *format = Minicap::FORMAT_RGBX_8888;
+    return true;
+}
+
+// JPEG encode width x height pixels of buf, stride pixels apart, into enc->jpg
+static bool encodeJpgScreenshot(ScreenshotEncoder *enc, const ScreenshotRequest &req, unsigned char *buf, int width, int height,
+                                int stride, int screenBpp, Minicap::Format format) {
+    if (!scaleScreenshot(enc, req, &buf, &width, &height, &stride, &screenBpp, &format))
+        return false;
+
+    if (!JpgEncoder::isSupported(screenBpp, format)) {
+        LOGE("JPEG screenshots not supported for format %d at %d bytes per pixel", format, screenBpp);
+        return false;
+    }
+
+    if (!enc->jpg.reserveData(width, height)) {
+        LOGE("Could not reserve data for screenshot");
+        return false;
+    }
+
+    LOGD("Encoding..");
+    try {
+        if (!enc->jpg.encode(buf, width, height, stride, screenBpp, format, req.quality)) {
+            LOGE("Could not encode screenshot");
+            return false;
+        }
+    } catch (const std::exception &e) {
+        LOGE("Could not encode screenshot: %s", e.what());
+        return false;
+    }
+
+    if (!enc->jpg.getEncodedSize()) {
+        LOGE("Could not get encoded screenshot");
+        return false;
+    }
+    return true;
+}
+
+// Encode width x height pixels of buf, stride pixels apart, to f as req asks
+static bool writeScreenshot(ScreenshotEncoder *enc, FILE *f, const ScreenshotRequest &req, unsigned char *buf, int width,
+                            int height, int stride, int screenBpp, Minicap::Format format) {
+    if (req.png) {
+        if (!scaleScreenshot(enc, req, &buf, &width, &height, &stride, &screenBpp, &format))
+            return false;
+
+        LOGD("Writing..");
+        if (!enc->png.encode(f, buf, width, height, stride, screenBpp, format, req.level, req.filters))
+            return false;
+    } else {
+        if (!encodeJpgScreenshot(enc, req, buf, width, height, stride, screenBpp, format))
+            return false;
+
+        fwrite(enc->jpg.getEncodedData(), sizeof(char), enc->jpg.getEncodedSize(), f);
+    }
+
+    return !ferror(f);
+}
+
+// Encode width x height pixels of buf, stride pixels apart, into out as req asks
+static bool encodeScreenshot(ScreenshotEncoder *enc, std::vector<unsigned char> *out, const ScreenshotRequest &req,
+                             unsigned char *buf, int width, int height, int stride, int screenBpp, Minicap::Format format) {
+    out->clear();
+    if (req.png) {
+        if (!scaleScreenshot(enc, req, &buf, &width, &height, &stride, &screenBpp, &format))
+            return false;
+
+        LOGD("Writing..");
+        return enc->png.encode(out, buf, width, height, stride, screenBpp, format, req.level, req.filters);
+    }
+
+    if (!encodeJpgScreenshot(enc, req, buf, width, height, stride, screenBpp, format))
+        return false;
+
+    out->assign(enc->jpg.getEncodedData(), enc->jpg.getEncodedData() + enc->jpg.getEncodedSize());
+    return true;
+}
+
+// Size of the rotated screen in vncbuf
+static void getScreenshotSize(int *width, int *height) {
     if (forcedRotation && (imageRotation == 90 || imageRotation == 270)) {
-        targetWidth = frame.height;
-        targetHeight = frame.width;
+        *width = frame.height;
+        *height = frame.width;
     } else {
-        targetWidth = frame.width;
-        targetHeight = frame.height;
+        *width = frame.width;
+        *height = frame.height;
     }
+}
+
+// Write the frame to filename, converting only the part that is asked for
+static void writeScreenToFile(char *filename, int screenBpp) {
+    int targetWidth, targetHeight;
+    ScreenshotRequest req;
+    FILE *f;
+
+    getScreenshotOptions(&req, filename);
+    getScreenshotSize(&targetWidth, &targetHeight);
+    if (!resolveScreenshotRequest(&req, targetWidth, targetHeight))
+        FATAL("Screenshot region out of bounds");
+
+    copyScreenRegion(imageRotation, req.x, req.y, req.width, req.height);
 
     if ((f = fopen(filename, "w+")) == NULL)
         FATAL("Could not open screenshot file");
-    
-    if (strstr(filename, ".png") != NULL) {
-        png_structp png_ptr;
-        png_infop info_ptr;
-        png_byte **row_pointers;
-        png_byte *row;
 
-        // libpng with type PNG_COLOR_TYPE_RGB must have depth >= 8
-        int bitDepth = 8;
+    if (!writeScreenshot(&screenshotEncoder, f, req, vncbuf, req.width, req.height, req.width, screenBpp, frame.format))
+        FATAL("Could not write screenshot");
 
-        if ((png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL)
-            FATAL("Could not create PNG");
+    if (fclose(f))
+        FATAL("Could not close screenshot file");
 
-        if ((info_ptr = png_create_info_struct(png_ptr)) == NULL)
-            FATAL("Could not create PNG (2)");
+    LOGD("Wrote %s screenshot: %s", req.png ? "PNG" : "JPEG", filename);
+}
 
-        LOGD("Writing..");
-#if SCREENSHOT_PNG_RGBA_WHEN_CONVENIENT
-        if (screenBpp == 4) { // bitDepth * 4 / 8 = 4
-            // Enable this to use 32-bit color RGBA color in order to memcpy the whole row
-            png_set_IHDR(png_ptr, info_ptr, targetWidth, targetHeight, bitDepth, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-            row_pointers = (png_byte **) png_malloc(png_ptr, targetHeight * sizeof(png_byte *));
-            for (int i = 0; i < targetHeight; i++) {
-                row = (png_byte *) png_malloc(png_ptr, sizeof(png_byte) * targetWidth * screenBpp);
-                row_pointers[i] = row;
-                memcpy((char *) row, &((char *)vncbuf)[targetWidth * i * screenBpp], targetWidth * screenBpp);
-                // row_pointers[i] = (png_byte *) &((char *)vncbuf)[targetWidth * i * screenBpp];
-            }
+/*
+ * Burst screenshots (-S with -N). The capture loop converts frames into
+ * the free buffers of a small pool and queues them, encoder threads write
+ * them out as numbered files or, for a .mjpeg file, in order into one
+ * stream of concatenated JPEGs. When every buffer is still waiting to be
+ * encoded the frame is skipped instead of holding up the capture.
+ */
+class ScreenshotBurst {
+public:
+    ScreenshotBurst(const char *filename, const ScreenshotRequest &req, int screenBpp, size_t bufferSize)
+        : mReq(req),
+          mScreenBpp(screenBpp),
+          mFormat(frame.format),
+          mBufferSize(bufferSize),
+          mBuffers(0),
+          mStream(NULL),
+          mSubmitted(0),
+          mWritten(0),
+          mDone(false),
+          mOk(true) {
+        const char *ext = strrchr(filename, '.');
+        unsigned int threads = std::thread::hardware_concurrency();
+
+        if (ext == NULL || strchr(ext, '/') != NULL)
+            ext = filename + strlen(filename);
+        mBase.assign(filename, ext - filename);
+        mExt = ext;
+
+        if (!strcmp(ext, ".mjpeg") || !strcmp(ext, ".mjpg")) {
+            if ((mStream = fopen(filename, "w")) == NULL)
+                FATAL("Could not open screenshot file");
+        }
+
+        if (threads < 1)
+            threads = 1;
+        mMaxBuffers = threads * SCREENSHOT_BURST_BUFFERS + 1;
+        for (unsigned int i = 0; i < threads; i++)
+            mThreads.push_back(std::thread(&ScreenshotBurst::run, this));
+    }
+
+    ~ScreenshotBurst() {
+        finish();
+        for (unsigned char *buf : mFree)
+            free(buf);
+    }
+
+    // A buffer for the next screenshot, or NULL if all are busy
+    unsigned char *acquire() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        unsigned char *buf;
+
+        if (!mFree.empty()) {
+            buf = mFree.back();
+            mFree.pop_back();
+        } else if (mBuffers < mMaxBuffers && (buf = (unsigned char *) malloc(mBufferSize)) != NULL) {
+            mBuffers++;
         } else {
-#endif
-            // Use 24-bit color
-            png_set_IHDR(png_ptr, info_ptr, targetWidth, targetHeight, bitDepth, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-            row_pointers = (png_byte **) png_malloc(png_ptr, targetHeight * sizeof(png_byte *));
-            for (int i = 0; i < targetHeight; i++) {
-                row = (png_byte *) png_malloc(png_ptr, sizeof(uint8_t) * targetWidth * bitDepth);
-                row_pointers[i] = row;
-                // TODO: optimize 
-                if (screenBpp == 1) {
-                    // Assume RGB 332, convert to 8 bit depth
-                    uint8_t pixel;
-                    for (int j = 0; j < targetWidth; j++) {
-                        pixel = ((uint8_t *)vncbuf)[i * targetWidth + j];
-                        *row++ = (pixel & 3) << 6;
-                        *row++ = ((pixel >> 2) & 7) << 5;
-                        *row++ = pixel & (7 << 5);
-                    }
-                } else if (screenBpp == 2) {
-                    // Assume RGB 565, convert to 8 bit depth
-                    uint16_t pixel;
-                    for (int j = 0; j < targetWidth; j++) {
-                        pixel = ((uint16_t *)vncbuf)[i * targetWidth + j];
-                        *row++ = (pixel & 31) << 3;
-                        *row++ = ((pixel >> 5) & 63) << 2;
-                        *row++ = ((pixel >> 11) & 31) << 3;
-                    }
-                } else if (screenBpp == 4) {
-                    // Assume RGBA 8888
-                    // TODO: BGRA 8888 support
-                    uint32_t pixel;
-                    for (int j = 0; j < targetWidth; j++) {
-                        pixel = ((uint32_t *)vncbuf)[i * targetWidth + j];
-                        *row++ = (pixel & 255);
-                        *row++ = (pixel >> 8) & 255;
-                        *row++ = (pixel >> 16) & 255;
-                    }
-                } else if (screenBpp == 8) {
-                    uint64_t pixel;
-                    for (int j = 0; j < targetWidth; j++) {
-                        pixel = ((uint64_t *)vncbuf)[i * targetWidth + j];
-                        *row++ = (pixel >> 8) & 255;
-                        *row++ = (pixel >> 24) & 255;
-                        *row++ = (pixel >> 40) & 255;
-                    }
+            buf = NULL;
+        }
+        return buf;
+    }
+
+    // Queue an acquired buffer holding the width x height region
+    void submit(unsigned char *buf, int width, int height) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Shot shot = { buf, width, height, mSubmitted++ };
+
+        mQueue.push_back(shot);
+        // all, the same condition orders the MJPEG writes
+        mCondition.notify_all();
+    }
+
+    // Wait for everything queued to be written
+    bool finish() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mDone = true;
+            mCondition.notify_all();
+        }
+        for (std::thread &t : mThreads)
+            t.join();
+        mThreads.clear();
+
+        if (mStream != NULL) {
+            if (fclose(mStream))
+                mOk = false;
+            mStream = NULL;
+        }
+        return mOk;
+    }
+
+private:
+    struct Shot {
+        unsigned char *buf;
+        int width, height;
+        int index;
+    };
+
+    void run() {
+        ScreenshotEncoder enc(1); // one frame per thread already keeps the CPUs busy
+        char name[PATH_MAX];
+        Shot shot;
+        bool ok;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]{ return mDone || !mQueue.empty(); });
+                if (mQueue.empty())
+                    return;
+                shot = mQueue.front();
+                mQueue.pop_front();
+            }
+
+            if (mStream != NULL) {
+                ok = encodeJpgScreenshot(&enc, mReq, shot.buf, shot.width, shot.height, shot.width, mScreenBpp, mFormat);
+
+                // The stream takes the frames in capture order
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this, &shot]{ return mWritten == shot.index; });
+                if (ok)
+                    ok = fwrite(enc.jpg.getEncodedData(), 1, enc.jpg.getEncodedSize(), mStream) ==
+                         (size_t) enc.jpg.getEncodedSize();
+                mWritten++;
+                mCondition.notify_all();
+            } else {
+                FILE *f;
+
+                snprintf(name, sizeof(name), "%s-%04d%s", mBase.c_str(), shot.index + 1, mExt.c_str());
+                if ((ok = (f = fopen(name, "w")) != NULL)) {
+                    ok = writeScreenshot(&enc, f, mReq, shot.buf, shot.width, shot.height, shot.width, mScreenBpp, mFormat);
+                    ok = !fclose(f) && ok;
                 }
+                if (ok)
+                    LOGD("Wrote %s", name);
+            }
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!ok) {
+                LOGE("Could not write screenshot %d", shot.index + 1);
+                mOk = false;
             }
-#if SCREENSHOT_PNG_RGBA_WHEN_CONVENIENT                
+            mFree.push_back(shot.buf);
         }
-#endif
-        // Write the png
-        png_init_io(png_ptr, f);
-        // png_set_filter(png_ptr, 0, PNG_FILTER_NONE);
-        // png_set_filter(png_ptr, 0, PNG_FILTER_PAETH);
-        // png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-        png_set_compression_level(png_ptr, 3);
-        png_set_rows(png_ptr, info_ptr, row_pointers);
-        png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    }
 
-        for (int i = 0; i < targetHeight; i++)
-            png_free(png_ptr, row_pointers[i]);
+    ScreenshotRequest mReq;
+    int mScreenBpp;
+    Minicap::Format mFormat;
+    size_t mBufferSize;
+    unsigned int mBuffers, mMaxBuffers;
+    std::string mBase, mExt;
+    FILE *mStream;
 
-        png_free(png_ptr, row_pointers);
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Shot> mQueue;
+    std::vector<unsigned char *> mFree;
+    std::vector<std::thread> mThreads;
+    int mSubmitted, mWritten;
+    bool mDone, mOk;
+};
 
-        png_destroy_write_struct(&png_ptr, &info_ptr);
+// Take screenshotCount screenshots, starting with the frame already consumed
+static bool writeScreenBurst(FrameWaiter *waiter, int screenBpp) {
+    std::chrono::milliseconds interval(screenshotInterval);
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+    int width, height, taken = 0, skipped = 0;
+    ScreenshotRequest req;
+    bool ok;
+
+    getScreenshotOptions(&req, screenshotFile);
+    getScreenshotSize(&width, &height);
+    if (!resolveScreenshotRequest(&req, width, height))
+        FATAL("Screenshot region out of bounds");
+
+    ScreenshotBurst burst(screenshotFile, req, screenBpp, (size_t) req.width * req.height * frame.bpp);
+
+    while (taken < screenshotCount) {
+        if (screenshotInterval > 0) {
+            // Hold on to the newest frame until it's time, an unchanging
+            // screen sends no new frames
+            while (waiter->waitForFrameUntil(deadline) > 0) {
+                minicap->releaseConsumedFrame(&frame);
+                if (minicap->consumePendingFrame(&frame) != 0)
+                    FATAL("Could not read frame");
+            }
+            deadline += interval;
+        } else if (taken > 0 || skipped > 0) {
+            minicap->releaseConsumedFrame(&frame);
+            waiter->waitForFrame();
+            if (minicap->consumePendingFrame(&frame) != 0)
+                FATAL("Could not read frame");
+        }
 
-        if (ferror(f))
-            FATAL("Could not write screenshot");
+        if ((vncbuf = burst.acquire()) == NULL) {
+            skipped++;
+            continue;
+        }
+        copyScreenRegion(imageRotation, req.x, req.y, req.width, req.height);
+        burst.submit(vncbuf, req.width, req.height);
+        taken++;
+    }
 
-        if (fclose(f))
-            FATAL("Could not close screenshot file");
+    vncbuf = NULL;
+    minicap->releaseConsumedFrame(&frame);
+    minicap->setFrameAvailableListener(NULL);
 
-        LOGD("Wrote PNG screenshot: %s", filename);
-    } else {
-        JpgEncoder encoder(4, 0);
-        FILE *f;
-        unsigned int len;
+    ok = burst.finish();
+    if (skipped > 0)
+        LOGD("Skipped %d frames while the encoders were busy", skipped);
+    LOGD("Wrote %d %s screenshots: %s", taken, strstr(screenshotFile, ".png") != NULL ? "PNG" : "JPEG", screenshotFile);
+    return ok;
+}
 
-        if (!encoder.reserveData(targetWidth, targetHeight))
-            FATAL("Could not reserve data for screenshot");        
+/*
+ * Screenshot service. A client connects to SCREENSHOT_SOCKET and sends one
+ * line of space separated, optional parameters:
+ *
+ *     format=png|jpg quality=1..100 region=x,y,width,height
+ *     size=<width>x<height> level=0..9 filter=none|sub|up|avg|paeth|all
+ *
+ * quality applies to JPEG, the zlib level and row filter to PNG. size
+ * shrinks the region to a thumbnail, either dimension may be 0 to keep the
+ * aspect ratio. It gets back "OK <width> <height> <png|jpg>\n" followed by the encoded
+ * image up to the end of the stream, or "ERR <reason>\n". The service works on
+ * the server's frame, which -s shrinks: region is in its coordinates, and the
+ * OK line gives the size of the image actually sent. Requests are served
+ * one at a time on a worker thread, which copies the region out of the
+ * framebuffer and encodes it without holding up the capture loop.
+ *
+ * The last few encoded screenshots are kept with the frame generation and
+ * a hash of the region they were made from. A repeated request is answered
+ * from the cache without copying anything when no frame has come in since,
+ * or without encoding when the region still hashes the same.
+ *
+ * The socket lives in the abstract namespace, which has no permissions, so
+ * any app could connect to it. Only root, the shell and the server's own
+ * uid are served, everyone else has to go through the VNC password.
+ */
+
+struct CachedScreenshot {
+    ScreenshotRequest req; // resolved
+    int bpp;
+    Minicap::Format format;
+    uint64_t generation;   // screenGeneration the region was last seen at
+    uint64_t hash;         // of the region's pixels
+    unsigned int lastUsed;
+    std::vector<unsigned char> data;
+};
 
-        LOGD("Encoding..");
-        if (!encoder.encode(vncbuf, targetWidth, targetHeight, targetWidth, screenBpp, frame.format, SCREENSHOT_JPG_QUALITY))
-            FATAL("Could not encode screenshot");
+static int screenshotSock = -1;
+static CachedScreenshot screenshotCache[SCREENSHOT_CACHE_ENTRIES]; // service thread only
+static unsigned int screenshotCacheClock = 0;
 
-        len = encoder.getEncodedSize();
-        if (!len) 
-            FATAL("Could not get encoded screenshot");
+// A quick 64 bit hash, enough to tell whether pixels changed
+static uint64_t hashBytes(uint64_t hash, const unsigned char *data, size_t len) {
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t word;
 
-        fwrite(encoder.getEncodedData(), sizeof(char), len, f);
+    for (; len >= 8; data += 8, len -= 8) {
+        memcpy(&word, data, 8);
+        hash = (hash ^ word) * k;
+        hash ^= hash >> 29;
+    }
+    for (; len > 0; data++, len--)
+        hash = (hash ^ *data) * k;
+    return hash;
+}
 
-        if (ferror(f))
-            FATAL("Could not write screenshot");
+// The cache entry for req, or the one to replace (data empty) if there is none
+static CachedScreenshot *findCachedScreenshot(const ScreenshotRequest &req, int bpp, Minicap::Format format) {
+    CachedScreenshot *oldest = &screenshotCache[0];
+
+    for (CachedScreenshot &c : screenshotCache) {
+        const ScreenshotRequest &r = c.req;
+        if (!c.data.empty() && c.bpp == bpp && c.format == format && r.png == req.png &&
+            (req.png ? r.level == req.level && r.filters == req.filters : r.quality == req.quality) &&
+            r.x == req.x && r.y == req.y && r.width == req.width && r.height == req.height &&
+            r.outWidth == req.outWidth && r.outHeight == req.outHeight)
+            return &c;
+        if (c.data.empty() || (oldest->lastUsed > c.lastUsed && !oldest->data.empty()))
+            oldest = &c;
+    }
 
-        if (fclose(f))
-            FATAL("Could not close screenshot file");
+    oldest->data.clear();
+    oldest->req = req;
+    oldest->bpp = bpp;
+    oldest->format = format;
+    return oldest;
+}
 
-        LOGD("Wrote JPEG screenshot: %s", filename);
+static bool parseScreenshotRequest(char *line, ScreenshotRequest *req) {
+    char *save, *tok;
+
+    initScreenshotRequest(req, true);
+
+    for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (!strcmp(tok, "format=png")) {
+            req->png = true;
+        } else if (!strcmp(tok, "format=jpg") || !strcmp(tok, "format=jpeg")) {
+            req->png = false;
+        } else if (sscanf(tok, "quality=%d", &req->quality) == 1) {
+            if (req->quality < 1 || req->quality > 100)
+                return false;
+        } else if (sscanf(tok, "level=%d", &req->level) == 1) {
+            if (req->level < 0 || req->level > 9)
+                return false;
+        } else if (!strncmp(tok, "filter=", 7)) {
+            if (!strcmp(tok + 7, "none"))
+                req->filters = PNG_FILTER_NONE;
+            else if (!strcmp(tok + 7, "sub"))
+                req->filters = PNG_FILTER_SUB;
+            else if (!strcmp(tok + 7, "up"))
+                req->filters = PNG_FILTER_UP;
+            else if (!strcmp(tok + 7, "avg"))
+                req->filters = PNG_FILTER_AVG;
+            else if (!strcmp(tok + 7, "paeth"))
+                req->filters = PNG_FILTER_PAETH;
+            else if (!strcmp(tok + 7, "all"))
+                req->filters = PNG_ALL_FILTERS;
+            else
+                return false;
+        } else if (sscanf(tok, "size=%dx%d", &req->outWidth, &req->outHeight) == 2) {
+            if (req->outWidth < 0 || req->outHeight < 0 || (req->outWidth == 0 && req->outHeight == 0))
+                return false;
+        } else if (sscanf(tok, "region=%d,%d,%d,%d", &req->x, &req->y, &req->width, &req->height) == 4) {
+            if (req->x < 0 || req->y < 0 || req->width <= 0 || req->height <= 0)
+                return false;
+        } else {
+            return false;
+        }
     }
+    return true;
 }
 
-static void takeScreenshot(int signum, siginfo_t *siginfo, void *context) {
-    LOGD("Received signal, taking screenshot..");
-    writeScreenToFile((char *)SCREENSHOT_SIGNAL_FILE, vncscr->bitsPerPixel / 8);
-    
-    kill(siginfo->si_pid, SIGCONT);
-    LOGD("Screenshot completed and response was sent.");
+static void serveScreenshot(int sock) {
+    char line[256];
+    size_t len = 0;
+    ScreenshotRequest req;
+    std::vector<unsigned char> pixels;
+    CachedScreenshot *cached = NULL;
+    Minicap::Format format;
+    uint64_t generation, hash = 0;
+    int bpp;
+    bool jpgOk, hit = false;
+    FILE *f;
+
+    // Read the request line, the receive timeout keeps idle clients out
+    while (len < sizeof(line) - 1) {
+        ssize_t n = recv(sock, line + len, sizeof(line) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        if (memchr(line, '\n', len) != NULL)
+            break;
+    }
+    line[len] = 0;
+
+    if ((f = fdopen(sock, "w")) == NULL) {
+        close(sock);
+        return;
+    }
+
+    if (memchr(line, '\n', len) == NULL || !parseScreenshotRequest(line, &req)) {
+        fprintf(f, "ERR bad request\n");
+        fclose(f);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(screenMutex);
+
+        bpp = vncscr->bitsPerPixel / 8;
+        format = frame.format;
+        jpgOk = JpgEncoder::isSupported(bpp, format);
+        generation = screenGeneration;
+        if (resolveScreenshotRequest(&req, vncscr->width, vncscr->height) && (req.png || jpgOk)) {
+            cached = findCachedScreenshot(req, bpp, format);
+            hit = !cached->data.empty() && cached->generation == generation;
+            if (!hit) {
+                pixels.resize((size_t) req.width * req.height * bpp);
+                for (int y = 0; y < req.height; y++) {
+                    unsigned char *row = &pixels[(size_t) y * req.width * bpp];
+                    memcpy(row, vncbuf + (size_t) (req.y + y) * vncscr->paddedWidthInBytes + req.x * bpp,
+                           req.width * bpp);
+                    hash = hashBytes(hash, row, req.width * bpp);
+                }
+            }
+        }
+    }
+
+    if (cached == NULL) {
+        fprintf(f, (req.png || jpgOk) ? "ERR region out of bounds\n" : "ERR format not supported\n");
+        fclose(f);
+        return;
+    }
+
+    if (!hit && !cached->data.empty() && cached->hash == hash) {
+        // New frames, but not in this region
+        hit = true;
+    } else if (!hit) {
+        if (!encodeScreenshot(&screenshotEncoder, &cached->data, req, &pixels[0], req.width, req.height, req.width, bpp,
+                              format)) {
+            cached->data.clear();
+            fprintf(f, "ERR could not encode screenshot\n");
+            fclose(f);
+            return;
+        }
+        cached->hash = hash;
+    }
+    cached->generation = generation;
+    cached->lastUsed = ++screenshotCacheClock;
+
+    fprintf(f, "OK %d %d %s\n", req.outWidth, req.outHeight, req.png ? "png" : "jpg");
+    if (fwrite(&cached->data[0], 1, cached->data.size(), f) != cached->data.size() || fflush(f))
+        LOGE("Could not send screenshot");
+    fclose(f);
 }
 
-static void setupScreenshotSignalHandler() {
-    struct sigaction act;
-    memset(&act, 0x0, sizeof(struct sigaction));
-    act.sa_sigaction = &takeScreenshot;
-    act.sa_flags = SA_SIGINFO;
+// Whether the process at the other end of sock may take screenshots
+static bool screenshotPeerAllowed(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
 
-    if (sigaction(SIGCONT, &act, NULL) < 0)
-        FATAL("Could not setup screenshot signal handler");
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        LOGE("Could not get screenshot client credentials: %s", strerror(errno));
+        return false;
+    }
+    if (cred.uid == 0 || cred.uid == SCREENSHOT_SHELL_UID || cred.uid == getuid())
+        return true;
+    LOGE("Refused screenshot request from uid %d", (int) cred.uid);
+    return false;
 }
 
-static int writeServerPid() {
-    FILE *f;
-    if ((f = fopen(PID_FILE, "w+")) == NULL) return 1;
-    fprintf(f, "%d", getpid());
-    if (fclose(f)) return 1;
-    return 0;
+static void runScreenshotService() {
+    struct timeval timeout = { SCREENSHOT_TIMEOUT, 0 };
+    int sock;
+
+    while (true) {
+        if ((sock = accept(screenshotSock, NULL, NULL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("Screenshot service stopped: %s", strerror(errno));
+            return;
+        }
+        if (!screenshotPeerAllowed(sock)) {
+            close(sock);
+            continue;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serveScreenshot(sock);
+    }
 }
 
-static int deleteServerPid() {
-    return unlink(PID_FILE);
+static void startScreenshotService() {
+    if ((screenshotSock = rfbListenOnUnixSocket(SCREENSHOT_SOCKET)) < 0) {
+        LOGE("Could not listen for screenshot requests on " SCREENSHOT_SOCKET);
+        return;
+    }
+    std::thread(runScreenshotService).detach();
+    LOGD("Serving screenshots on " SCREENSHOT_SOCKET);
 }
 
-static pid_t getRunningServerPid() {
-    FILE *f = fopen(PID_FILE, "r");
-    int i;
-    char buf[16];
-    memset(buf, 0x0, 16);
-    fgets(buf, 15, f);
-    int pid = atoi(buf);
-    if (pid <= 0) return -1;
-    if (kill(pid, 0) != 0) return -1;
-    return (pid_t) pid;
+// Ask a running server for a screenshot and write it to filename
+static bool requestScreenshot(const char *filename) {
+    struct sockaddr_un addr;
+    struct timeval timeout = { SCREENSHOT_TIMEOUT, 0 };
+    bool png = strstr(filename, ".png") != NULL;
+    char buf[65536], *eol;
+    size_t len = strlen(SCREENSHOT_SOCKET), have = 0;
+    ssize_t n;
+    FILE *f;
+    int sock, width = 0, height = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, SCREENSHOT_SOCKET, len);
+    addr.sun_path[0] = '\0'; // abstract namespace
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return false;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, (struct sockaddr *) &addr, offsetof(struct sockaddr_un, sun_path) + len) < 0) {
+        close(sock);
+        return false;
+    }
+
+    formatScreenshotRequest(buf, sizeof(buf), png);
+    if (send(sock, buf, strlen(buf), 0) < 0) {
+        close(sock);
+        return false;
+    }
+
+    // Status line, then the image until the server closes the connection
+    while ((eol = (char *) memchr(buf, '\n', have)) == NULL && have < sizeof(buf) &&
+           (n = recv(sock, buf + have, sizeof(buf) - have, 0)) > 0)
+        have += n;
+    if (eol == NULL || strncmp(buf, "OK ", 3) != 0) {
+        if (eol != NULL) {
+            *eol = 0;
+            LOGE("Screenshot request failed: %s", buf);
+        }
+        close(sock);
+        return false;
+    }
+
+    *eol = 0;
+    sscanf(buf, "OK %d %d", &width, &height);
+
+    if ((f = fopen(filename, "w+")) == NULL)
+        FATAL("Could not open screenshot file");
+    eol++;
+    fwrite(eol, 1, have - (eol - buf), f);
+    while ((n = recv(sock, buf, sizeof(buf), 0)) > 0)
+        fwrite(buf, 1, n, f);
+    close(sock);
+
+    if (n < 0 || ferror(f) || fclose(f))
+        FATAL("Could not write screenshot");
+    LOGD("Received %dx%d screenshot: %s", width, height, filename);
+    return true;
 }
 
-static void waitForScreenshot(int signum) {
-    LOGD("Received response, screenshot was successfully created.");
-    cleanup(0);
+// Consume the next pending frame and put it on the VNC screen, timing each
+// stage into the screen's latency histograms
+static void sendPendingFrame(FrameWaiter *waiter, void (*updateScreenFn)(int)) {
+    uint64_t start = rfbLatencyClock(), end;
+    int err;
+
+    if ((err = minicap->consumePendingFrame(&frame)) == 0) {
+        end = rfbLatencyClock();
+        vncscr->framesCaptured++;
+        rfbLatencyRecord(&vncscr->latency[RFB_LATENCY_FRAME_WAIT], start - waiter->getFrameAvailableAt());
+        rfbLatencyRecord(&vncscr->latency[RFB_LATENCY_CONSUME], end - start);
+        {
+            std::lock_guard<std::mutex> lock(screenMutex);
+            start = rfbLatencyClock();
+            (*updateScreenFn)(imageRotation);
+            screenGeneration++;
+            end = rfbLatencyClock();
+        }
+        vncscr->framesConverted++;
+        rfbLatencyRecord(&vncscr->latency[RFB_LATENCY_CONVERT], end - start);
+        rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
+        rfbLatencyRecord(&vncscr->latency[RFB_LATENCY_MARK], rfbLatencyClock() - end);
+        // Only this thread writes vncbuf, so it can be read without the lock
+        recorder.publish(vncbuf);
+    } else {
+        vncscr->framesDropped++;
+        if (err == -EINTR) {
+            LOGD("Frame consumption interrupted by EINTR");
+        }
+        else {
+            LOGE("Unable to consume pending frame");
+        }
+    }
+    minicap->releaseConsumedFrame(&frame);
 }
 
-static bool dispatchScreenshotSignal() {
-    if (unlink(SCREENSHOT_SIGNAL_FILE) < 0)
-        FATAL("Could not remove old screenshot " SCREENSHOT_SIGNAL_FILE);
-    
-    pid_t pid = getRunningServerPid();
-    if (pid <= 0) return false;
+// Start a new part of the recording for the screen as it is now
+static void recordScreenFormat() {
+    recorder.setRotation(screenRotation, imageRotation);
+    recorder.setFormat(vncscr->width, vncscr->height, vncscr->serverFormat.bitsPerPixel / 8, vncscr->serverFormat);
+}
 
-    signal(SIGCONT, waitForScreenshot);
-    kill(pid, SIGCONT);
+// Serve a -W recording instead of the screen, at the pace it was recorded
+// and from the start again once it ends
+static void replayRecording(int argc, char **argv) {
+    FrameReplayer replayer;
+    uint64_t start, now, end;
+    time_t latencyReported = time(NULL);
+    bool replayed = false; // any frame since the last rewind
+
+    if (!replayer.open(replayFile))
+        FATAL("Could not open recording %s", replayFile);
+    while (replayer.next() && replayer.getType() != FRAME_RECORD_FORMAT);
+    if (replayer.getWidth() == 0)
+        FATAL("No frames in recording %s", replayFile);
+
+    LOGD("Recording format: %dx%d, %d bytes per pixel", replayer.getWidth(), replayer.getHeight(), replayer.getBpp());
+    initVncServer(argc, argv, replayer.getWidth(), replayer.getHeight(), replayer.getWidth(), replayer.getBpp());
+    vncscr->serverFormat = replayer.getFormat();
+    memset(vncbuf, 0, replayer.getWidth() * replayer.getHeight() * replayer.getBpp());
 
-    // Wait for 4 seconds
-    sleep(4);
-    
-    // If we reach here, then the signal was not received before timeout
-    
-    // Remove the signal handler
-    signal(SIGCONT, SIG_DFL);
+    rfbRunEventLoop(vncscr, -1, TRUE);
+    startScreenshotService();
 
-    return false;
+    start = rfbLatencyClock();
+    while (1) {
+        if (!replayer.next()) {
+            if (!replayed || !replayer.rewind())
+                FATAL("Could not replay recording %s", replayFile);
+            replayed = false;
+            start = rfbLatencyClock();
+            continue;
+        }
+
+        switch (replayer.getType()) {
+        case FRAME_RECORD_FORMAT:
+            if (replayer.getBpp() * 8 != vncscr->serverFormat.bitsPerPixel ||
+                replayer.getWidth() * replayer.getHeight() != (unsigned int) (vncscr->width * vncscr->height))
+                FATAL("Recording changes the frame size, which replaying does not support");
+            {
+                std::lock_guard<std::mutex> lock(screenMutex);
+                reinitVncServer(replayer.getWidth(), replayer.getHeight(), replayer.getWidth(), replayer.getBpp());
+            }
+            break;
+        case FRAME_RECORD_ROTATION:
+            LOGD("Recorded rotation: screen %d, image %d", replayer.getScreenRotation(), replayer.getImageRotation());
+            break;
+        case FRAME_RECORD_FRAME:
+            now = rfbLatencyClock();
+            if (start + replayer.getTime() > now)
+                usleep(start + replayer.getTime() - now);
+
+            // Frames the recording left out were captured but never seen
+            vncscr->framesCaptured += replayer.getSkippedFrames() + 1;
+            vncscr->framesDropped += replayer.getSkippedFrames();
+            {
+                std::lock_guard<std::mutex> lock(screenMutex);
+                now = rfbLatencyClock();
+                replayer.applyFrame(vncbuf);
+                screenGeneration++;
+                end = rfbLatencyClock();
+            }
+            vncscr->framesConverted++;
+            replayed = true;
+            rfbLatencyRecord(&vncscr->latency[RFB_LATENCY_CONVERT], end - now);
+            rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
+            rfbLatencyRecord(&vncscr->latency[RFB_LATENCY_MARK], rfbLatencyClock() - end);
+
+            if (latencyInterval > 0 && time(NULL) - latencyReported >= latencyInterval) {
+                rfbPrintLatency(vncscr);
+                latencyReported = time(NULL);
+            }
+            break;
+        }
+    }
 }
 
 int main(int argc, char **argv)
@@ -810,7 +1537,8 @@ int main(int argc, char **argv)
                     LOGD("Set screenshot file: %s", screenshotFile);
                     break;
                 case 'U':
-                    screenshotFile = (char *) SCREENSHOT_SIGNAL_FILE;
+                    if (screenshotFile == NULL)
+                        screenshotFile = (char *) SCREENSHOT_FAST_FILE;
                     screenshotFast = true;
                     LOGD("Attempting fast screenshot: %s", screenshotFile);
                     break;
@@ -818,6 +1546,39 @@ int main(int argc, char **argv)
                     screenshotSkipFrame = true;
                     LOGD("Skipping first frame for screenshot");
                     break;
+                case 'C':
+                    if (++i >= argc) FATAL("No screenshot region provided");
+                    screenshotRegion = argv[i];
+                    break;
+                case 'T':
+                    if (++i >= argc) FATAL("No thumbnail size provided");
+                    screenshotSize = argv[i];
+                    break;
+                case 'N':
+                    if (++i >= argc) FATAL("No screenshot count provided");
+                    if ((screenshotCount = atoi(argv[i])) < 1)
+                        FATAL("Invalid screenshot count: %s", argv[i]);
+                    break;
+                case 'I':
+                    if (++i >= argc) FATAL("No screenshot interval provided");
+                    if ((screenshotInterval = atoi(argv[i])) < 0)
+                        FATAL("Invalid screenshot interval: %s", argv[i]);
+                    break;
+                case 'L':
+                    if (++i >= argc) FATAL("No latency report interval provided");
+                    if ((latencyInterval = atoi(argv[i])) < 0)
+                        FATAL("Invalid latency report interval: %s", argv[i]);
+                    break;
+                case 'W':
+                    if (++i >= argc) FATAL("No recording filename provided");
+                    recordFile = argv[i];
+                    LOGD("Recording frames to %s", recordFile);
+                    break;
+                case 'F':
+                    if (++i >= argc) FATAL("No recording filename provided");
+                    replayFile = argv[i];
+                    LOGD("Replaying frames from %s", replayFile);
+                    break;
                 }
             }
             i++;
@@ -825,14 +1586,19 @@ int main(int argc, char **argv)
     }
 
     // Try to shortcut out by finding a running droidvncserver    
-    if (screenshotFast) {
-        if (dispatchScreenshotSignal()) {
+    if (screenshotFast && screenshotCount == 1) {
+        if (requestScreenshot(screenshotFile)) {
             return 0;
         } else {
             LOGD("Fast screenshot failed, continuing normal screenshot");
         }
     }
 
+    if (replayFile != NULL) {
+        replayRecording(argc, argv);
+        return 0;
+    }
+
     LOGD("Starting rotation watcher");
 
     if (start_rotation_watcher())
@@ -906,6 +1672,14 @@ int main(int argc, char **argv)
 
     LOGD("Bytes per pixel: %d", frame.bpp);
     LOGD("Image format: %s", getImageFormatName());
+
+    if (scaling != 100 && screenshotFile == NULL) {
+        // Not every capture method can scale, fall back to libvncserver then
+        unsigned int w = scaleDimension(screenWidth), h = scaleDimension(screenHeight);
+        captureScaled = (frame.width == w && frame.height == h) ||
+                        (frame.width == h && frame.height == w);
+        LOGD("Scaling %s", captureScaled ? "at capture" : "in libvncserver");
+    }
     
     unsigned int targetBpp = frame.bpp;
     void (*updateScreenFn)(int);
@@ -970,15 +1744,18 @@ int main(int argc, char **argv)
             minicap->consumePendingFrame(&frame);
         }
         
+        if (screenshotCount > 1) {
+            bool ok = writeScreenBurst(gWaiter, targetBpp);
+            minicap_free(minicap);
+            return ok ? 0 : 1;
+        }
+
         // Stop getting informed of more frames on other thread(s)
         minicap->setFrameAvailableListener(NULL);
         
         if ((vncbuf = (unsigned char *)malloc(frame.width * frame.height * frame.bpp)) == NULL)
             FATAL("Could not create buffer");
         
-        // Write image to vncbuf
-        updateScreenFn(imageRotation);
-        
         writeScreenToFile(screenshotFile, targetBpp);
 
         free(vncbuf);
@@ -998,6 +1775,13 @@ int main(int argc, char **argv)
     // Send the first frame
     (*updateScreenFn)(imageRotation);
     rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
+
+    if (recordFile != NULL) {
+        if (!recorder.open(recordFile))
+            FATAL("Could not open recording %s", recordFile);
+        recordScreenFormat();
+        recorder.publish(vncbuf);
+    }
     
     minicap->releaseConsumedFrame(&frame);
 
@@ -1018,10 +1802,10 @@ int main(int argc, char **argv)
     // long usec;
     rfbRunEventLoop(vncscr, -1, TRUE);
 
-    setupScreenshotSignalHandler();
-    writeServerPid();
+    startScreenshotService();
 
     int x, y, pending, err;
+    time_t latencyReported = time(NULL);
 
     while (1) {
         if (check_rotation_change(&screenRotation)) {
@@ -1052,12 +1836,16 @@ int main(int argc, char **argv)
             if (frame.size != expectedFrameSize)
                 FATAL("Unexpected frame size %d, expected %d", frame.size, expectedFrameSize);
 
-            // Reinitialize VNC screen
-            reinitVncServer(frame.width, frame.height, frame.stride, targetBpp);
-
-            // Send the first frame
-            (*updateScreenFn)(imageRotation);
+            // Reinitialize VNC screen and send the first frame
+            {
+                std::lock_guard<std::mutex> lock(screenMutex);
+                reinitVncServer(frame.width, frame.height, frame.stride, targetBpp);
+                (*updateScreenFn)(imageRotation);
+                screenGeneration++;
+            }
             rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
+            recordScreenFormat();
+            recorder.publish(vncbuf);
                 
             minicap->releaseConsumedFrame(&frame);
         }
@@ -1070,7 +1858,10 @@ int main(int argc, char **argv)
                 gWaiter->reportExtraConsumption(pending - 1);
 
                 while (--pending >= 1) {
-                    if ((err = minicap->consumePendingFrame(&frame)) != 0) {
+                    vncscr->framesDropped++;
+                    if ((err = minicap->consumePendingFrame(&frame)) == 0) {
+                        vncscr->framesCaptured++;
+                    } else {
                         if (err == -EINTR) {
                             LOGE("Frame consumption interrupted by EINTR");
                         }
@@ -1082,35 +1873,18 @@ int main(int argc, char **argv)
                 }
                 
                 // Process the one remaining frame
-                if ((err = minicap->consumePendingFrame(&frame)) == 0) {
-                    (*updateScreenFn)(imageRotation);
-                    rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);                    
-                } else {
-                    if (err == -EINTR) {
-                        LOGD("Frame consumption interrupted by EINTR");
-                    }
-                    else {
-                        LOGE("Unable to consume pending frame");
-                    }
-                }
-                minicap->releaseConsumedFrame(&frame);                
+                sendPendingFrame(gWaiter, updateScreenFn);
             } else {
                 // Consume all available frames
                 do {
-                    if ((err = minicap->consumePendingFrame(&frame)) == 0) {
-                        (*updateScreenFn)(imageRotation);
-                        rfbMarkRectAsModified(vncscr, 0, 0, vncscr->width, vncscr->height);
-                    } else {
-                        if (err == -EINTR) {
-                            LOGD("Frame consumption interrupted by EINTR");
-                        }
-                        else {
-                            LOGE("Unable to consume pending frame");
-                        }
-                    }
-                    minicap->releaseConsumedFrame(&frame);
+                    sendPendingFrame(gWaiter, updateScreenFn);
                 } while ((pending = gWaiter->getPendingFrames()) > 0);
             }
+
+            if (latencyInterval > 0 && time(NULL) - latencyReported >= latencyInterval) {
+                rfbPrintLatency(vncscr);
+                latencyReported = time(NULL);
+            }
         }
     }
 
@@ -50,6 +50,14 @@ rfbUsage(void)
 #endif
     fprintf(stderr, "-enablehttpproxy       enable http proxy support\n");
     fprintf(stderr, "-progressive height    enable progressive updating for slow links\n");
+    fprintf(stderr, "-interp filter         filter for scaled clients: area (default), bilinear\n"
+                    "                       or lanczos2\n");
+    fprintf(stderr, "-unixsock path         also listen on a Unix domain socket, a leading '@'\n"
+                    "                       selects the abstract namespace\n");
+    fprintf(stderr, "-notsentlowat bytes    keep at most this many unsent bytes in the kernel\n");
+    fprintf(stderr, "-tcpcork               only send full TCP segments while writing an update\n");
+    fprintf(stderr, "-autosndbuf            size the socket send buffer from the measured\n"
+                    "                       bandwidth-delay product\n");
     fprintf(stderr, "-listen ipaddr         listen for connections only on network interface with\n");
     fprintf(stderr, "                       addr ipaddr. '-listen localhost' and hostname work too.\n");
 #ifdef LIBVNCSERVER_IPv6
@@ -181,6 +189,38 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->progressiveSliceHeight = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-notsentlowat") == 0) {  /* -notsentlowat bytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->tcpNotSentLowat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-interp") == 0) {  /* -interp filter */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            i++;
+            if (strcmp(argv[i], "area") == 0)
+                rfbScreen->scaleFilter = RFB_SCALE_AREA;
+            else if (strcmp(argv[i], "bilinear") == 0)
+                rfbScreen->scaleFilter = RFB_SCALE_BILINEAR;
+            else if (strcmp(argv[i], "lanczos2") == 0)
+                rfbScreen->scaleFilter = RFB_SCALE_LANCZOS2;
+            else {
+		rfbUsage();
+		return FALSE;
+	    }
+        } else if (strcmp(argv[i], "-unixsock") == 0) {  /* -unixsock path */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->unixSocketPath = argv[++i];
+        } else if (strcmp(argv[i], "-tcpcork") == 0) {
+            rfbScreen->tcpCork = TRUE;
+        } else if (strcmp(argv[i], "-autosndbuf") == 0) {
+            rfbScreen->tcpAutoSndBuf = TRUE;
         } else if (strcmp(argv[i], "-listen") == 0) {  /* -listen ipaddr */
             if (i + 1 >= *argc) {
 		rfbUsage();
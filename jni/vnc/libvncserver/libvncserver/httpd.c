@@ -83,6 +83,7 @@
 
 #define OK_STR "HTTP/1.0 200 OK\r\nConnection: close\r\n\r\n"
 #define OK_STR_HTML "HTTP/1.0 200 OK\r\nConnection: close\r\nContent-Type: text/html\r\n\r\n"
+#define OK_STR_METRICS "HTTP/1.0 200 OK\r\nConnection: close\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n"
 
 
 
@@ -432,6 +433,21 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
         return;
     }
 
+    /* The counters of rfbGetMetrics() are served instead of a file */
+
+    if (strcmp(fname, "/metrics") == 0) {
+        char *metrics = rfbGetMetrics(rfbScreen);
+        if (metrics == NULL) {
+            rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
+        } else {
+            rfbWriteExact(&cl, OK_STR_METRICS, strlen(OK_STR_METRICS));
+            rfbWriteExact(&cl, metrics, strlen(metrics));
+            free(metrics);
+        }
+        httpCloseSock(rfbScreen);
+        return;
+    }
+
     /* If we were asked for '/', actually read the file index.vnc */
 
     if (strcmp(fname, "/") == 0) {
@@ -400,10 +400,13 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
+   uint64_t now = rfbLatencyClock();
 
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
+     if (cl->modifiedAt == 0 && !sraRgnEmpty(modRegion))
+       cl->modifiedAt = now;
      sraRgnOr(cl->modifiedRegion,modRegion);
      TSIGNAL(cl->updateCond);
      UNLOCK(cl->updateMutex);
@@ -413,6 +416,8 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 }
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
+void rfbScaledScreenFree(rfbScreenInfoPtr ptr);
+void rfbScalePyramidFree(rfbScreenInfoPtr screen);
 void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
 {
    sraRegionPtr region;
@@ -428,7 +433,7 @@ void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
    if(y2>screen->height) y2=screen->height;
    if(y1==y2) return;
 
-   /* update scaled copies for this rectangle */
+   /* flag this rectangle in the scaled copies */
    rfbScaledScreenUpdate(screen,x1,y1,x2,y2);
 
    region = sraRgnCreateRect(x1,y1,x2,y2);
@@ -483,6 +488,12 @@ clientOutput(void *data)
            updates to come along. */
         usleep(cl->screen->deferUpdateTime * 1000);
 
+        /* Don't pile up updates for a slow client: until its writer
+           thread caught up, changes keep accumulating in modifiedRegion
+           and are sent as one update afterwards. */
+        if (!rfbSendQueueWaitForSpace(cl))
+            continue;
+
         /* Now, get the region we're going to update, and remove
            it from cl->modifiedRegion _before_ we send the update.
            That way, if anything that overlaps the region we're sending
@@ -510,6 +521,7 @@ clientInput(void *data)
 {
     rfbClientPtr cl = (rfbClientPtr)data;
     pthread_t output_thread;
+    rfbStartSendQueue(cl);
     pthread_create(&output_thread, NULL, clientOutput, (void *)cl);
 
     while (1) {
@@ -591,6 +603,8 @@ listenerRun(void *data)
 	  FD_SET(screen->listenSock, &listen_fds);
 	if(screen->listen6Sock >= 0) 
 	  FD_SET(screen->listen6Sock, &listen_fds);
+	if(screen->listenUnixSock >= 0) 
+	  FD_SET(screen->listenUnixSock, &listen_fds);
 
         if (select(screen->maxFd+1, &listen_fds, NULL, NULL, NULL) == -1) {
             rfbLogPerror("listenerRun: error in select");
@@ -603,6 +617,8 @@ listenerRun(void *data)
 	    client_fd = accept(screen->listenSock, (struct sockaddr*)&peer, &len);
 	else if (FD_ISSET(screen->listen6Sock, &listen_fds))
 	    client_fd = accept(screen->listen6Sock, (struct sockaddr*)&peer, &len);
+	else if (screen->listenUnixSock >= 0 && FD_ISSET(screen->listenUnixSock, &listen_fds))
+	    client_fd = accept(screen->listenUnixSock, NULL, NULL);
 
 	if(client_fd >= 0)
 	  cl = rfbNewClient(screen,client_fd);
@@ -847,6 +863,8 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->maxFd=0;
    screen->listenSock=-1;
    screen->listen6Sock=-1;
+   screen->listenUnixSock=-1;
+   screen->unixSocketPath=NULL;
 
    screen->httpInitDone=FALSE;
    screen->httpEnableProxyConnect=FALSE;
@@ -887,6 +905,16 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
    screen->permitFileTransfer = FALSE;
 
+   /* write synchronously per default */
+   screen->sendQueueLimit = 0;
+
+   /* leave client sockets to the kernel per default */
+   screen->tcpNotSentLowat = 0;
+   screen->tcpCork = FALSE;
+   screen->tcpAutoSndBuf = FALSE;
+
+   screen->scaleFilter = RFB_SCALE_AREA;
+
    if(!rfbProcessArguments(screen,argc,argv)) {
      free(screen);
      return NULL;
@@ -1043,9 +1071,9 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
       rfbScreenInfoPtr ptr;
       ptr = screen->scaledScreenNext;
       screen->scaledScreenNext = ptr->scaledScreenNext;
-      free(ptr->frameBuffer);
-      free(ptr);
+      rfbScaledScreenFree(ptr);
   }
+  rfbScalePyramidFree(screen);
 
 #endif
   free(screen);
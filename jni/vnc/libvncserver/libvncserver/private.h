@@ -11,6 +11,27 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
 
+/* from sendqueue.c */
+
+void rfbStartSendQueue(rfbClientPtr cl);
+void rfbCloseSendQueue(rfbClientPtr cl);
+void rfbStopSendQueue(rfbClientPtr cl);
+int rfbSendQueueWrite(rfbClientPtr cl, const char *hdr, int hlen,
+                      const char *buf, int len);
+rfbBool rfbSendQueueWaitForSpace(rfbClientPtr cl);
+void rfbSendQueueBeginUpdate(rfbClientPtr cl);
+void rfbSendQueueEndUpdate(rfbClientPtr cl, sraRegionPtr region,
+                           rfbBool droppable, rfbBool supersedes,
+                           uint64_t modifiedAt);
+void rfbSendQueueGetStats(rfbClientPtr cl, int *bytes, int *droppedUpdates);
+
+/* from stats.c */
+
+uint64_t rfbThreadCpuClock(void); /* CPU time of the calling thread, in microseconds */
+void rfbRecordEncodeCost(rfbClientPtr cl, uint64_t micros, uint64_t cpuMicros, uint64_t writeMicros);
+void rfbRecordRectPixels(rfbClientPtr cl, uint32_t pixels);
+void rfbRecordUpdateRate(rfbClientPtr cl, uint64_t now);
+
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
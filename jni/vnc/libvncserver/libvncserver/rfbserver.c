@@ -338,6 +338,11 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       int one=1;
 
       getpeername(sock, (struct sockaddr *)&addr, &addrlen);
+      if(((struct sockaddr *)&addr)->sa_family == AF_UNIX) {
+	/* accepted on the Unix domain listener */
+	cl->unixSocket = TRUE;
+	cl->host = strdup("localhost");
+      } else
 #ifdef LIBVNCSERVER_IPv6
       if(getnameinfo((struct sockaddr*)&addr, addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
 	rfbLogPerror("rfbNewClient: error in getnameinfo");
@@ -361,11 +366,13 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	return NULL;
       }
 
-      if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+      if (!cl->unixSocket && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
 		     (char *)&one, sizeof(one)) < 0) {
 	rfbLogPerror("setsockopt failed: can't set TCP_NODELAY flag, non TCP socket?");
       }
 
+      rfbTuneClientSocket(cl);
+
       FD_SET(sock,&(rfbScreen->allFds));
 		rfbScreen->maxFd = rfbMax(sock,rfbScreen->maxFd);
 
@@ -559,11 +566,13 @@ rfbClientConnectionGone(rfbClientPtr cl)
     }
 #endif
 
+    rfbStopSendQueue(cl);
+
     if(cl->sock>=0)
 	close(cl->sock);
 
     if (cl->scaledScreen!=NULL)
-        cl->scaledScreen->scaledScreenRefCount--;
+        rfbScalingRelease(cl);
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     rfbFreeZrleData(cl);
@@ -953,6 +962,7 @@ rfbSendSupportedMessages(rfbClientPtr cl)
     /*rfbSetBit(msgs.client2server, rfbSetSW);           */
     /*rfbSetBit(msgs.client2server, rfbTextChat);        */
     rfbSetBit(msgs.client2server, rfbPalmVNCSetScaleFactor);
+    rfbSetBit(msgs.client2server, rfbSetDesktopSize);
 
     rfbSetBit(msgs.server2client, rfbFramebufferUpdate);
     rfbSetBit(msgs.server2client, rfbSetColourMapEntries);
@@ -1012,6 +1022,7 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 	rfbEncodingPointerPos,
 	rfbEncodingLastRect,
 	rfbEncodingNewFBSize,
+	rfbEncodingExtDesktopSize,
 	rfbEncodingKeyboardLedState,
 	rfbEncodingSupportedMessages,
 	rfbEncodingSupportedEncodings,
@@ -2088,6 +2099,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
         cl->preferredEncoding=-1;
         cl->useCopyRect              = FALSE;
         cl->useNewFBSize             = FALSE;
+        cl->useExtDesktopSize        = FALSE;
         cl->cursorWasChanged         = FALSE;
         cl->useRichCursorEncoding    = FALSE;
         cl->enableCursorPosUpdates   = FALSE;
@@ -2189,6 +2201,17 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 		    cl->useNewFBSize = TRUE;
 		}
 		break;
+	    case rfbEncodingExtDesktopSize:
+		if (!cl->useExtDesktopSize) {
+		    rfbLog("Enabling ExtendedDesktopSize protocol extension for client "
+			   "%s\n", cl->host);
+		    cl->useExtDesktopSize = TRUE;
+		    /* tell the client its current size with the next update */
+		    LOCK(cl->updateMutex);
+		    cl->extDesktopSizePending = TRUE;
+		    UNLOCK(cl->updateMutex);
+		}
+		break;
             case rfbEncodingKeyboardLedState:
                 if (!cl->enableKeyboardLedState) {
                   rfbLog("Enabling KeyboardLedState protocol extension for client "
@@ -2645,6 +2668,56 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
       rfbSendNewScaleSize(cl);
       return;
 
+    case rfbSetDesktopSize:
+    {
+      rfbExtDesktopScreen screen;
+      int width, height, status = rfbExtDesktopSize_Success;
+
+      if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+          sz_rfbSetDesktopSizeMsg - 1)) <= 0) {
+          if (n != 0)
+            rfbLogPerror("rfbProcessClientNormalMessage: read");
+          rfbCloseClient(cl);
+          return;
+      }
+      /* we serve a single screen, the layout only needs to be consumed */
+      for (i = 0; i < msg.sdm.numberOfScreens; i++) {
+          if ((n = rfbReadExact(cl, (char *)&screen, sz_rfbExtDesktopScreen)) <= 0) {
+              if (n != 0)
+                rfbLogPerror("rfbProcessClientNormalMessage: read");
+              rfbCloseClient(cl);
+              return;
+          }
+      }
+      rfbStatRecordMessageRcvd(cl, msg.type,
+          sz_rfbSetDesktopSizeMsg + msg.sdm.numberOfScreens * sz_rfbExtDesktopScreen,
+          sz_rfbSetDesktopSizeMsg + msg.sdm.numberOfScreens * sz_rfbExtDesktopScreen);
+
+      width = Swap16IfLE(msg.sdm.width);
+      height = Swap16IfLE(msg.sdm.height);
+      rfbLog("rfbSetDesktopSize(%dx%d) from client %s\n", width, height, cl->host);
+
+      /* every client gets its own size, served from a scaled copy of
+       * the framebuffer that is shared between clients of the same size */
+      if (width <= 0 || height <= 0 || msg.sdm.numberOfScreens == 0 ||
+          width > rfbMaxDesktopSize || height > rfbMaxDesktopSize)
+          status = rfbExtDesktopSize_InvalidScreenLayout;
+      else if (!rfbScalingSetup(cl, width, height))
+          status = rfbExtDesktopSize_OutOfResources;
+      else
+          cl->clientDesktopSize = TRUE;
+
+      if (cl->useExtDesktopSize) {
+          LOCK(cl->updateMutex);
+          cl->extDesktopSizePending = TRUE;
+          cl->extDesktopSizeReason = rfbExtDesktopSize_ClientRequestedChange;
+          cl->extDesktopSizeStatus = status;
+          TSIGNAL(cl->updateCond);
+          UNLOCK(cl->updateMutex);
+      }
+      return;
+    }
+
     case rfbXvp:
 
       if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
@@ -2716,6 +2789,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
     rfbBool result = TRUE;
+    rfbBool droppable;
+    uint64_t started, cpuStarted, writeMicros, modifiedAt;
     
 
     if(cl->screen->displayHook)
@@ -2726,14 +2801,26 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      * encoding, just send NewFBSize marker and return.
      */
 
-    if (cl->useNewFBSize && cl->newFBSizePending) {
+    if (((cl->useNewFBSize || cl->useExtDesktopSize) && cl->newFBSizePending) ||
+        cl->extDesktopSizePending) {
+      int reason, status;
+      rfbBool sent;
       LOCK(cl->updateMutex);
       cl->newFBSizePending = FALSE;
+      cl->extDesktopSizePending = FALSE;
+      reason = cl->extDesktopSizeReason;
+      status = cl->extDesktopSizeStatus;
+      cl->extDesktopSizeReason = rfbExtDesktopSize_GenericChange;
+      cl->extDesktopSizeStatus = rfbExtDesktopSize_Success;
       UNLOCK(cl->updateMutex);
       fu->type = rfbFramebufferUpdate;
       fu->nRects = Swap16IfLE(1);
       cl->ublen = sz_rfbFramebufferUpdateMsg;
-      if (!rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height)) {
+      if (cl->useExtDesktopSize)
+        sent = rfbSendExtDesktopSize(cl, cl->scaledScreen->width, cl->scaledScreen->height, reason, status);
+      else
+        sent = rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height);
+      if (!sent) {
 	if(cl->screen->displayFinishedHook)
 	  cl->screen->displayFinishedHook(cl, FALSE);
         return FALSE;
@@ -2899,6 +2986,11 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      sraRgnSubtract(cl->modifiedRegion,updateRegion);
      sraRgnSubtract(cl->modifiedRegion,updateCopyRegion);
 
+     /* what is left keeps its (possibly older) time */
+     modifiedAt = sraRgnEmpty(updateRegion) ? 0 : cl->modifiedAt;
+     if (sraRgnEmpty(cl->modifiedRegion))
+         cl->modifiedAt = 0;
+
      sraRgnMakeEmpty(cl->requestedRegion);
      sraRgnMakeEmpty(cl->copyRegion);
      cl->copyDX = 0;
@@ -2918,10 +3010,44 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
       rfbShowCursor(cl);
     }
 
+    /* rescale what this client is about to get, if it is scaled, and also
+     * send the scaled pixels the filter rewrote around it */
+    if (cl->screen!=cl->scaledScreen) {
+        started = rfbLatencyClock();
+        rfbScaledScreenSync(cl->screen, cl->scaledScreen, updateRegion);
+        rfbScaledScreenPadRegion(cl->screen, cl->scaledScreen, updateRegion);
+        rfbLatencyRecord(&cl->latency[RFB_LATENCY_SCALE], rfbLatencyClock() - started);
+    }
+
+    /*
+     * An update may be discarded from the send queue in favour of a later
+     * one only if it carries nothing but pixel data which does not depend
+     * on the encoder state left by earlier updates.
+     */
+
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+    case rfbEncodingRRE:
+    case rfbEncodingCoRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+        droppable = sraRgnEmpty(updateCopyRegion) &&
+            !sendCursorShape && !sendCursorPos && !sendKeyboardLedState &&
+            !sendSupportedMessages && !sendSupportedEncodings && !sendServerIdentity;
+        break;
+    default:
+        droppable = FALSE;
+    }
+
     /*
      * Now send the update.
      */
     
+    started = rfbLatencyClock();
+    cpuStarted = rfbThreadCpuClock();
+    writeMicros = cl->writeMicros;
+    rfbSendQueueBeginUpdate(cl);
     rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
     if (cl->preferredEncoding == rfbEncodingCoRRE) {
         nUpdateRegionRects = 0;
@@ -3143,6 +3269,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 #endif
 #endif
         }
+        rfbRecordRectPixels(cl, w * h);
     }
     if (i) {
         sraRgnReleaseIterator(i);
@@ -3158,6 +3285,19 @@ updateFailed:
 	result = FALSE;
     }
 
+    if (result) {
+        /* blocking writes are the socket's time, not the encoder's */
+        uint64_t elapsed = rfbLatencyClock() - started;
+        writeMicros = cl->writeMicros - writeMicros;
+        rfbRecordEncodeCost(cl, elapsed > writeMicros ? elapsed - writeMicros : 0,
+                            rfbThreadCpuClock() - cpuStarted, writeMicros);
+        rfbRecordUpdateRate(cl, started + elapsed);
+    }
+
+    rfbSendQueueEndUpdate(cl, updateRegion, result && droppable,
+			  sraRgnEmpty(updateCopyRegion), result ? modifiedAt : 0);
+    rfbAutoTuneSendBuffer(cl);
+
     if (!cl->enableCursorShapeUpdates) {
       rfbHideCursor(cl);
     }
@@ -3375,6 +3515,60 @@ rfbSendNewFBSize(rfbClientPtr cl,
 }
 
 
+/*
+ * Send an ExtendedDesktopSize rectangle describing a single screen of
+ * w x h, with the reason and status of the change in the rectangle origin.
+ */
+
+rfbBool
+rfbSendExtDesktopSize(rfbClientPtr cl,
+                      int w,
+                      int h,
+                      int reason,
+                      int status)
+{
+    rfbFramebufferUpdateRectHeader rect;
+    rfbExtDesktopSizeMsg edsz;
+    rfbExtDesktopScreen screen;
+    int len = sz_rfbFramebufferUpdateRectHeader + sz_rfbExtDesktopSizeMsg + sz_rfbExtDesktopScreen;
+
+    if (cl->ublen + len > UPDATE_BUF_SIZE) {
+	if (!rfbSendUpdateBuf(cl))
+	    return FALSE;
+    }
+
+    rfbLog("Sending rfbEncodingExtDesktopSize for size (%dx%d), reason %d, status %d\n",
+           w, h, reason, status);
+
+    rect.encoding = Swap32IfLE(rfbEncodingExtDesktopSize);
+    rect.r.x = Swap16IfLE(reason);
+    rect.r.y = Swap16IfLE(status);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+
+    edsz.numberOfScreens = 1;
+    edsz.pad[0] = edsz.pad[1] = edsz.pad[2] = 0;
+
+    screen.id = 0;
+    screen.x = 0;
+    screen.y = 0;
+    screen.width = Swap16IfLE(w);
+    screen.height = Swap16IfLE(h);
+    screen.flags = 0;
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&edsz, sz_rfbExtDesktopSizeMsg);
+    cl->ublen += sz_rfbExtDesktopSizeMsg;
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&screen, sz_rfbExtDesktopScreen);
+    cl->ublen += sz_rfbExtDesktopScreen;
+
+    rfbStatRecordEncodingSent(cl, rfbEncodingExtDesktopSize, len, len);
+
+    return TRUE;
+}
+
+
 /*
  * Send the contents of cl->updateBuf.  Returns 1 if successful, -1 if
  * not (errno should be set).
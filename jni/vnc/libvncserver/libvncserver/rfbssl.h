@@ -3,12 +3,14 @@
 
 #include "rfb/rfb.h"
 #include "rfb/rfbconfig.h"
+#include <sys/uio.h>
 
 int rfbssl_init(rfbClientPtr cl);
 int rfbssl_pending(rfbClientPtr cl);
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize);
 int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize);
 int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize);
+int rfbssl_writev(rfbClientPtr cl, const struct iovec *iov, int iovcnt);
 void rfbssl_destroy(rfbClientPtr cl);
 
 
@@ -192,6 +192,25 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
     return ret;
 }
 
+int rfbssl_writev(rfbClientPtr cl, const struct iovec *iov, int iovcnt)
+{
+    int i, ret, total = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+	const char *buf = (const char *)iov[i].iov_base;
+	int len = iov[i].iov_len;
+
+	while (len > 0) {
+	    if ((ret = rfbssl_write(cl, buf, len)) <= 0)
+		return total ? total : ret;
+	    buf += ret;
+	    len -= ret;
+	    total += ret;
+	}
+    }
+    return total;
+}
+
 static void rfbssl_gc_peekbuf(struct rfbssl_ctx *ctx, int bufsize)
 {
     if (ctx->peekstart) {
@@ -38,6 +38,11 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
     return -1;
 }
 
+int rfbssl_writev(rfbClientPtr cl, const struct iovec *iov, int iovcnt)
+{
+    return -1;
+}
+
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize)
 {
     return -1;
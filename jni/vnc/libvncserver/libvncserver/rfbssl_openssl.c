@@ -24,12 +24,38 @@
 #include "rfbssl.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* largest amount of plaintext which fits into one TLS record */
+#define RFBSSL_RECORD_SIZE SSL3_RT_MAX_PLAIN_LENGTH
 
 struct rfbssl_ctx {
     SSL_CTX *ssl_ctx;
     SSL     *ssl;
+    char    *stage;          /* collects small writes into one record */
+    int      stagelen;
 };
 
+/*
+ * All connections share one SSL_CTX, so that its session cache (and the
+ * session ticket key) lets reconnecting viewers resume their session
+ * instead of doing a full handshake.  It is rebuilt if the certificate or
+ * key file changes.
+ */
+static struct {
+    SSL_CTX *ssl_ctx;
+    char    *certfile;
+    char    *keyfile;
+} shared;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_mutex_t sharedMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static const unsigned char sessionIdContext[] = "libvncserver";
+
 static void rfbssl_error(void)
 {
     char buf[1024];
@@ -37,31 +63,107 @@ static void rfbssl_error(void)
     rfbErr("%s (%ld)\n", ERR_error_string(e, buf), e);
 }
 
+static SSL_CTX *rfbssl_shared_ctx(char *certfile, char *keyfile)
+{
+    SSL_CTX *ssl_ctx = NULL;
+
+    LOCK(sharedMutex);
+    if (shared.ssl_ctx && strcmp(shared.certfile, certfile) == 0
+	&& strcmp(shared.keyfile, keyfile) == 0) {
+	ssl_ctx = shared.ssl_ctx;
+	goto out;
+    }
+
+    if (!shared.ssl_ctx) {
+	SSL_library_init();
+	SSL_load_error_strings();
+    }
+
+    if (NULL == (ssl_ctx = SSL_CTX_new(TLSv1_server_method()))) {
+	rfbssl_error();
+	goto out;
+    } else if (SSL_CTX_use_PrivateKey_file(ssl_ctx, keyfile, SSL_FILETYPE_PEM) <= 0) {
+	rfbErr("Unable to load private key file %s\n", keyfile);
+    } else if (SSL_CTX_use_certificate_file(ssl_ctx, certfile, SSL_FILETYPE_PEM) <= 0) {
+	rfbErr("Unable to load certificate file %s\n", certfile);
+    } else {
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(ssl_ctx, sessionIdContext, sizeof(sessionIdContext) - 1);
+	/* a failed write is retried with the same data, not the same pointer */
+	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	/* connections still using the old context hold a reference to it */
+	if (shared.ssl_ctx)
+	    SSL_CTX_free(shared.ssl_ctx);
+	free(shared.certfile);
+	free(shared.keyfile);
+	shared.ssl_ctx = ssl_ctx;
+	shared.certfile = strdup(certfile);
+	shared.keyfile = strdup(keyfile);
+	goto out;
+    }
+    SSL_CTX_free(ssl_ctx);
+    ssl_ctx = NULL;
+
+out:
+    UNLOCK(sharedMutex);
+    return ssl_ctx;
+}
+
+/*
+ * Wait until the socket is ready for the SSL call that returned r to be
+ * retried, instead of spinning on it.  Returns FALSE on errors and once
+ * the client did not make progress for maxClientWait milliseconds.
+ */
+static rfbBool rfbssl_wait(rfbClientPtr cl, SSL *ssl, int r, int *waited)
+{
+    const int timeout = cl->screen->maxClientWait ? cl->screen->maxClientWait : rfbMaxClientWait;
+    fd_set fds;
+    struct timeval tv;
+    int err = SSL_get_error(ssl, r);
+
+    if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ)
+	return FALSE;
+    if (cl->sock == -1)
+	return FALSE;
+
+    FD_ZERO(&fds);
+    FD_SET(cl->sock, &fds);
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    if (err == SSL_ERROR_WANT_WRITE)
+	r = select(cl->sock + 1, NULL, &fds, NULL, &tv);
+    else
+	r = select(cl->sock + 1, &fds, NULL, NULL, &tv);
+
+    if (r < 0)
+	return errno == EINTR;
+    if (r == 0 && (*waited += 5000) >= timeout) {
+	errno = ETIMEDOUT;
+	return FALSE;
+    }
+    return TRUE;
+}
+
 int rfbssl_init(rfbClientPtr cl)
 {
     char *keyfile;
     int r, ret = -1;
     struct rfbssl_ctx *ctx;
 
-    SSL_library_init();
-    SSL_load_error_strings();
-
     if (cl->screen->sslkeyfile && *cl->screen->sslkeyfile) {
       keyfile = cl->screen->sslkeyfile;
     } else {
       keyfile = cl->screen->sslcertfile;
     }
 
-    if (NULL == (ctx = malloc(sizeof(struct rfbssl_ctx)))) {
+    if (NULL == (ctx = calloc(1, sizeof(struct rfbssl_ctx)))) {
 	rfbErr("OOM\n");
+	return ret;
     } else if (!cl->screen->sslcertfile || !cl->screen->sslcertfile[0]) {
 	rfbErr("SSL connection but no cert specified\n");
-    } else if (NULL == (ctx->ssl_ctx = SSL_CTX_new(TLSv1_server_method()))) {
-	rfbssl_error();
-    } else if (SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, keyfile, SSL_FILETYPE_PEM) <= 0) {
-	rfbErr("Unable to load private key file %s\n", keyfile);
-    } else if (SSL_CTX_use_certificate_file(ctx->ssl_ctx, cl->screen->sslcertfile, SSL_FILETYPE_PEM) <= 0) {
-	rfbErr("Unable to load certificate file %s\n", cl->screen->sslcertfile);
+    } else if (NULL == (ctx->ssl_ctx = rfbssl_shared_ctx(cl->screen->sslcertfile, keyfile))) {
+	/* already logged */
     } else if (NULL == (ctx->ssl = SSL_new(ctx->ssl_ctx))) {
 	rfbErr("SSL_new failed\n");
 	rfbssl_error();
@@ -76,25 +178,108 @@ int rfbssl_init(rfbClientPtr cl)
 	if (r < 0) {
 	    rfbErr("SSL_accept failed %d\n", SSL_get_error(ctx->ssl, r));
 	} else {
+	    if (SSL_session_reused(ctx->ssl))
+		rfbLog("SSL session resumed\n");
 	    cl->sslctx = (rfbSslCtx *)ctx;
 	    ret = 0;
 	}
     }
+
+    if (ret < 0) {
+	if (ctx->ssl)
+	    SSL_free(ctx->ssl);
+	free(ctx);
+    }
     return ret;
 }
 
-int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
+/* write one record's worth of data, waiting for the socket as necessary */
+static int rfbssl_write_record(rfbClientPtr cl, const char *buf, int bufsize)
 {
-    int ret;
+    int ret, waited = 0;
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
 
     while ((ret = SSL_write(ctx->ssl, buf, bufsize)) <= 0) {
-	if (SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_WRITE)
+	if (!rfbssl_wait(cl, ctx->ssl, ret, &waited))
 	    break;
     }
     return ret;
 }
 
+int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
+{
+    struct iovec iov;
+
+    iov.iov_base = (char *)buf;
+    iov.iov_len = bufsize;
+    return rfbssl_writev(cl, &iov, 1);
+}
+
+/*
+ * Gather-write: the data is handed to SSL_write() in pieces of exactly one
+ * maximum-size record, so each record carries as much payload per MAC and
+ * syscall as possible.  Full records are encrypted straight from the
+ * caller's buffers; whatever straddles buffer boundaries is collected in a
+ * staging buffer first.  Returns the number of bytes written, which is all
+ * of them unless an error occurred.  Only bytes of records SSL_write()
+ * accepted count as written: staged bytes whose record failed are dropped
+ * from the stage again and left for the caller to retry.
+ */
+int rfbssl_writev(rfbClientPtr cl, const struct iovec *iov, int iovcnt)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+    int i, ret, total = 0;
+
+    if (!ctx->stage && NULL == (ctx->stage = malloc(RFBSSL_RECORD_SIZE))) {
+	rfbErr("OOM\n");
+	return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+	const char *buf = (const char *)iov[i].iov_base;
+	int len = iov[i].iov_len;
+
+	while (len > 0) {
+	    int n;
+
+	    if (ctx->stagelen == 0 && len >= RFBSSL_RECORD_SIZE) {
+		if ((ret = rfbssl_write_record(cl, buf, RFBSSL_RECORD_SIZE)) <= 0)
+		    return total ? total : ret;
+		n = ret;
+		total += n;
+	    } else {
+		n = RFBSSL_RECORD_SIZE - ctx->stagelen;
+		if (n > len)
+		    n = len;
+		memcpy(ctx->stage + ctx->stagelen, buf, n);
+		ctx->stagelen += n;
+		if (ctx->stagelen == RFBSSL_RECORD_SIZE) {
+		    ret = rfbssl_write_record(cl, ctx->stage, ctx->stagelen);
+		    if (ret <= 0) {
+			ctx->stagelen = 0;
+			return total ? total : ret;
+		    }
+		    total += ctx->stagelen;
+		    ctx->stagelen = 0;
+		}
+	    }
+	    buf += n;
+	    len -= n;
+	}
+    }
+
+    if (ctx->stagelen > 0) {
+	ret = rfbssl_write_record(cl, ctx->stage, ctx->stagelen);
+	if (ret <= 0) {
+	    ctx->stagelen = 0;
+	    return total ? total : ret;
+	}
+	total += ctx->stagelen;
+	ctx->stagelen = 0;
+    }
+    return total;
+}
+
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize)
 {
     int ret;
@@ -128,8 +313,12 @@ int rfbssl_pending(rfbClientPtr cl)
 void rfbssl_destroy(rfbClientPtr cl)
 {
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
-    if (ctx->ssl)
+    if (ctx->ssl) {
+	/* an orderly shutdown keeps the session resumable */
+	SSL_shutdown(ctx->ssl);
 	SSL_free(ctx->ssl);
-    if (ctx->ssl_ctx)
-	SSL_CTX_free(ctx->ssl_ctx);
+    }
+    free(ctx->stage);
+    free(ctx);
+    cl->sslctx = NULL;
 }
@@ -29,6 +29,7 @@
 #define _BSD_SOURCE
 #endif
 #include <string.h>
+#include <stdint.h>
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
@@ -54,6 +55,12 @@
 #endif
 #endif
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef DEBUGPROTO
 #undef DEBUGPROTO
 #define DEBUGPROTO(x) x
@@ -137,153 +144,1110 @@ void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int
     if (*y+*h > to->height) *h=to->height - *y;
 }
 
-void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0)
+/*
+ * Separable filters for arbitrary, non-integer scaling ratios.
+ *
+ * For every destination pixel of an axis a table holds the first source
+ * pixel it reads, the number of source pixels (taps) and their fixed-point
+ * weights, which add up to exactly 1 << SCALE_WEIGHT_BITS.  The tables are
+ * built once per source size, destination size and filter and kept with
+ * the scaled screen.  The filter is applied in two passes: the source rows
+ * of a destination row are weighted into 16 bit intermediates (8.6 fixed
+ * point, signed because Lanczos has negative lobes), which are then reduced
+ * horizontally and clamped.  Both passes work on four 8 bit channels per
+ * pixel, so 32 bpp framebuffers with 8 bit channels are filtered in place
+ * and other true colour formats are unpacked to that layout first.
+ *
+ * RFB_SCALE_AREA averages the source area covered by a destination pixel,
+ * RFB_SCALE_BILINEAR and RFB_SCALE_LANCZOS2 are the triangle and two-lobe
+ * Lanczos kernels, widened by the ratio when downscaling.
+ */
+
+#define SCALE_WEIGHT_BITS 14
+#define SCALE_MID_SHIFT   8   /* vertical sums -> 8.6 intermediates */
+#define SCALE_OUT_SHIFT   (2 * SCALE_WEIGHT_BITS - SCALE_MID_SHIFT)
+
+typedef struct {
+    int src, dst, filter;  /* what the table was built for */
+    int maxTaps;
+    int *first;            /* first source pixel of each destination pixel */
+    int *taps;             /* number of source pixels it reads */
+    int16_t *weight;       /* maxTaps weights per destination pixel */
+} rfbScaleTaps;
+
+#define SCALE_PI 3.14159265358979323846
+
+static int scaleFloor(double x)
 {
-    int x,y,w,v,z;
-    int x1, y1, w1, h1;
-    int bitsPerPixel, bytesPerPixel, bytesPerLine, areaX, areaY, area2;
-    unsigned char *srcptr, *dstptr;
+    int i = (int)x;
+    return i - (x < i);
+}
 
-    /* Nothing to do!!! */
-    if (screen==ptr) return;
+/* sine without libm, good to about 1e-6 */
+static double scaleSin(double x)
+{
+    double x2;
+    while (x > SCALE_PI) x -= 2 * SCALE_PI;
+    while (x < -SCALE_PI) x += 2 * SCALE_PI;
+    if (x > SCALE_PI / 2) x = SCALE_PI - x;
+    if (x < -SCALE_PI / 2) x = -SCALE_PI - x;
+    x2 = x * x;
+    return x * (1 - x2 / 6 * (1 - x2 / 20 * (1 - x2 / 42 * (1 - x2 / 72 * (1 - x2 / 110)))));
+}
+
+/* filter support in destination pixels */
+static double scaleRadius(int filter)
+{
+    switch (filter) {
+    case RFB_SCALE_BILINEAR: return 1.0;
+    case RFB_SCALE_LANCZOS2: return 2.0;
+    default:                 return 0.5;
+    }
+}
 
-    x1 = x0;
-    y1 = y0;
-    w1 = w0;
-    h1 = h0;
+static double scaleKernel(int filter, double x)
+{
+    if (x < 0)
+        x = -x;
+    switch (filter) {
+    case RFB_SCALE_BILINEAR:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case RFB_SCALE_LANCZOS2:
+        if (x < 1e-6)
+            return 1.0;
+        if (x >= 2.0)
+            return 0.0;
+        return 2.0 * scaleSin(SCALE_PI * x) * scaleSin(SCALE_PI * x / 2) / (SCALE_PI * SCALE_PI * x * x);
+    default:
+        return 0.0;
+    }
+}
 
-    rfbScaledCorrection(screen, ptr, &x1, &y1, &w1, &h1, "rfbScaledScreenUpdateRect");
-    x0 = ScaleX(ptr, screen, x1);
-    y0 = ScaleY(ptr, screen, y1);
-    w0 = ScaleX(ptr, screen, w1);
-    h0 = ScaleY(ptr, screen, h1);
-
-    bitsPerPixel = screen->bitsPerPixel;
-    bytesPerPixel = bitsPerPixel / 8;
-    bytesPerLine = w1 * bytesPerPixel;
-    srcptr = (unsigned char *)(screen->frameBuffer +
-     (y0 * screen->paddedWidthInBytes + x0 * bytesPerPixel));
-    dstptr = (unsigned char *)(ptr->frameBuffer +
-     ( y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
-    /* The area of the source framebuffer for each destination pixel */
-    areaX = ScaleX(ptr,screen,1);
-    areaY = ScaleY(ptr,screen,1);
-    area2 = areaX*areaY;
+/* source pixels a change must be widened by to reach every destination
+ * pixel whose filter support it falls into */
+static int scalePadding(int filter, int src, int dst)
+{
+    double s = (double)src / dst;
+    if (filter == RFB_SCALE_AREA)
+        return 0;
+    return scaleFloor(scaleRadius(filter) * (s > 1.0 ? s : 1.0)) + 1;
+}
+
+static void scaleTapsFree(rfbScaleTaps *t)
+{
+    free(t->first);
+    free(t->weight);
+    t->first = t->taps = NULL;
+    t->weight = NULL;
+    t->dst = 0;
+}
 
+/* turn one destination pixel's raw weights into fixed point */
+static void scaleNormalize(int16_t *w, const double *fw, int n)
+{
+    double sum = 0;
+    int i, total = 0, big = 0;
 
-    /* Ensure that we do not go out of bounds */
-    if ((x1+w1) > (ptr->width))
-    {
-      if (x1==0) w1=ptr->width; else x1 = ptr->width - w1;
+    for (i = 0; i < n; i++)
+        sum += fw[i];
+    for (i = 0; i < n; i++) {
+        double v = fw[i] / sum * (1 << SCALE_WEIGHT_BITS);
+        w[i] = (int16_t)scaleFloor(v + 0.5);
+        total += w[i];
+        if (w[i] > w[big])
+            big = i;
     }
-    if ((y1+h1) > (ptr->height))
-    {
-      if (y1==0) h1=ptr->height; else y1 = ptr->height - h1;
+    /* hand the rounding loss to the largest weight */
+    w[big] += (1 << SCALE_WEIGHT_BITS) - total;
+}
+
+static rfbBool scaleTapsBuild(rfbScaleTaps *t, int src, int dst, int filter)
+{
+    double scale = (double)src / dst, s = scale > 1.0 ? scale : 1.0;
+    double support = scaleRadius(filter) * s, *fw;
+    int d, i;
+
+    scaleTapsFree(t);
+    if (filter == RFB_SCALE_AREA)
+        t->maxTaps = (src + dst - 1) / dst + 1;
+    else
+        t->maxTaps = scaleFloor(2 * support) + 2;
+    t->first = malloc(2 * dst * sizeof(int));
+    t->weight = malloc((size_t)dst * t->maxTaps * sizeof(int16_t));
+    fw = malloc(t->maxTaps * sizeof(double));
+    if (t->first == NULL || t->weight == NULL || fw == NULL) {
+        free(fw);
+        scaleTapsFree(t);
+        return FALSE;
     }
-    /*
-     * rfbLog("rfbScaledScreenUpdateRect(%dXx%dY-%dWx%dH  ->  %dXx%dY-%dWx%dH <%dx%d>) {%dWx%dH -> %dWx%dH} 0x%p\n",
-     *    x0, y0, w0, h0, x1, y1, w1, h1, areaX, areaY,
-     *    screen->width, screen->height, ptr->width, ptr->height, ptr->frameBuffer);
-     */
+    t->taps = t->first + dst;
+
+    for (d = 0; d < dst; d++) {
+        int first, last;
+
+        if (filter == RFB_SCALE_AREA) {
+            /* overlap of [d*src/dst, (d+1)*src/dst) with each source
+             * pixel, in units of 1/dst source pixels */
+            long begin = (long)d * src, end = begin + src;
+            first = (int)(begin / dst);
+            last = (int)((end - 1) / dst);
+            if (last >= src)
+                last = src - 1;
+            for (i = first; i <= last; i++) {
+                long lo = (long)i * dst, hi = lo + dst;
+                if (lo < begin) lo = begin;
+                if (hi > end) hi = end;
+                fw[i - first] = (double)(hi - lo);
+            }
+        } else {
+            /* kernel centred on the destination pixel centre, cut off at
+             * the framebuffer edges */
+            double centre = (d + 0.5) * scale - 0.5;
+            first = scaleFloor(centre - support) + 1;
+            last = scaleFloor(centre + support);
+            if (first < 0) first = 0;
+            if (last >= src) last = src - 1;
+            if (last < first)
+                first = last = first < src ? first : src - 1;
+            for (i = first; i <= last; i++)
+                fw[i - first] = scaleKernel(filter, (i - centre) / s);
+            if (last == first)
+                fw[0] = 1.0;
+        }
+        t->first[d] = first;
+        t->taps[d] = last - first + 1;
+        scaleNormalize(t->weight + d * t->maxTaps, fw, last - first + 1);
+    }
+
+    free(fw);
+    t->src = src;
+    t->dst = dst;
+    t->filter = filter;
+    return TRUE;
+}
+
+/* acc[i] += row[i] * weight, n a multiple of 4 */
+static void scaleAccumulateRow(int32_t *acc, const unsigned char *row, int n, int weight)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(row + i);
+        int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+        int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+        vst1q_s32(acc + i,      vmlal_n_s16(vld1q_s32(acc + i),      vget_low_s16(lo),  weight));
+        vst1q_s32(acc + i + 4,  vmlal_n_s16(vld1q_s32(acc + i + 4),  vget_high_s16(lo), weight));
+        vst1q_s32(acc + i + 8,  vmlal_n_s16(vld1q_s32(acc + i + 8),  vget_low_s16(hi),  weight));
+        vst1q_s32(acc + i + 12, vmlal_n_s16(vld1q_s32(acc + i + 12), vget_high_s16(hi), weight));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w = _mm_set1_epi16((short)weight);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i halves[2];
+        int h;
+        halves[0] = _mm_unpacklo_epi8(v, zero);
+        halves[1] = _mm_unpackhi_epi8(v, zero);
+        for (h = 0; h < 2; h++) {
+            __m128i pl = _mm_mullo_epi16(halves[h], w);
+            __m128i ph = _mm_mulhi_epi16(halves[h], w);
+            __m128i *a = (__m128i *)(acc + i + 8 * h);
+            _mm_storeu_si128(a,     _mm_add_epi32(_mm_loadu_si128(a),     _mm_unpacklo_epi16(pl, ph)));
+            _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(pl, ph)));
+        }
+    }
+#endif
+    for (; i < n; i++)
+        acc[i] += row[i] * weight;
+}
+
+/* mid[i] = acc[i] in 8.6 fixed point, n a multiple of 4 */
+static void scaleNarrowRow(int16_t *mid, const int32_t *acc, int n)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4)
+        vst1_s16(mid + i, vrshrn_n_s32(vld1q_s32(acc + i), SCALE_MID_SHIFT));
+#elif defined(__SSE2__)
+    const __m128i round = _mm_set1_epi32(1 << (SCALE_MID_SHIFT - 1));
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_srai_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + i)), round), SCALE_MID_SHIFT);
+        __m128i b = _mm_srai_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + i + 4)), round), SCALE_MID_SHIFT);
+        _mm_storeu_si128((__m128i *)(mid + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < n; i++)
+        mid[i] = (int16_t)((acc[i] + (1 << (SCALE_MID_SHIFT - 1))) >> SCALE_MID_SHIFT);
+}
+
+/* reduce taps intermediate pixels into one 4 channel output pixel */
+static void scaleReducePixel(unsigned char *out, const int16_t *mid, const int16_t *w, int taps)
+{
+    int t = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    int16x4_t px16;
+    uint8x8_t px;
+    uint32_t v;
+    for (; t < taps; t++)
+        acc = vmlal_n_s16(acc, vld1_s16(mid + 4 * t), w[t]);
+    px16 = vqmovn_s32(vrshrq_n_s32(acc, SCALE_OUT_SHIFT));
+    px = vqmovun_s16(vcombine_s16(px16, px16));
+    v = vget_lane_u32(vreinterpret_u32_u8(px), 0);
+    memcpy(out, &v, 4);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_set1_epi32(1 << (SCALE_OUT_SHIFT - 1));
+    int v;
+    /* two pixels at a time: interleave their channels and multiply-add
+     * against the interleaved pair of weights (all values fit in int16) */
+    for (; t + 2 <= taps; t += 2) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(mid + 4 * t));
+        __m128i ab = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(ab, _mm_set1_epi32((uint16_t)w[t] | ((uint32_t)(uint16_t)w[t + 1] << 16))));
+    }
+    if (t < taps) {
+        __m128i p = _mm_loadl_epi64((const __m128i *)(mid + 4 * t));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(p, _mm_setzero_si128()),
+                                                _mm_set1_epi32((uint16_t)w[t])));
+    }
+    acc = _mm_srai_epi32(acc, SCALE_OUT_SHIFT);
+    acc = _mm_packs_epi32(acc, acc);
+    v = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+    memcpy(out, &v, 4);
+#else
+    int32_t acc[4] = { 0, 0, 0, 0 };
+    int c;
+    for (; t < taps; t++)
+        for (c = 0; c < 4; c++)
+            acc[c] += mid[4 * t + c] * w[t];
+    for (c = 0; c < 4; c++) {
+        int32_t v = (acc[c] + (1 << (SCALE_OUT_SHIFT - 1))) >> SCALE_OUT_SHIFT;
+        out[c] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+#endif
+}
+
+static uint32_t scaleGetPixel(const unsigned char *p, int bytesPerPixel)
+{
+    uint32_t v = 0;
+    int z;
+    switch (bytesPerPixel) {
+    case 4: return *((const uint32_t *)p);
+    case 2: return *((const uint16_t *)p);
+    case 1: return *p;
+    default:
+        /* fixme: endianness problem? */
+        for (z = 0; z < bytesPerPixel; z++)
+            v += (p[z] << (8 * z));
+        return v;
+    }
+}
 
-    if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
-      unsigned char *srcptr2;
-      unsigned long pixel_value, red, green, blue;
-      unsigned int redShift = screen->serverFormat.redShift;
-      unsigned int greenShift = screen->serverFormat.greenShift;
-      unsigned int blueShift = screen->serverFormat.blueShift;
-      unsigned long redMax = screen->serverFormat.redMax;
-      unsigned long greenMax = screen->serverFormat.greenMax;
-      unsigned long blueMax = screen->serverFormat.blueMax;
-
-     /* for each *destination* pixel... */
-     for (y = 0; y < h1; y++) {
-       for (x = 0; x < w1; x++) {
-         red = green = blue = 0;
-         /* Get the totals for rgb from the source grid... */
-         for (w = 0; w < areaX; w++) {
-           for (v = 0; v < areaY; v++) {
-             srcptr2 = &srcptr[(((x * areaX) + w) * bytesPerPixel) +
-                               (v * screen->paddedWidthInBytes)];
-             pixel_value = 0;
-
-
-             switch (bytesPerPixel) {
-             case 4: pixel_value = *((unsigned int *)srcptr2);   break;
-             case 2: pixel_value = *((unsigned short *)srcptr2); break;
-             case 1: pixel_value = *((unsigned char *)srcptr2);  break;
-             default:
-               /* fixme: endianness problem? */
-               for (z = 0; z < bytesPerPixel; z++)
-                 pixel_value += (srcptr2[z] << (8 * z));
+static void scalePutPixel(unsigned char *p, int bytesPerPixel, uint32_t v)
+{
+    int z;
+    switch (bytesPerPixel) {
+    case 4: *((uint32_t *)p) = v; break;
+    case 2: *((uint16_t *)p) = (uint16_t)v; break;
+    case 1: *p = (unsigned char)v; break;
+    default:
+        /* fixme: endianness problem? */
+        for (z = 0; z < bytesPerPixel; z++)
+            p[z] = (v >> (8 * z)) & 0xff;
+        break;
+    }
+}
+
+/* split n pixels into 4 byte r, g, b, 0 channel values */
+static void scaleUnpackRow(unsigned char *dst, const unsigned char *src, int n, int bytesPerPixel, const rfbPixelFormat *f)
+{
+    int i;
+    for (i = 0; i < n; i++, src += bytesPerPixel, dst += 4) {
+        uint32_t v = scaleGetPixel(src, bytesPerPixel);
+        dst[0] = (v >> f->redShift) & f->redMax;
+        dst[1] = (v >> f->greenShift) & f->greenMax;
+        dst[2] = (v >> f->blueShift) & f->blueMax;
+        dst[3] = 0;
+    }
+}
+
+/*
+ * Scaled screens are brought up to date lazily.  Marking the original
+ * screen as modified only flags the affected source tiles; rfbScaledScreenSync()
+ * rescales the flagged tiles a client is about to receive, and only those
+ * whose contents actually changed, since the framebuffer is commonly marked
+ * as modified as a whole.
+ *
+ * The change tracking is shared by all scaled screens of a server through a
+ * pyramid kept with the original screen.  It hashes a flagged tile once, no
+ * matter how many scaled screens there are, stamps the tiles that changed
+ * with a new generation, and keeps 1/2, 1/4 and 1/8 size copies of the
+ * framebuffer, each averaged 2x2 from the one above and updated tile by tile.
+ * A scaled screen remembers the generation it last scaled every tile from
+ * and is filtered from the smallest level that is still at least its own
+ * size, so that thumbnails only read a fraction of the framebuffer.
+ */
+
+#define SCALE_TILE 64
+#define SCALE_LEVELS 3   /* 1/2, 1/4 and 1/8, SCALE_TILE must divide by 8 */
+
+enum { TILE_CLEAN, TILE_DIRTY, TILE_INVALID };
+
+/*
+ * Marking happens on the thread that changes the framebuffer and only
+ * takes markMutex.  A sync takes the flagged tiles it needs under both
+ * mutexes, hashes and halves them with neither held and then publishes
+ * their generations under mutex.  While a sync holds a tile, its hash and
+ * its part of the levels are that sync's alone.
+ */
+typedef struct _rfbScalePyramid {
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    MUTEX(mutex);          /* guards everything but state and the level pixels */
+    MUTEX(markMutex);      /* guards state; the sizes change under both */
+    COND(idleCond);        /* broadcast when readers, hashing or a claim drop */
+#endif
+    int srcWidth, srcHeight, bitsPerPixel;
+    rfbPixelFormat format;
+    int cols, rows;
+    unsigned char *state;  /* TILE_* per source tile */
+    unsigned char *claimed; /* state a tile was taken in by a sync, 0 if none */
+    uint32_t *hash;        /* two words of content hash per source tile */
+    uint64_t *gen;         /* generation of each tile's contents, 0 before the first sync */
+    uint64_t clock;        /* last generation handed out */
+    int depth;             /* levels built so far */
+    rfbScreenInfoPtr level[SCALE_LEVELS];
+    int readers;           /* syncs filtering from the levels right now */
+    int hashing;           /* syncs hashing claimed tiles right now */
+} rfbScalePyramid;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+/* several syncs and a resize may wait on idleCond at once */
+#define SCALE_WAKE_ALL(p) pthread_cond_broadcast(&(p)->idleCond)
+#else
+#define SCALE_WAKE_ALL(p)
+#endif
+
+typedef struct _rfbScaleCache {
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    MUTEX(syncMutex);      /* one rescale of a scaled screen at a time */
+#endif
+    int cols, rows;
+    int level;             /* pyramid level the tiles were scaled from */
+    uint64_t *seen;        /* generation each tile was last scaled from */
+    unsigned char *work;   /* tiles taken by the running sync */
+    rfbScaleTaps tx, ty;   /* weight tables */
+} rfbScaleCache;
+
+static rfbScalePyramid *scalePyramidNew(void)
+{
+    rfbScalePyramid *p = calloc(1, sizeof(rfbScalePyramid));
+    if (p != NULL) {
+        INIT_MUTEX(p->mutex);
+        INIT_MUTEX(p->markMutex);
+        INIT_COND(p->idleCond);
+    }
+    return p;
+}
+
+static void scalePyramidFreeLevels(rfbScalePyramid *p)
+{
+    int l;
+    for (l = 0; l < SCALE_LEVELS; l++) {
+        if (p->level[l] != NULL) {
+            free(p->level[l]->frameBuffer);
+            free(p->level[l]);
+            p->level[l] = NULL;
+        }
+    }
+    p->depth = 0;
+}
+
+static void scalePyramidFree(rfbScalePyramid *p)
+{
+    if (p == NULL)
+        return;
+    scalePyramidFreeLevels(p);
+    TINI_MUTEX(p->mutex);
+    TINI_MUTEX(p->markMutex);
+    TINI_COND(p->idleCond);
+    free(p->state);
+    free(p->claimed);
+    free(p->hash);
+    free(p->gen);
+    free(p);
+}
+
+/* with the mutex held: start over for the current source framebuffer */
+static void scalePyramidResize(rfbScalePyramid *p, rfbScreenInfoPtr screen)
+{
+    int tiles;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /* nobody may be reading or writing the levels that are about to go */
+    while (p->readers > 0 || p->hashing > 0)
+        WAIT(p->idleCond, p->mutex);
+#endif
+    scalePyramidFreeLevels(p);
+    LOCK(p->markMutex);
+    p->srcWidth = screen->width;
+    p->srcHeight = screen->height;
+    p->bitsPerPixel = screen->bitsPerPixel;
+    p->format = screen->serverFormat;
+    p->cols = (screen->width + SCALE_TILE - 1) / SCALE_TILE;
+    p->rows = (screen->height + SCALE_TILE - 1) / SCALE_TILE;
+    tiles = p->cols * p->rows;
+    free(p->state);
+    free(p->claimed);
+    free(p->hash);
+    free(p->gen);
+    p->state = malloc(tiles);
+    p->claimed = calloc(tiles, 1);
+    p->hash = malloc(tiles * 2 * sizeof(uint32_t));
+    p->gen = calloc(tiles, sizeof(uint64_t));
+    if (p->state == NULL || p->claimed == NULL || p->hash == NULL || p->gen == NULL) {
+        free(p->state);
+        free(p->claimed);
+        free(p->hash);
+        free(p->gen);
+        p->state = NULL;
+        p->claimed = NULL;
+        p->hash = NULL;
+        p->gen = NULL;
+        p->cols = p->rows = 0;
+    } else
+        memset(p->state, TILE_INVALID, tiles);
+    UNLOCK(p->markMutex);
+}
+
+/* flag the source tiles touching [x1,x2) x [y1,y2) */
+static void scalePyramidMark(rfbScalePyramid *p, int x1, int y1, int x2, int y2)
+{
+    int tx, ty;
+
+    LOCK(p->markMutex);
+    /* a source of another size is caught up with by the next sync */
+    if (p->state != NULL) {
+        if (x2 > p->srcWidth) x2 = p->srcWidth;
+        if (y2 > p->srcHeight) y2 = p->srcHeight;
+        for (ty = y1 / SCALE_TILE; ty * SCALE_TILE < y2; ty++)
+            for (tx = x1 / SCALE_TILE; tx * SCALE_TILE < x2; tx++) {
+                unsigned char *s = &p->state[ty * p->cols + tx];
+                if (*s == TILE_CLEAN)
+                    *s = TILE_DIRTY;
+            }
+    }
+    UNLOCK(p->markMutex);
+}
+
+static rfbScaleCache *scaleCacheNew(void)
+{
+    rfbScaleCache *c = calloc(1, sizeof(rfbScaleCache));
+    if (c != NULL)
+        INIT_MUTEX(c->syncMutex);
+    return c;
+}
+
+static void scaleCacheFree(rfbScaleCache *c)
+{
+    if (c == NULL)
+        return;
+    TINI_MUTEX(c->syncMutex);
+    free(c->seen);
+    free(c->work);
+    scaleTapsFree(&c->tx);
+    scaleTapsFree(&c->ty);
+    free(c);
+}
+
+/* rescale every tile at the next sync */
+static void scaleCacheInvalidate(rfbScaleCache *c)
+{
+    LOCK(c->syncMutex);
+    if (c->seen != NULL)
+        memset(c->seen, 0, c->cols * c->rows * sizeof(uint64_t));
+    UNLOCK(c->syncMutex);
+}
+
+static void scaleTileHash(rfbScreenInfoPtr screen, int x, int y, int w, int h, uint32_t *out)
+{
+    int bytes = w * (screen->bitsPerPixel / 8), i;
+    const unsigned char *row = (const unsigned char *)screen->frameBuffer +
+        y * screen->paddedWidthInBytes + x * (screen->bitsPerPixel / 8);
+    uint32_t a = 0x811c9dc5, b = 0x9e3779b9, v[2];
+
+    for (; h > 0; h--, row += screen->paddedWidthInBytes) {
+        for (i = 0; i + 8 <= bytes; i += 8) {
+            memcpy(v, row + i, 8);
+            a = (a ^ v[0]) * 0x01000193;
+            b = (b ^ v[1]) * 0x85ebca6b;
+        }
+        for (; i < bytes; i++)
+            a = (a ^ row[i]) * 0x01000193;
+        b ^= a >> 15;
+    }
+    out[0] = a;
+    out[1] = b;
+}
+
+static uint32_t scaleAverage4(const uint32_t *p, int shift, int max)
+{
+    uint32_t s = ((p[0] >> shift) & max) + ((p[1] >> shift) & max) +
+        ((p[2] >> shift) & max) + ((p[3] >> shift) & max) + 2;
+    return (s >> 2) << shift;
+}
+
+/* [x,x+w) x [y,y+h) of to, a level half the size of from, as the rounded
+ * average of the 2x2 pixels of from it covers; an odd last row or column
+ * of from is counted twice */
+static void scaleHalve(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int x, int y, int w, int h)
+{
+    const rfbPixelFormat *f = &from->serverFormat;
+    int bytesPerPixel = from->bitsPerPixel / 8, i, j;
+    rfbBool bytewise = bytesPerPixel == 4 &&
+        f->redMax == 255 && f->greenMax == 255 && f->blueMax == 255 &&
+        f->redShift % 8 == 0 && f->greenShift % 8 == 0 && f->blueShift % 8 == 0;
+
+    for (j = y; j < y + h; j++) {
+        const unsigned char *r0 = (const unsigned char *)from->frameBuffer +
+            2 * j * from->paddedWidthInBytes;
+        const unsigned char *r1 = 2 * j + 1 < from->height ? r0 + from->paddedWidthInBytes : r0;
+        unsigned char *out = (unsigned char *)to->frameBuffer +
+            j * to->paddedWidthInBytes + x * bytesPerPixel;
+
+        for (i = x; i < x + w; i++, out += bytesPerPixel) {
+            int x0 = 2 * i * bytesPerPixel;
+            int x1 = 2 * i + 1 < from->width ? x0 + bytesPerPixel : x0;
+            uint32_t p[4];
+
+            p[0] = scaleGetPixel(r0 + x0, bytesPerPixel);
+            p[1] = scaleGetPixel(r0 + x1, bytesPerPixel);
+            p[2] = scaleGetPixel(r1 + x0, bytesPerPixel);
+            p[3] = scaleGetPixel(r1 + x1, bytesPerPixel);
+            if (bytewise) {
+                /* all four bytes at once, two per 16 bit lane */
+                uint32_t lo = (p[0] & 0x00ff00ff) + (p[1] & 0x00ff00ff) +
+                    (p[2] & 0x00ff00ff) + (p[3] & 0x00ff00ff) + 0x00020002;
+                uint32_t hi = ((p[0] >> 8) & 0x00ff00ff) + ((p[1] >> 8) & 0x00ff00ff) +
+                    ((p[2] >> 8) & 0x00ff00ff) + ((p[3] >> 8) & 0x00ff00ff) + 0x00020002;
+                scalePutPixel(out, 4, ((lo >> 2) & 0x00ff00ff) | (((hi >> 2) & 0x00ff00ff) << 8));
+            } else
+                scalePutPixel(out, bytesPerPixel,
+                              scaleAverage4(p, f->redShift, f->redMax) |
+                              scaleAverage4(p, f->greenShift, f->greenMax) |
+                              scaleAverage4(p, f->blueShift, f->blueMax));
+        }
+    }
+}
+
+/* the pyramid level (0 for the framebuffer itself) a scaled screen is
+ * filtered from */
+static int scaleLevelFor(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr)
+{
+    const rfbPixelFormat *f = &screen->serverFormat;
+    int level = 0, w = screen->width, h = screen->height;
+
+    /* averaging needs true colour */
+    if (!f->trueColour || f->redMax > 255 || f->greenMax > 255 || f->blueMax > 255)
+        return 0;
+    while (level < SCALE_LEVELS && (w + 1) / 2 >= ptr->width && (h + 1) / 2 >= ptr->height) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        level++;
+    }
+    return level;
+}
+
+/* with the mutex held: add the next level, built from the one above */
+static rfbBool scalePyramidGrow(rfbScalePyramid *p, rfbScreenInfoPtr screen)
+{
+    rfbScreenInfoPtr from = p->depth == 0 ? screen : p->level[p->depth - 1];
+    rfbScreenInfoPtr lv = malloc(sizeof(rfbScreenInfo));
+
+    if (lv == NULL)
+        return FALSE;
+    memcpy(lv, from, sizeof(rfbScreenInfo));
+    lv->width = (from->width + 1) / 2;
+    lv->height = (from->height + 1) / 2;
+    lv->paddedWidthInBytes = pad4(lv->width * (lv->bitsPerPixel / 8));
+    lv->sizeInBytes = lv->paddedWidthInBytes * lv->height;
+    lv->scaledScreenNext = NULL;
+    lv->scaleCache = NULL;
+    lv->scalePyramid = NULL;
+    if ((lv->frameBuffer = malloc(lv->sizeInBytes)) == NULL) {
+        free(lv);
+        return FALSE;
+    }
+    /* tiles still flagged are redone for every level by the sync that
+     * takes them */
+    scaleHalve(from, lv, 0, 0, lv->width, lv->height);
+    p->level[p->depth++] = lv;
+    return TRUE;
+}
+
+/*
+ * With the mutex held: take the flagged tiles of region that no other sync
+ * holds and return how many, noting in *others whether some were held.
+ */
+static int scalePyramidClaim(rfbScalePyramid *p, sraRegionPtr region, int *claim, rfbBool *others)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    int tx, ty, n = 0;
+
+    *others = FALSE;
+    LOCK(p->markMutex);
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        int x2 = rfbMin(rect.x2, p->srcWidth), y2 = rfbMin(rect.y2, p->srcHeight);
+        for (ty = rfbMax(rect.y1, 0) / SCALE_TILE; ty * SCALE_TILE < y2; ty++)
+            for (tx = rfbMax(rect.x1, 0) / SCALE_TILE; tx * SCALE_TILE < x2; tx++) {
+                int t = ty * p->cols + tx;
+
+                if (p->claimed[t]) {
+                    /* the holder publishes it, it may have been marked since */
+                    *others = TRUE;
+                    continue;
+                }
+                if (p->state[t] == TILE_CLEAN)
+                    continue;
+                /* marks from now on are for the next sync */
+                p->claimed[t] = p->state[t];
+                p->state[t] = TILE_CLEAN;
+                claim[n++] = t;
+            }
+    }
+    sraRgnReleaseIterator(i);
+    UNLOCK(p->markMutex);
+    return n;
+}
+
+/*
+ * With the mutex held: make sure the levels down to want exist, then hash
+ * the flagged tiles of region and, for those that changed, refresh the
+ * levels and hand out a new generation.  The hashing and halving is done
+ * with the mutex released.
+ */
+static void scalePyramidSync(rfbScalePyramid *p, rfbScreenInfoPtr screen, sraRegionPtr region, int want)
+{
+    int *claim, tiles, n, k, l;
+    rfbBool others;
+
+    if (p->srcWidth != screen->width || p->srcHeight != screen->height ||
+        p->bitsPerPixel != screen->bitsPerPixel ||
+        memcmp(&p->format, &screen->serverFormat, sizeof(rfbPixelFormat)) != 0 ||
+        p->state == NULL)
+        scalePyramidResize(p, screen);
+    if (p->state == NULL)
+        return;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /* a new level is halved from the one above, which must hold still */
+    while (p->depth < want && p->hashing > 0)
+        WAIT(p->idleCond, p->mutex);
+    if (p->state == NULL)
+        return;
+#endif
+    while (p->depth < want)
+        if (!scalePyramidGrow(p, screen)) {
+            rfbErr("rfbScaledScreenSync: out of memory\n");
+            break;
+        }
+
+    tiles = p->cols * p->rows;
+    claim = malloc(tiles * sizeof(int));
+    if (claim == NULL) {
+        rfbErr("rfbScaledScreenSync: out of memory\n");
+        return;
+    }
+    for (;;) {
+        n = scalePyramidClaim(p, region, claim, &others);
+        if (n == 0) {
+            if (!others)
+                break;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+            /* the tiles held by other syncs have to be published first */
+            WAIT(p->idleCond, p->mutex);
+#endif
+            /* the source changed shape meanwhile, the next sync starts over */
+            if (p->state == NULL || p->cols * p->rows != tiles)
                 break;
-              }
-              /*
-              srcptr2 += bytesPerPixel;
-              */
-
-            red += ((pixel_value >> redShift) & redMax);
-            green += ((pixel_value >> greenShift) & greenMax);
-            blue += ((pixel_value >> blueShift) & blueMax);
-
-           }
-         }
-         /* We now have a total for all of the colors, find the average! */
-         red /= area2;
-         green /= area2;
-         blue /= area2;
-          /* Stuff the new value back into memory */
-         pixel_value = ((red & redMax) << redShift) | ((green & greenMax) << greenShift) | ((blue & blueMax) << blueShift);
-
-         switch (bytesPerPixel) {
-         case 4: *((unsigned int *)dstptr)   = (unsigned int)   pixel_value; break;
-         case 2: *((unsigned short *)dstptr) = (unsigned short) pixel_value; break;
-         case 1: *((unsigned char *)dstptr)  = (unsigned char)  pixel_value; break;
-         default:
-           /* fixme: endianness problem? */
-           for (z = 0; z < bytesPerPixel; z++)
-             dstptr[z]=(pixel_value >> (8 * z)) & 0xff;
+            continue;
+        }
+
+        /* resizes and new levels wait for this */
+        p->hashing++;
+        UNLOCK(p->mutex);
+        for (k = 0; k < n; k++) {
+            int t = claim[k], x = (t % p->cols) * SCALE_TILE, y = (t / p->cols) * SCALE_TILE;
+            int w = rfbMin(SCALE_TILE, p->srcWidth - x), h = rfbMin(SCALE_TILE, p->srcHeight - y);
+            uint32_t h2[2];
+
+            scaleTileHash(screen, x, y, w, h, h2);
+            if (p->claimed[t] == TILE_INVALID ||
+                h2[0] != p->hash[2 * t] || h2[1] != p->hash[2 * t + 1]) {
+                p->hash[2 * t] = h2[0];
+                p->hash[2 * t + 1] = h2[1];
+                for (l = 0; l < p->depth; l++) {
+                    rfbScreenInfoPtr lv = p->level[l];
+                    int lx = x >> (l + 1), ly = y >> (l + 1);
+                    scaleHalve(l == 0 ? screen : p->level[l - 1], lv, lx, ly,
+                               rfbMin(lx + (SCALE_TILE >> (l + 1)), lv->width) - lx,
+                               rfbMin(ly + (SCALE_TILE >> (l + 1)), lv->height) - ly);
+                }
+            } else
+                claim[k] = -1 - t;   /* unchanged */
+        }
+        LOCK(p->mutex);
+
+        for (k = 0; k < n; k++) {
+            int t = claim[k] >= 0 ? claim[k] : -1 - claim[k];
+            if (claim[k] >= 0)
+                p->gen[t] = ++p->clock;
+            p->claimed[t] = 0;
+        }
+        p->hashing--;
+        SCALE_WAKE_ALL(p);
+        /* tiles marked meanwhile are left for the next sync */
+        if (!others)
             break;
-          }
-          dstptr += bytesPerPixel;
-       }
-       srcptr += (screen->paddedWidthInBytes * areaY);
-       dstptr += (ptr->paddedWidthInBytes - bytesPerLine);
-     }
-   } else
-   { /* Not truecolour, so we can't blend. Just use the top-left pixel instead */
-     for (y = y1; y < (y1+h1); y++) {
-       for (x = x1; x < (x1+w1); x++)
-         memcpy (&ptr->frameBuffer[(y *ptr->paddedWidthInBytes) + (x * bytesPerPixel)],
-                 &screen->frameBuffer[(y * areaY * screen->paddedWidthInBytes) + (x *areaX * bytesPerPixel)], bytesPerPixel);
-     }
-  }
+    }
+    free(claim);
+}
+
+/* with the tables for screen -> ptr: rescale what a change of the given
+ * source rectangle affects */
+static void scaleRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, const rfbScaleTaps *tx, const rfbScaleTaps *ty,
+                      int x0, int y0, int w0, int h0)
+{
+    int x1, y1, w1, h1;
+    int x, y, t, bytesPerPixel, srcX0, srcW, padX, padY;
+    const rfbPixelFormat *f = &screen->serverFormat;
+    rfbBool direct, blend;
+    unsigned char *mem, *unpacked = NULL;
+    int32_t *acc = NULL;
+    int16_t *mid = NULL;
+
+    /* everything whose filter support reaches into the change */
+    padX = scalePadding(tx->filter, screen->width, ptr->width);
+    padY = scalePadding(ty->filter, screen->height, ptr->height);
+    x1 = x0 - padX;
+    y1 = y0 - padY;
+    w1 = w0 + 2 * padX;
+    h1 = h0 + 2 * padY;
+    if (x1 < 0) { w1 += x1; x1 = 0; }
+    if (y1 < 0) { h1 += y1; y1 = 0; }
+    if (x1 + w1 > screen->width)  w1 = screen->width - x1;
+    if (y1 + h1 > screen->height) h1 = screen->height - y1;
+
+    rfbScaledCorrection(screen, ptr, &x1, &y1, &w1, &h1, "rfbScaledScreenUpdateRect");
+
+    /* Ensure that we do not go out of bounds */
+    if (x1 < 0) { w1 += x1; x1 = 0; }
+    if (y1 < 0) { h1 += y1; y1 = 0; }
+    if (x1 + w1 > ptr->width)  w1 = ptr->width - x1;
+    if (y1 + h1 > ptr->height) h1 = ptr->height - y1;
+    if (w1 <= 0 || h1 <= 0 || screen->width <= 0 || screen->height <= 0)
+        return;
+
+    bytesPerPixel = screen->bitsPerPixel / 8;
+    blend = screen->serverFormat.trueColour &&
+        f->redMax <= 255 && f->greenMax <= 255 && f->blueMax <= 255;
+    /* 8 bit channels in a 32 bit pixel can be filtered bytewise */
+    direct = blend && bytesPerPixel == 4 &&
+        f->redMax == 255 && f->greenMax == 255 && f->blueMax == 255 &&
+        f->redShift % 8 == 0 && f->greenShift % 8 == 0 && f->blueShift % 8 == 0;
+
+    if (!blend) {
+        for (y = 0; y < h1; y++) {
+            /* Not truecolour, so we can't blend. Use the pixel that covers
+             * the centre of the destination pixel instead */
+            unsigned char *dstptr = (unsigned char *)ptr->frameBuffer +
+                (y1 + y) * ptr->paddedWidthInBytes + x1 * bytesPerPixel;
+            int sy = (int)(((2L * (y1 + y) + 1) * screen->height) / (2L * ptr->height));
+            const unsigned char *srcrow = (const unsigned char *)screen->frameBuffer +
+                sy * screen->paddedWidthInBytes;
+            for (x = 0; x < w1; x++, dstptr += bytesPerPixel) {
+                int sx = (int)(((2L * (x1 + x) + 1) * screen->width) / (2L * ptr->width));
+                memcpy(dstptr, srcrow + sx * bytesPerPixel, bytesPerPixel);
+            }
+        }
+        return;
+    }
+
+    /* the source columns this rectangle reads */
+    srcX0 = tx->first[x1];
+    srcW = 0;
+    for (x = x1; x < x1 + w1; x++)
+        srcW = rfbMax(srcW, tx->first[x] + tx->taps[x] - srcX0);
+
+    /* row buffers are per call, so that concurrent updates of different
+     * scaled screens do not share scratch memory */
+    mem = malloc((size_t)srcW * 4 * (sizeof(int32_t) + sizeof(int16_t) + (direct ? 0 : 1)));
+    if (mem == NULL) {
+        rfbErr("rfbScaledScreenUpdateRect: out of memory\n");
+        return;
+    }
+    acc = (int32_t *)mem;
+    mid = (int16_t *)(acc + srcW * 4);
+    if (!direct)
+        unpacked = (unsigned char *)(mid + srcW * 4);
+
+    for (y = y1; y < y1 + h1; y++) {
+        unsigned char *dstptr = (unsigned char *)ptr->frameBuffer +
+            y * ptr->paddedWidthInBytes + x1 * bytesPerPixel;
+
+        /* vertical pass: weighted sum of the source rows */
+        memset(acc, 0, srcW * 4 * sizeof(int32_t));
+        for (t = 0; t < ty->taps[y]; t++) {
+            const unsigned char *srcrow = (const unsigned char *)screen->frameBuffer +
+                (ty->first[y] + t) * screen->paddedWidthInBytes + srcX0 * bytesPerPixel;
+            if (!direct) {
+                scaleUnpackRow(unpacked, srcrow, srcW, bytesPerPixel, f);
+                srcrow = unpacked;
+            }
+            scaleAccumulateRow(acc, srcrow, srcW * 4, ty->weight[y * ty->maxTaps + t]);
+        }
+        scaleNarrowRow(mid, acc, srcW * 4);
+
+        /* horizontal pass */
+        for (x = x1; x < x1 + w1; x++, dstptr += bytesPerPixel) {
+            const int16_t *m = mid + (tx->first[x] - srcX0) * 4;
+            const int16_t *w = tx->weight + x * tx->maxTaps;
+            if (direct)
+                scaleReducePixel(dstptr, m, w, tx->taps[x]);
+            else {
+                unsigned char c[4];
+                scaleReducePixel(c, m, w, tx->taps[x]);
+                /* the channels were unpacked to 0..max, but the filters
+                 * overshoot and only 255 is clamped to */
+                scalePutPixel(dstptr, bytesPerPixel,
+                              ((uint32_t)rfbMin(c[0], f->redMax) << f->redShift) |
+                              ((uint32_t)rfbMin(c[1], f->greenMax) << f->greenShift) |
+                              ((uint32_t)rfbMin(c[2], f->blueMax) << f->blueShift));
+            }
+        }
+    }
+
+    free(mem);
+}
+
+/* with syncMutex held: the weight tables of the cache for screen -> ptr */
+static rfbBool scaleCacheTaps(rfbScaleCache *c, rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int filter)
+{
+    if (c->tx.dst != ptr->width || c->tx.src != screen->width || c->tx.filter != filter)
+        if (!scaleTapsBuild(&c->tx, screen->width, ptr->width, filter))
+            return FALSE;
+    if (c->ty.dst != ptr->height || c->ty.src != screen->height || c->ty.filter != filter)
+        if (!scaleTapsBuild(&c->ty, screen->height, ptr->height, filter))
+            return FALSE;
+    return TRUE;
+}
+
+void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0)
+{
+    rfbScaleCache *c = ptr->scaleCache;
+    rfbScaleTaps tx, ty;
+
+    /* Nothing to do!!! */
+    if (screen==ptr || screen->width <= 0 || screen->height <= 0) return;
+
+    if (c != NULL) {
+        LOCK(c->syncMutex);
+        if (scaleCacheTaps(c, screen, ptr, screen->scaleFilter))
+            scaleRect(screen, ptr, &c->tx, &c->ty, x0, y0, w0, h0);
+        else
+            rfbErr("rfbScaledScreenUpdateRect: out of memory\n");
+        UNLOCK(c->syncMutex);
+        return;
+    }
+
+    /* no cache to keep them in: build throwaway tables */
+    memset(&tx, 0, sizeof(tx));
+    memset(&ty, 0, sizeof(ty));
+    if (scaleTapsBuild(&tx, screen->width, ptr->width, screen->scaleFilter) &&
+        scaleTapsBuild(&ty, screen->height, ptr->height, screen->scaleFilter))
+        scaleRect(screen, ptr, &tx, &ty, x0, y0, w0, h0);
+    else
+        rfbErr("rfbScaledScreenUpdateRect: out of memory\n");
+    scaleTapsFree(&tx);
+    scaleTapsFree(&ty);
+}
+
+/*
+ * Bring the part of a scaled screen covering region (in coordinates of
+ * the original screen) up to date.
+ */
+void rfbScaledScreenSync(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, sraRegionPtr region)
+{
+    rfbScaleCache *c = ptr->scaleCache;
+    rfbScalePyramid *p = screen->scalePyramid;
+    rfbScreenInfoPtr from;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int tx, ty, level, shift, pending = 0;
+    rfbBool reading;
+
+    if (screen == ptr || c == NULL || p == NULL)
+        return;
+
+    LOCK(c->syncMutex);
+    level = scaleLevelFor(screen, ptr);
+
+    LOCK(p->mutex);
+    scalePyramidSync(p, screen, region, level);
+    if (level > p->depth)
+        level = p->depth;
+    if (c->cols != p->cols || c->rows != p->rows || c->seen == NULL) {
+        free(c->seen);
+        free(c->work);
+        c->cols = p->cols;
+        c->rows = p->rows;
+        c->seen = calloc(c->cols * c->rows, sizeof(uint64_t));
+        c->work = malloc(c->cols * c->rows);
+        if (c->seen == NULL || c->work == NULL) {
+            free(c->seen);
+            free(c->work);
+            c->seen = NULL;
+            c->work = NULL;
+        }
+    } else if (c->level != level)
+        memset(c->seen, 0, c->cols * c->rows * sizeof(uint64_t));
+    c->level = level;
+
+    /* take the tiles of this update that changed since this screen saw them */
+    if (c->seen != NULL && p->state != NULL) {
+        memset(c->work, 0, c->cols * c->rows);
+        i = sraRgnGetIterator(region);
+        while (sraRgnIteratorNext(i, &rect)) {
+            int x2 = rfbMin(rect.x2, p->srcWidth), y2 = rfbMin(rect.y2, p->srcHeight);
+            for (ty = rfbMax(rect.y1, 0) / SCALE_TILE; ty * SCALE_TILE < y2; ty++)
+                for (tx = rfbMax(rect.x1, 0) / SCALE_TILE; tx * SCALE_TILE < x2; tx++) {
+                    int t = ty * c->cols + tx;
+                    if (!c->work[t] && c->seen[t] != p->gen[t]) {
+                        c->seen[t] = p->gen[t];
+                        c->work[t] = 1;
+                        pending++;
+                    }
+                }
+        }
+        sraRgnReleaseIterator(i);
+    }
+    from = level == 0 ? screen : p->level[level - 1];
+    reading = pending > 0;
+    if (reading)
+        p->readers++;
+    UNLOCK(p->mutex);
+
+    if (reading && !scaleCacheTaps(c, from, ptr, screen->scaleFilter)) {
+        rfbErr("rfbScaledScreenSync: out of memory\n");
+        /* try again next time */
+        memset(c->seen, 0, c->cols * c->rows * sizeof(uint64_t));
+        pending = 0;
+    }
+
+    /* rescale the ones that changed, merging neighbours in a tile row;
+     * a level is 1 << level times smaller than the tiles */
+    shift = level;
+    for (ty = 0; pending > 0 && ty < c->rows; ty++) {
+        int y = (ty * SCALE_TILE) >> shift;
+        int h = rfbMin(SCALE_TILE >> shift, from->height - y);
+        int run = -1;
+
+        for (tx = 0; tx <= c->cols; tx++) {
+            rfbBool changed = tx < c->cols && c->work[ty * c->cols + tx];
+
+            if (changed) {
+                pending--;
+                if (run < 0)
+                    run = tx;
+            } else if (run >= 0) {
+                int x = (run * SCALE_TILE) >> shift;
+                scaleRect(from, ptr, &c->tx, &c->ty, x, y,
+                          rfbMin((tx * SCALE_TILE) >> shift, from->width) - x, h);
+                run = -1;
+            }
+        }
+    }
+
+    if (reading) {
+        LOCK(p->mutex);
+        if (--p->readers == 0)
+            SCALE_WAKE_ALL(p);
+        UNLOCK(p->mutex);
+    }
+
+    UNLOCK(c->syncMutex);
+}
+
+/*
+ * Widen region (in coordinates of the original screen) by the filter
+ * support: rescaling a change rewrites the scaled pixels whose support
+ * reaches into it, and those lie outside the scaled change for every
+ * filter but the area average.
+ */
+void rfbScaledScreenPadRegion(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, sraRegionPtr region)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    sraRegionPtr grown, r;
+    int level, l, w = screen->width, h = screen->height, padX, padY;
+
+    if (screen == ptr || screen->scaleFilter == RFB_SCALE_AREA || sraRgnEmpty(region))
+        return;
+
+    /* the padding scaleRect() uses on the level it filters from, in
+     * pixels of the original screen, plus one for the rounding there */
+    level = scaleLevelFor(screen, ptr);
+    for (l = 0; l < level; l++) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    padX = (scalePadding(screen->scaleFilter, w, ptr->width) + 1) << level;
+    padY = (scalePadding(screen->scaleFilter, h, ptr->height) + 1) << level;
+
+    grown = sraRgnCreate();
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        r = sraRgnCreateRect(rfbMax(rect.x1 - padX, 0), rfbMax(rect.y1 - padY, 0),
+                             rfbMin(rect.x2 + padX, screen->width), rfbMin(rect.y2 + padY, screen->height));
+        sraRgnOr(grown, r);
+        sraRgnDestroy(r);
+    }
+    sraRgnReleaseIterator(i);
+    sraRgnOr(region, grown);
+    sraRgnDestroy(grown);
 }
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
 {
     /* ok, now the task is to update each and every scaled version of the framebuffer
      * and we only have to do this for this specific changed rectangle!
+     * All of them share the change tracking of the pyramid.
      */
-    rfbScreenInfoPtr ptr;
-    int count=0;
+    if (screen->scalePyramid != NULL)
+        scalePyramidMark(screen->scalePyramid, x1, y1, x2, y2);
+}
 
-    /* We don't point to cl->screen as it is the original */
-    for (ptr=screen->scaledScreenNext;ptr!=NULL;ptr=ptr->scaledScreenNext)
-    {
-        /* Only update if it has active clients... */
-        if (ptr->scaledScreenRefCount>0)
-        {
-          rfbScaledScreenUpdateRect(screen, ptr, x1, y1, x2-x1, y2-y1);
-          count++;
-        }
-    }
+/* Free a scaled version of the framebuffer */
+void rfbScaledScreenFree(rfbScreenInfoPtr ptr)
+{
+    scaleCacheFree(ptr->scaleCache);
+    free(ptr->frameBuffer);
+    free(ptr);
+}
+
+/* Free the pyramid the scaled versions of the framebuffer were built from */
+void rfbScalePyramidFree(rfbScreenInfoPtr screen)
+{
+    scalePyramidFree(screen->scalePyramid);
+    screen->scalePyramid = NULL;
 }
 
 /* Create a new scaled version of the framebuffer */
 rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
 {
     rfbScreenInfoPtr ptr;
+    rfbScalePyramid *pyramid;
     ptr = malloc(sizeof(rfbScreenInfo));
     if (ptr!=NULL)
     {
@@ -318,12 +1282,17 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
         ptr->serverFormat = cl->screen->serverFormat;
 
         ptr->frameBuffer = malloc(ptr->sizeInBytes);
-        if (ptr->frameBuffer!=NULL)
+        ptr->scaleCache = scaleCacheNew();
+        /* the pyramid belongs to the original screen only */
+        ptr->scalePyramid = NULL;
+        pyramid = cl->screen->scalePyramid;
+        if (pyramid == NULL)
+            pyramid = scalePyramidNew();
+        if (ptr->frameBuffer!=NULL && ptr->scaleCache!=NULL && pyramid!=NULL)
         {
-            /* Reset to a known condition: scale the entire framebuffer */
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
-            /* Now, insert into the chain */
+            /* The first sync scales the entire framebuffer.  Now, insert into the chain */
             LOCK(cl->updateMutex);
+            cl->screen->scalePyramid = pyramid;
             ptr->scaledScreenNext = cl->screen->scaledScreenNext;
             cl->screen->scaledScreenNext = ptr;
             UNLOCK(cl->updateMutex);
@@ -331,6 +1300,10 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
         else
         {
             /* Failed to malloc the new frameBuffer, cleanup */
+            if (pyramid != cl->screen->scalePyramid)
+                scalePyramidFree(pyramid);
+            scaleCacheFree(ptr->scaleCache);
+            free(ptr->frameBuffer);
             free(ptr);
             ptr=NULL;
         }
@@ -338,10 +1311,45 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
     return ptr;
 }
 
-/* Find an active scaled version of the framebuffer
- * TODO: implement a refcount per scaled screen to prevent
- * unreferenced scaled screens from hanging around
+/*
+ * The scaled screens of a server form a pool keyed by size, shared by all
+ * clients that want the same size.  Lookups and reference counts are
+ * protected by scalePoolMutex; a client only switches screens while it is
+ * not sending an update (under its sendMutex), so a screen nobody refers to
+ * is not read by anyone and can be reshaped for the next size asked for.
  */
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_mutex_t scalePoolMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Give an unused scaled screen a new size instead of allocating another */
+static rfbScreenInfoPtr rfbScaledScreenReuse(rfbClientPtr cl, int width, int height)
+{
+    rfbScreenInfoPtr ptr;
+    int allocSize;
+    char *fb;
+
+    for (ptr=cl->screen->scaledScreenNext; ptr!=NULL; ptr=ptr->scaledScreenNext)
+        if (ptr->scaledScreenRefCount<1)
+            break;
+    if (ptr==NULL)
+        return NULL;
+
+    allocSize = pad4(width * (ptr->bitsPerPixel/8));
+    if (height == 0 || allocSize >= SIZE_MAX / height)
+        return NULL;
+    if ((fb = realloc(ptr->frameBuffer, allocSize * height)) == NULL)
+        return NULL;
+
+    ptr->frameBuffer = fb;
+    ptr->width = width;
+    ptr->height = height;
+    ptr->paddedWidthInBytes = allocSize;
+    ptr->sizeInBytes = allocSize * height;
+    return ptr;
+}
+
+/* Find an active scaled version of the framebuffer */
 rfbScreenInfoPtr rfbScalingFind(rfbClientPtr cl, int width, int height)
 {
     rfbScreenInfoPtr ptr;
@@ -354,20 +1362,23 @@ rfbScreenInfoPtr rfbScalingFind(rfbClientPtr cl, int width, int height)
     return NULL;
 }
 
-/* Future needs "scale to 320x240, as that's the client's screen size */
-void rfbScalingSetup(rfbClientPtr cl, int width, int height)
+/* Serve this client from a version of the framebuffer scaled to width x height */
+rfbBool rfbScalingSetup(rfbClientPtr cl, int width, int height)
 {
     rfbScreenInfoPtr ptr;
 
+    LOCK(scalePoolMutex);
     ptr = rfbScalingFind(cl,width,height);
+    if (ptr==NULL)
+        ptr = rfbScaledScreenReuse(cl,width,height);
     if (ptr==NULL)
         ptr = rfbScaledScreenAllocate(cl,width,height);
     /* Now, there is a new screen available (if ptr is not NULL) */
     if (ptr!=NULL)
     {
-        /* Update it! */
-        if (ptr->scaledScreenRefCount<1)
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+        /* Its tiles were not tracked while nobody used it, rescale all of them */
+        if (ptr->scaledScreenRefCount<1 && ptr->scaleCache!=NULL)
+            scaleCacheInvalidate(ptr->scaleCache);
         /*
          * rfbLog("Taking one from %dx%d-%d and adding it to %dx%d-%d\n",
          *    cl->scaledScreen->width, cl->scaledScreen->height,
@@ -375,17 +1386,30 @@ void rfbScalingSetup(rfbClientPtr cl, int width, int height)
          *    ptr->width, ptr->height, ptr->scaledScreenRefCount);
          */
 
+        LOCK(cl->sendMutex);
         LOCK(cl->updateMutex);
         cl->scaledScreen->scaledScreenRefCount--;
         ptr->scaledScreenRefCount++;
         cl->scaledScreen=ptr;
         cl->newFBSizePending = TRUE;
         UNLOCK(cl->updateMutex);
+        UNLOCK(cl->sendMutex);
 
         rfbLog("Scaling to %dx%d (refcount=%d)\n",width,height,ptr->scaledScreenRefCount);
     }
     else
         rfbLog("Scaling to %dx%d failed, leaving things alone\n",width,height);
+    UNLOCK(scalePoolMutex);
+
+    return ptr!=NULL;
+}
+
+/* Drop the reference of a departing client on its scaled screen */
+void rfbScalingRelease(rfbClientPtr cl)
+{
+    LOCK(scalePoolMutex);
+    cl->scaledScreen->scaledScreenRefCount--;
+    UNLOCK(scalePoolMutex);
 }
 
 int rfbSendNewScaleSize(rfbClientPtr cl)
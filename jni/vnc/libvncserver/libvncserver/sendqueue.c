@@ -0,0 +1,611 @@
+/*
+ * sendqueue.c - asynchronous per-client output queue.
+ *
+ * In threaded mode every client gets a writer thread which drains a queue
+ * of outgoing data.  rfbWriteExact() only appends to that queue, so a
+ * client whose socket stalls blocks nobody but its own writer thread: not
+ * the thread encoding its updates, not other threads holding
+ * cl->sendMutex or cl->updateMutex, and in particular never the thread
+ * calling rfbMarkRectAsModified().
+ *
+ * The queue is bounded: clientOutput() does not start a new
+ * FramebufferUpdate while more than screen->sendQueueLimit bytes are
+ * waiting.  Meanwhile modifications keep accumulating in
+ * cl->modifiedRegion and go out as a single update with the latest pixels
+ * once the client has caught up.  On top of that, a queued update that
+ * has not started going out yet is discarded as soon as a later update
+ * covering all of its region is queued behind it.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+#include "rfbssl.h"
+#endif
+
+/* small writes are coalesced into buffers of at least this size */
+#define SEND_QUEUE_CHUNK_SIZE 32768
+/* the writer hands at most this many buffers to one writev() */
+#define SEND_QUEUE_MAX_IOV 16
+
+typedef struct _rfbSendQueueBuf {
+    struct _rfbSendQueueBuf *next;
+    unsigned int update;   /* serial of the FramebufferUpdate, 0 for other messages */
+    int size;              /* allocated size of data */
+    int len;               /* bytes queued in data */
+    int pos;               /* bytes of data already written */
+    uint64_t modifiedAt;   /* set on the last buffer of an update, see rfbSendQueueEndUpdate() */
+    char data[1];
+} rfbSendQueueBuf;
+
+/* a complete update which may be discarded while it is still queued */
+typedef struct _rfbSendQueueUpdate {
+    struct _rfbSendQueueUpdate *next;
+    unsigned int serial;
+    sraRegionPtr region;
+    uint64_t modifiedAt;
+} rfbSendQueueUpdate;
+
+typedef struct _rfbSendQueue {
+    MUTEX(mutex);
+    COND(dataCond);        /* signalled when data was queued or on close */
+    COND(spaceCond);       /* signalled when data was written or on close */
+    pthread_t thread;
+
+    rfbSendQueueBuf *head, *tail;
+    int bytes;
+    int inflight;          /* buffers at head currently being written */
+
+    unsigned int serial;
+    unsigned int currentUpdate;
+    rfbSendQueueUpdate *droppable;
+
+    rfbBool closing;
+    rfbBool failed;
+
+    int droppedUpdates;
+    int droppedBytes;
+} rfbSendQueue;
+
+
+/*
+ * Find out where update "serial" is: returns -1 if no data of it is queued
+ * any more, 1 if it started going out and 0 if it can still be discarded.
+ */
+
+static int
+sendQueueState(rfbSendQueue *q, unsigned int serial)
+{
+    rfbSendQueueBuf *b;
+    int i;
+
+    for (b = q->head, i = 0; b; b = b->next, i++)
+        if (b->update == serial)
+            return (i < q->inflight || b->pos > 0) ? 1 : 0;
+    return -1;
+}
+
+
+/*
+ * Remove all queued data of update "serial", which must not have started
+ * going out.  Returns the number of bytes removed.
+ */
+
+static int
+sendQueueDiscard(rfbSendQueue *q, unsigned int serial)
+{
+    rfbSendQueueBuf **prev = &q->head, *b;
+    int bytes = 0;
+
+    q->tail = NULL;
+    while ((b = *prev) != NULL) {
+        if (b->update == serial) {
+            *prev = b->next;
+            bytes += b->len;
+            free(b);
+        } else {
+            q->tail = b;
+            prev = &b->next;
+        }
+    }
+    q->bytes -= bytes;
+    return bytes;
+}
+
+
+static void
+sendQueueFree(rfbSendQueue *q)
+{
+    rfbSendQueueBuf *b;
+    rfbSendQueueUpdate *u;
+
+    while ((b = q->head) != NULL) {
+        q->head = b->next;
+        free(b);
+    }
+    while ((u = q->droppable) != NULL) {
+        q->droppable = u->next;
+        sraRgnDestroy(u->region);
+        free(u);
+    }
+    TINI_COND(q->spaceCond);
+    TINI_COND(q->dataCond);
+    TINI_MUTEX(q->mutex);
+    free(q);
+}
+
+
+/*
+ * The writer thread.  It writes out as much of the queue as it can with
+ * one writev() (or one gathered SSL write, which then goes out in
+ * maximum-size records).  Like the synchronous rfbWriteExact(), it gives up
+ * on a client which did not accept any data for maxClientWait milliseconds.
+ */
+
+static void *
+sendQueueWriter(void *data)
+{
+    rfbClientPtr cl = (rfbClientPtr)data;
+    rfbSendQueue *q = cl->sendQueue;
+    const int timeout = cl->screen->maxClientWait ? cl->screen->maxClientWait : rfbMaxClientWait;
+    int totalTimeWaited = 0;
+    uint64_t started = 0;
+
+    while (1) {
+        rfbSendQueueBuf *b;
+        struct iovec iov[SEND_QUEUE_MAX_IOV];
+        int i, n, sock;
+        fd_set fds;
+        struct timeval tv;
+
+        LOCK(q->mutex);
+        while (!q->head && !q->closing) {
+            if (cl->socketCorked && !q->currentUpdate) {
+                /* drained and no update being queued: push out the rest */
+                UNLOCK(q->mutex);
+                rfbCorkClientSocket(cl, FALSE);
+                LOCK(q->mutex);
+                continue;
+            }
+            WAIT(q->dataCond, q->mutex);
+        }
+        if (q->closing) {
+            UNLOCK(q->mutex);
+            return NULL;
+        }
+        /* Other threads may append to the last of these buffers, but
+           never move or free them while they are in flight. */
+        for (b = q->head, i = 0; b && i < SEND_QUEUE_MAX_IOV; b = b->next, i++) {
+            iov[i].iov_base = b->data + b->pos;
+            iov[i].iov_len = b->len - b->pos;
+        }
+        q->inflight = i;
+        UNLOCK(q->mutex);
+
+        /* a batch the socket refused is timed until it is finally taken */
+        if (started == 0)
+            started = rfbLatencyClock();
+
+        if ((sock = cl->sock) == -1)
+            return NULL;
+
+        /* while there is a backlog, only send full segments */
+        rfbCorkClientSocket(cl, TRUE);
+
+        LOCK(cl->outputMutex);
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+        if (cl->sslctx)
+            n = rfbssl_writev(cl, iov, i);
+        else
+#endif
+            n = writev(sock, iov, i);
+        UNLOCK(cl->outputMutex);
+
+        if (n > 0) {
+            LOCK(q->mutex);
+            q->bytes -= n;
+            for (i = 0; n > 0; i++) {
+                int done = n < (int)iov[i].iov_len ? n : (int)iov[i].iov_len;
+                b = q->head;
+                b->pos += done;
+                n -= done;
+                if (b->pos == b->len) {
+                    if (b->modifiedAt)
+                        rfbLatencyRecord(&cl->latency[RFB_LATENCY_DELIVER],
+                                         rfbLatencyClock() - b->modifiedAt);
+                    q->head = b->next;
+                    if (q->head == NULL)
+                        q->tail = NULL;
+                    free(b);
+                }
+            }
+            q->inflight = 0;
+            TSIGNAL(q->spaceCond);
+            UNLOCK(q->mutex);
+            rfbLatencyRecord(&cl->latency[RFB_LATENCY_WRITE], rfbLatencyClock() - started);
+            started = 0;
+            totalTimeWaited = 0;
+            continue;
+        }
+
+        LOCK(q->mutex);
+        q->inflight = 0;
+        UNLOCK(q->mutex);
+
+        if (n == 0) {
+            rfbErr("sendQueueWriter: write returned 0?\n");
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+            rfbLogPerror("sendQueueWriter: write");
+            break;
+        }
+
+        /* Retry every 5 seconds until we exceed timeout, see rfbWriteExact() */
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        tv.tv_sec = 5;
+        tv.tv_usec = 0;
+        n = select(sock+1, NULL, &fds, NULL, &tv);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            rfbLogPerror("sendQueueWriter: select");
+            break;
+        }
+        if (n == 0) {
+            totalTimeWaited += 5000;
+            if (totalTimeWaited >= timeout) {
+                rfbLog("sendQueueWriter: client %s timed out\n", cl->host);
+                break;
+            }
+        }
+    }
+
+    LOCK(q->mutex);
+    q->failed = TRUE;
+    TSIGNAL(q->spaceCond);
+    UNLOCK(q->mutex);
+
+    rfbCloseClient(cl);
+    return NULL;
+}
+
+
+/*
+ * Set up the queue for a client, called from the client's input thread.
+ * Does nothing if screen->sendQueueLimit is not set.
+ */
+
+void
+rfbStartSendQueue(rfbClientPtr cl)
+{
+    rfbSendQueue *q;
+
+    if (cl->screen->sendQueueLimit <= 0 || cl->sendQueue)
+        return;
+
+    q = (rfbSendQueue *)calloc(1, sizeof(rfbSendQueue));
+    if (q == NULL) {
+        rfbErr("rfbStartSendQueue: out of memory, writing synchronously\n");
+        return;
+    }
+    INIT_MUTEX(q->mutex);
+    INIT_COND(q->dataCond);
+    INIT_COND(q->spaceCond);
+
+    cl->sendQueue = q;
+    if (pthread_create(&q->thread, NULL, sendQueueWriter, (void *)cl) != 0) {
+        rfbErr("rfbStartSendQueue: cannot start writer thread, writing synchronously\n");
+        cl->sendQueue = NULL;
+        sendQueueFree(q);
+    }
+}
+
+
+/*
+ * Wake up everyone waiting on the queue; the writer thread exits without
+ * sending what is left.  Called by rfbCloseClient().
+ */
+
+void
+rfbCloseSendQueue(rfbClientPtr cl)
+{
+    rfbSendQueue *q = cl->sendQueue;
+
+    if (q == NULL)
+        return;
+
+    LOCK(q->mutex);
+    q->closing = TRUE;
+    TSIGNAL(q->dataCond);
+    TSIGNAL(q->spaceCond);
+    UNLOCK(q->mutex);
+}
+
+
+/*
+ * Stop the writer thread and free the queue.  Called by
+ * rfbClientConnectionGone() once nobody else references the client.
+ */
+
+void
+rfbStopSendQueue(rfbClientPtr cl)
+{
+    rfbSendQueue *q = cl->sendQueue;
+
+    if (q == NULL)
+        return;
+
+    rfbCloseSendQueue(cl);
+    pthread_join(q->thread, NULL);
+    cl->sendQueue = NULL;
+
+    if (q->droppedUpdates)
+        rfbLog("Client %s: discarded %d superseded updates (%d bytes)\n",
+               cl->host, q->droppedUpdates, q->droppedBytes);
+
+    sendQueueFree(q);
+}
+
+
+/*
+ * Queue hlen bytes of hdr (a WebSockets frame header, may be empty)
+ * followed by len bytes of buf for sending.  Never blocks on the socket.
+ * Returns 1 on success and -1 if the client is gone, like rfbWriteExact().
+ */
+
+int
+rfbSendQueueWrite(rfbClientPtr cl, const char *hdr, int hlen,
+                  const char *buf, int len)
+{
+    rfbSendQueue *q = cl->sendQueue;
+    rfbSendQueueBuf *b;
+
+    /* an empty buffer at the head would make the writer see writev()
+       return 0, as if the socket were gone */
+    if (hlen + len == 0)
+        return 1;
+
+    LOCK(q->mutex);
+    if (q->closing || q->failed) {
+        UNLOCK(q->mutex);
+        errno = EPIPE;
+        return -1;
+    }
+
+    b = q->tail;
+    if (b == NULL || b->update != q->currentUpdate || b->size - b->len < hlen + len) {
+        int size = hlen + len > SEND_QUEUE_CHUNK_SIZE ? hlen + len : SEND_QUEUE_CHUNK_SIZE;
+
+        b = (rfbSendQueueBuf *)malloc(sizeof(rfbSendQueueBuf) + size);
+        if (b == NULL) {
+            UNLOCK(q->mutex);
+            rfbErr("rfbSendQueueWrite: out of memory\n");
+            errno = ENOMEM;
+            return -1;
+        }
+        b->next = NULL;
+        b->update = q->currentUpdate;
+        b->size = size;
+        b->len = 0;
+        b->pos = 0;
+        b->modifiedAt = 0;
+        if (q->tail)
+            q->tail->next = b;
+        else
+            q->head = b;
+        q->tail = b;
+    }
+
+    if (hlen) {
+        memcpy(b->data + b->len, hdr, hlen);
+        b->len += hlen;
+    }
+    memcpy(b->data + b->len, buf, len);
+    b->len += len;
+    q->bytes += hlen + len;
+
+    TSIGNAL(q->dataCond);
+    UNLOCK(q->mutex);
+    return 1;
+}
+
+
+/*
+ * Block until the queue has drained below screen->sendQueueLimit.  Returns
+ * FALSE if the client went away in the meantime.
+ */
+
+rfbBool
+rfbSendQueueWaitForSpace(rfbClientPtr cl)
+{
+    rfbSendQueue *q = cl->sendQueue;
+    rfbBool result;
+
+    if (q == NULL)
+        return TRUE;
+
+    LOCK(q->mutex);
+    while (q->bytes > cl->screen->sendQueueLimit && !q->closing && !q->failed)
+        WAIT(q->spaceCond, q->mutex);
+    result = !q->closing && !q->failed;
+    UNLOCK(q->mutex);
+    return result;
+}
+
+
+/*
+ * Everything queued between rfbSendQueueBeginUpdate() and
+ * rfbSendQueueEndUpdate() is one FramebufferUpdate.  Both must be called
+ * from the same thread, with cl->sendMutex held.  Without a queue, the
+ * socket is corked in between instead.
+ */
+
+void
+rfbSendQueueBeginUpdate(rfbClientPtr cl)
+{
+    rfbSendQueue *q = cl->sendQueue;
+
+    if (q == NULL) {
+        rfbCorkClientSocket(cl, TRUE);
+        return;
+    }
+
+    LOCK(q->mutex);
+    if (++q->serial == 0)
+        q->serial = 1;
+    q->currentUpdate = q->serial;
+    UNLOCK(q->mutex);
+}
+
+
+/*
+ * region is the part of the screen the update just queued carries pixel
+ * data for.  If it supersedes earlier updates (i.e. it does not depend on
+ * what the client shows, as CopyRect does), queued updates lying entirely
+ * within region are discarded.  If the update itself is droppable (it
+ * carries nothing but pixel data in a stateless encoding), remember it so
+ * a later update can discard it in turn.
+ *
+ * modifiedAt is when the oldest change the update carries was marked, 0 if
+ * it carries none.  Once its last byte was written, the time since then is
+ * recorded as RFB_LATENCY_DELIVER; the changes of discarded updates are
+ * delivered with this one.
+ */
+
+void
+rfbSendQueueEndUpdate(rfbClientPtr cl, sraRegionPtr region,
+                      rfbBool droppable, rfbBool supersedes,
+                      uint64_t modifiedAt)
+{
+    rfbSendQueue *q = cl->sendQueue;
+    rfbSendQueueUpdate **prev, *u;
+    unsigned int serial;
+
+    if (q == NULL) {
+        rfbCorkClientSocket(cl, FALSE);
+        if (modifiedAt)
+            rfbLatencyRecord(&cl->latency[RFB_LATENCY_DELIVER], rfbLatencyClock() - modifiedAt);
+        return;
+    }
+
+    LOCK(q->mutex);
+    serial = q->currentUpdate;
+    q->currentUpdate = 0;
+
+    prev = &q->droppable;
+    while ((u = *prev) != NULL) {
+        /* still queued and not started yet? */
+        rfbBool keep = sendQueueState(q, u->serial) == 0;
+
+        if (keep && supersedes) {
+            sraRegionPtr rest = sraRgnCreateRgn(u->region);
+            sraRgnSubtract(rest, region);
+            if (sraRgnEmpty(rest)) {
+                q->droppedUpdates++;
+                q->droppedBytes += sendQueueDiscard(q, u->serial);
+                if (u->modifiedAt && (modifiedAt == 0 || u->modifiedAt < modifiedAt))
+                    modifiedAt = u->modifiedAt;
+                keep = FALSE;
+            }
+            sraRgnDestroy(rest);
+        }
+
+        if (keep) {
+            prev = &u->next;
+        } else {
+            *prev = u->next;
+            sraRgnDestroy(u->region);
+            free(u);
+        }
+    }
+
+    if (droppable && serial && q->tail && q->tail->update == serial
+        && (u = (rfbSendQueueUpdate *)malloc(sizeof(rfbSendQueueUpdate))) != NULL) {
+        u->next = NULL;
+        u->serial = serial;
+        u->region = sraRgnCreateRgn(region);
+        u->modifiedAt = modifiedAt;
+        *prev = u;
+    }
+
+    if (modifiedAt) {
+        if (serial && q->tail && q->tail->update == serial)
+            q->tail->modifiedAt = modifiedAt;
+        else /* already written */
+            rfbLatencyRecord(&cl->latency[RFB_LATENCY_DELIVER], rfbLatencyClock() - modifiedAt);
+    }
+
+    TSIGNAL(q->spaceCond);
+    /* the writer may have to uncork the socket */
+    TSIGNAL(q->dataCond);
+    UNLOCK(q->mutex);
+}
+
+
+/*
+ * Report the bytes waiting in the queue and the updates discarded so far,
+ * both 0 for a client without a queue.
+ */
+
+void
+rfbSendQueueGetStats(rfbClientPtr cl, int *bytes, int *droppedUpdates)
+{
+    rfbSendQueue *q = cl->sendQueue;
+
+    *bytes = *droppedUpdates = 0;
+    if (q == NULL)
+        return;
+
+    LOCK(q->mutex);
+    *bytes = q->bytes;
+    *droppedUpdates = q->droppedUpdates;
+    UNLOCK(q->mutex);
+}
+
+#else
+
+void rfbStartSendQueue(rfbClientPtr cl) {}
+void rfbCloseSendQueue(rfbClientPtr cl) {}
+void rfbStopSendQueue(rfbClientPtr cl) {}
+rfbBool rfbSendQueueWaitForSpace(rfbClientPtr cl) { return TRUE; }
+void rfbSendQueueBeginUpdate(rfbClientPtr cl) { rfbCorkClientSocket(cl, TRUE); }
+void rfbSendQueueEndUpdate(rfbClientPtr cl, sraRegionPtr region,
+                           rfbBool droppable, rfbBool supersedes, uint64_t modifiedAt) {
+    rfbCorkClientSocket(cl, FALSE);
+    if (modifiedAt)
+        rfbLatencyRecord(&cl->latency[RFB_LATENCY_DELIVER], rfbLatencyClock() - modifiedAt);
+}
+void rfbSendQueueGetStats(rfbClientPtr cl, int *bytes, int *droppedUpdates) { *bytes = *droppedUpdates = 0; }
+
+#endif
@@ -52,6 +52,11 @@
 #endif
 
 #include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+#include <sys/uio.h>
+#endif
 
 #ifdef LIBVNCSERVER_HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -69,6 +74,10 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #endif
+#ifndef WIN32
+#include <stddef.h>
+#include <sys/un.h>
+#endif
 #ifdef LIBVNCSERVER_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -90,6 +99,8 @@ struct timeval
 #endif
 
 #include <errno.h>
+#include <stdlib.h>
+#include <time.h>
 
 #ifdef USE_LIBWRAP
 #include <syslog.h>
@@ -225,6 +236,17 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 
     }
 
+    if (rfbScreen->unixSocketPath) {
+	if ((rfbScreen->listenUnixSock = rfbListenOnUnixSocket(rfbScreen->unixSocketPath)) < 0) {
+	    rfbLogPerror("ListenOnUnixSocket");
+	    return;
+	}
+	rfbLog("Listening for VNC connections on Unix socket %s\n", rfbScreen->unixSocketPath);
+
+	FD_SET(rfbScreen->listenUnixSock, &(rfbScreen->allFds));
+	rfbScreen->maxFd = rfbMax((int)rfbScreen->listenUnixSock,rfbScreen->maxFd);
+    }
+
     if (rfbScreen->udpPort != 0) {
 	rfbLog("rfbInitSockets: listening for input on UDP port %d\n",rfbScreen->udpPort);
 
@@ -264,6 +286,14 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
 	rfbScreen->listen6Sock=-1;
     }
 
+    if(rfbScreen->listenUnixSock>-1) {
+	closesocket(rfbScreen->listenUnixSock);
+	FD_CLR(rfbScreen->listenUnixSock,&rfbScreen->allFds);
+	rfbScreen->listenUnixSock=-1;
+	if(rfbScreen->unixSocketPath[0] != '@')
+	    unlink(rfbScreen->unixSocketPath);
+    }
+
     if(rfbScreen->udpSock>-1) {
 	closesocket(rfbScreen->udpSock);
 	FD_CLR(rfbScreen->udpSock,&rfbScreen->allFds);
@@ -345,6 +375,16 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 		return result;
 	}
 
+	if (rfbScreen->listenUnixSock != -1 && FD_ISSET(rfbScreen->listenUnixSock, &fds)) {
+
+	    if (!rfbProcessNewConnection(rfbScreen))
+                return -1;
+
+	    FD_CLR(rfbScreen->listenUnixSock, &fds);
+	    if (--nfds == 0)
+		return result;
+	}
+
 	if ((rfbScreen->udpSock != -1) && FD_ISSET(rfbScreen->udpSock, &fds)) {
 	    if(!rfbScreen->udpClient)
 		rfbNewUDPClient(rfbScreen);
@@ -430,6 +470,8 @@ rfbProcessNewConnection(rfbScreenInfoPtr rfbScreen)
       FD_SET(rfbScreen->listenSock, &listen_fds);
     if(rfbScreen->listen6Sock >= 0) 
       FD_SET(rfbScreen->listen6Sock, &listen_fds);
+    if(rfbScreen->listenUnixSock >= 0) 
+      FD_SET(rfbScreen->listenUnixSock, &listen_fds);
     if (select(rfbScreen->maxFd+1, &listen_fds, NULL, NULL, NULL) == -1) {
       rfbLogPerror("rfbProcessNewConnection: error in select");
       return FALSE;
@@ -439,6 +481,21 @@ rfbProcessNewConnection(rfbScreenInfoPtr rfbScreen)
     if (rfbScreen->listen6Sock >= 0 && FD_ISSET(rfbScreen->listen6Sock, &listen_fds))
       chosen_listen_sock = rfbScreen->listen6Sock;
 
+    if (rfbScreen->listenUnixSock >= 0 && FD_ISSET(rfbScreen->listenUnixSock, &listen_fds)) {
+      /* local viewer, no TCP options or host checks apply */
+      if ((sock = accept(rfbScreen->listenUnixSock, NULL, NULL)) < 0) {
+        rfbLogPerror("rfbCheckFds: accept");
+        return FALSE;
+      }
+      if(!rfbSetNonBlocking(sock)) {
+        closesocket(sock);
+        return FALSE;
+      }
+      rfbLog("Got connection from local client on %s\n", rfbScreen->unixSocketPath);
+      rfbNewClient(rfbScreen,sock);
+      return TRUE;
+    }
+
     if ((sock = accept(chosen_listen_sock,
 		       (struct sockaddr *)&addr, &addrlen)) < 0) {
       rfbLogPerror("rfbCheckFds: accept");
@@ -510,19 +567,26 @@ rfbCloseClient(rfbClientPtr cl)
 	  while(cl->screen->maxFd>0
 		&& !FD_ISSET(cl->screen->maxFd,&(cl->screen->allFds)))
 	    cl->screen->maxFd--;
+#ifndef __MINGW32__
+	shutdown(cl->sock,SHUT_RDWR);
+#endif
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	/* the shutdown woke up any writer blocked on the socket, wait for
+	   it to let go of the SSL context */
+	LOCK(cl->outputMutex);
 	if (cl->sslctx)
 	    rfbssl_destroy(cl);
+	UNLOCK(cl->outputMutex);
 	free(cl->wspath);
-#endif
-#ifndef __MINGW32__
-	shutdown(cl->sock,SHUT_RDWR);
+	cl->wspath = NULL;
 #endif
 	closesocket(cl->sock);
 	cl->sock = -1;
       }
     TSIGNAL(cl->updateCond);
     UNLOCK(cl->updateMutex);
+
+    rfbCloseSendQueue(cl);
 }
 
 
@@ -748,6 +812,12 @@ rfbWriteExact(rfbClientPtr cl,
     struct timeval tv;
     int totalTimeWaited = 0;
     const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+    const char *hdr = NULL;
+    int hlen = 0;
+    uint64_t started;
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    char wshdr[WEBSOCKETS_MAX_HEADER_LEN];
+#endif
 
 #undef DEBUG_WRITE_EXACT
 #ifdef DEBUG_WRITE_EXACT
@@ -759,19 +829,42 @@ rfbWriteExact(rfbClientPtr cl,
 
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
     if (cl->wsctx) {
-        char *tmp = NULL;
-        if ((len = webSocketsEncode(cl, buf, len, &tmp)) < 0) {
-            rfbErr("WriteExact: WebSockets encode error\n");
-            return -1;
+        /* Binary frames are written as a separate header followed by the
+           untouched payload. */
+        if ((hlen = webSocketsEncodeHeader(cl, len, wshdr)) > 0) {
+            hdr = wshdr;
+        } else {
+            char *tmp = NULL;
+            if ((len = webSocketsEncode(cl, buf, len, &tmp)) < 0) {
+                rfbErr("WriteExact: WebSockets encode error\n");
+                return -1;
+            }
+            buf = tmp;
         }
-        buf = tmp;
     }
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /* the client's writer thread does the actual writing */
+    if (cl->sendQueue)
+        return rfbSendQueueWrite(cl, hdr, hlen, buf, len);
+#endif
+
     LOCK(cl->outputMutex);
-    while (len > 0) {
+    started = rfbLatencyClock();
+    while (hlen + len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
-        if (cl->sslctx)
+        if (hlen > 0) {
+            struct iovec iov[2];
+            iov[0].iov_base = (char *)hdr;
+            iov[0].iov_len = hlen;
+            iov[1].iov_base = (char *)buf;
+            iov[1].iov_len = len;
+            if (cl->sslctx)
+                n = rfbssl_writev(cl, iov, 2);
+            else
+                n = writev(sock, iov, 2);
+        } else if (cl->sslctx)
 	    n = rfbssl_write(cl, buf, len);
 	else
 #endif
@@ -779,12 +872,20 @@ rfbWriteExact(rfbClientPtr cl,
 
         if (n > 0) {
 
-            buf += n;
-            len -= n;
+            if (n < hlen) {
+                hdr += n;
+                hlen -= n;
+            } else {
+                n -= hlen;
+                hlen = 0;
+                buf += n;
+                len -= n;
+            }
 
         } else if (n == 0) {
 
             rfbErr("WriteExact: write returned 0?\n");
+            UNLOCK(cl->outputMutex);
             return 0;
 
         } else {
@@ -830,6 +931,9 @@ rfbWriteExact(rfbClientPtr cl,
             }
         }
     }
+    started = rfbLatencyClock() - started;
+    rfbLatencyRecord(&cl->latency[RFB_LATENCY_WRITE], started);
+    cl->writeMicros += started;
     UNLOCK(cl->outputMutex);
     return 1;
 }
@@ -1062,6 +1166,54 @@ rfbListenOnUDPPort(int port,
     return sock;
 }
 
+/*
+ * rfbListenOnUnixSocket listens on a Unix domain stream socket.  A path
+ * starting with '@' names a socket in the Linux abstract namespace (what
+ * "adb forward tcp:5901 localabstract:<name>" connects to), anything else
+ * a socket file, which is replaced if it already exists.
+ */
+int
+rfbListenOnUnixSocket(const char* path)
+{
+#ifdef WIN32
+    rfbErr("This LibVNCServer does not have Unix domain socket support\n");
+    return -1;
+#else
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    size_t len = strlen(path);
+    int sock;
+
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+	rfbErr("rfbListenOnUnixSocket: invalid socket path \"%s\"\n", path);
+	return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    if (path[0] == '@')
+	addr.sun_path[0] = '\0';
+    else
+	unlink(path);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	return -1;
+    }
+    if (bind(sock, (struct sockaddr *)&addr, addrlen) < 0) {
+	closesocket(sock);
+	return -1;
+    }
+    if (listen(sock, 32) < 0) {
+	closesocket(sock);
+	return -1;
+    }
+
+    return sock;
+#endif
+}
+
 /*
  * rfbSetNonBlocking sets a socket into non-blocking mode.
  */
@@ -1081,3 +1233,120 @@ rfbSetNonBlocking(int sock)
   }
   return TRUE;
 }
+
+/*
+ * Per-client socket policies, see tcpNotSentLowat, tcpCork and
+ * tcpAutoSndBuf in rfbScreenInfo.  These are Linux specific and do
+ * nothing elsewhere.
+ */
+
+#if defined(__linux__) && !defined(TCP_NOTSENT_LOWAT)
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+/* bounds for the automatically sized send buffer */
+#define AUTO_SNDBUF_MIN (16*1024)
+#define AUTO_SNDBUF_MAX (4*1024*1024)
+
+/*
+ * rfbTuneClientSocket applies the screen's socket policies to a newly
+ * created client.
+ */
+void
+rfbTuneClientSocket(rfbClientPtr cl)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = cl->screen->tcpNotSentLowat;
+
+    if (lowat > 0 && !cl->unixSocket &&
+	setsockopt(cl->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+		   (char *)&lowat, sizeof(lowat)) < 0) {
+	rfbLogPerror("setsockopt failed: can't set TCP_NOTSENT_LOWAT");
+    }
+#endif
+    cl->socketCorked = FALSE;
+    cl->socketSndBuf = 0;
+    cl->socketLastTuned = 0;
+}
+
+/*
+ * rfbCorkClientSocket holds back partial segments while an update is being
+ * written and pushes them out once it is complete.
+ */
+void
+rfbCorkClientSocket(rfbClientPtr cl, rfbBool cork)
+{
+#ifdef TCP_CORK
+    int on = cork ? 1 : 0;
+
+    if (cl->socketCorked == cork || (cork && !cl->screen->tcpCork) || cl->unixSocket)
+	return;
+
+    if (cl->sock == -1) {
+	cl->socketCorked = FALSE;
+	return;
+    }
+    if (setsockopt(cl->sock, IPPROTO_TCP, TCP_CORK,
+		   (char *)&on, sizeof(on)) < 0) {
+	rfbLogPerror("setsockopt failed: can't set TCP_CORK");
+	cl->screen->tcpCork = FALSE;
+	cl->socketCorked = FALSE;
+	return;
+    }
+    cl->socketCorked = cork;
+#endif
+}
+
+/*
+ * rfbAutoTuneSendBuffer sizes SO_SNDBUF to twice the bandwidth-delay
+ * product the kernel measured for the connection (congestion window times
+ * MSS), so that the link stays busy without megabytes of stale
+ * framebuffer data piling up in the kernel.  Called after each update;
+ * does its work at most once a second.
+ */
+void
+rfbAutoTuneSendBuffer(rfbClientPtr cl)
+{
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    time_t now;
+    int bdp, sndbuf;
+
+    if (!cl->screen->tcpAutoSndBuf || cl->sock == -1 || cl->unixSocket)
+	return;
+
+    now = time(NULL);
+    if (now == cl->socketLastTuned)
+	return;
+    cl->socketLastTuned = now;
+
+    if (getsockopt(cl->sock, IPPROTO_TCP, TCP_INFO, (char *)&info, &len) < 0) {
+	rfbLogPerror("getsockopt failed: can't get TCP_INFO");
+	cl->screen->tcpAutoSndBuf = FALSE;
+	return;
+    }
+
+    bdp = info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+    cl->socketRtt = info.tcpi_rtt;
+    cl->socketBdp = bdp;
+
+    sndbuf = 2 * bdp;
+    if (sndbuf < AUTO_SNDBUF_MIN)
+	sndbuf = AUTO_SNDBUF_MIN;
+    if (sndbuf > AUTO_SNDBUF_MAX)
+	sndbuf = AUTO_SNDBUF_MAX;
+
+    /* don't bother for changes of less than a quarter */
+    if (cl->socketSndBuf &&
+	abs(sndbuf - cl->socketSndBuf) < cl->socketSndBuf / 4)
+	return;
+
+    if (setsockopt(cl->sock, SOL_SOCKET, SO_SNDBUF,
+		   (char *)&sndbuf, sizeof(sndbuf)) < 0) {
+	rfbLogPerror("setsockopt failed: can't set SO_SNDBUF");
+	return;
+    }
+    cl->socketSndBuf = sndbuf;
+#endif
+}
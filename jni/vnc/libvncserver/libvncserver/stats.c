@@ -25,6 +25,9 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
+#include <stdarg.h>
+#include <time.h>
 
 #ifdef _MSC_VER
 #define snprintf _snprintf /* Missing in MSVC */
@@ -44,6 +47,12 @@ void  rfbStatRecordMessageRcvd(rfbClientPtr cl, uint32_t type, int byteCount, in
 void rfbResetStats(rfbClientPtr cl);
 void rfbPrintStats(rfbClientPtr cl);
 
+static void rfbPrintLatencyHistogram(const char *name, const rfbLatencyHistogram *h);
+static void rfbPrintEncodingCost(rfbClientPtr cl);
+
+/* rfbGetUpdateRate() measures over windows of this many microseconds */
+#define RATE_WINDOW 1000000
+
 
 
 
@@ -82,6 +91,7 @@ char *messageNameClient2Server(uint32_t type, char *buf, int len) {
     case rfbTextChat:                 snprintf(buf, len, "TextChat"); break;
     case rfbPalmVNCSetScaleFactor:    snprintf(buf, len, "PalmVNCSetScale"); break;
     case rfbXvp:                      snprintf(buf, len, "XvpClientMessage"); break;
+    case rfbSetDesktopSize:           snprintf(buf, len, "SetDesktopSize"); break;
     default:
         snprintf(buf, len, "cli2svr-0x%08X", type);
 
@@ -126,6 +136,7 @@ char *encodingName(uint32_t type, char *buf, int len) {
 
     case rfbEncodingLastRect:           snprintf(buf, len, "LastRect");    break;
     case rfbEncodingNewFBSize:          snprintf(buf, len, "NewFBSize");   break;
+    case rfbEncodingExtDesktopSize:     snprintf(buf, len, "ExtDesktopSize"); break;
     case rfbEncodingKeyboardLedState:   snprintf(buf, len, "LedState");    break;
     case rfbEncodingSupportedMessages:  snprintf(buf, len, "SupportedMessage");  break;
     case rfbEncodingSupportedEncodings: snprintf(buf, len, "SupportedEncoding"); break;
@@ -354,6 +365,44 @@ int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type)
   return 0;
 }
 
+const rfbLatencyHistogram *rfbStatGetEncodingLatency(rfbClientPtr cl, uint32_t type)
+{
+  rfbStatList *ptr=NULL;
+    if (cl==NULL) return NULL;
+  for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+      if (ptr->type==type) return ptr->encodeLatency;
+  return NULL;
+}
+const rfbLatencyHistogram *rfbStatGetEncodingCpuTime(rfbClientPtr cl, uint32_t type)
+{
+  rfbStatList *ptr=NULL;
+    if (cl==NULL) return NULL;
+  for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+      if (ptr->type==type) return ptr->encodeCpu;
+  return NULL;
+}
+const rfbLatencyHistogram *rfbStatGetEncodingRectPixels(rfbClientPtr cl, uint32_t type)
+{
+  rfbStatList *ptr=NULL;
+    if (cl==NULL) return NULL;
+  for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+      if (ptr->type==type) return ptr->rectPixels;
+  return NULL;
+}
+uint64_t rfbStatGetEncodingWriteMicros(rfbClientPtr cl, uint32_t type)
+{
+  rfbStatList *ptr=NULL;
+    if (cl==NULL) return 0;
+  for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+      if (ptr->type==type) return ptr->writeMicros;
+  return 0;
+}
+uint64_t rfbStatGetWriteMicros(rfbClientPtr cl)
+{
+    if (cl==NULL) return 0;
+    return cl->writeMicros;
+}
+
 
 
 
@@ -365,6 +414,9 @@ void rfbResetStats(rfbClientPtr cl)
     {
         ptr = cl->statEncList;
         cl->statEncList = ptr->Next;
+        free(ptr->encodeLatency);
+        free(ptr->encodeCpu);
+        free(ptr->rectPixels);
         free(ptr);
     }
     while (cl->statMsgList!=NULL)
@@ -478,6 +530,453 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
-      
+
+    if (cl->screen->tcpNotSentLowat>0 || cl->screen->tcpCork || cl->screen->tcpAutoSndBuf)
+        rfbLog("Socket: notsent_lowat %d, cork %s, sndbuf %d, cwnd %d bytes, rtt %.1f ms\n",
+            cl->screen->tcpNotSentLowat, cl->screen->tcpCork ? "on" : "off",
+            cl->socketSndBuf, cl->socketBdp, cl->socketRtt / 1000.0);
+
+    rfbLog("%-21.21s  %-6.6s   %9.9s %9.9s %9.9s\n", "Latency", "events", "p50 ms", "p99 ms", "max ms");
+    for (count = RFB_LATENCY_SCALE; count < RFB_LATENCY_STAGES; count++)
+        rfbPrintLatencyHistogram(rfbLatencyStageName(count), &cl->latency[count]);
+    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+    {
+        if (ptr->encodeLatency==NULL) continue;
+        snprintf(encBuf, sizeof(encBuf), "encode ");
+        encodingName(ptr->type, encBuf+7, sizeof(encBuf)-7);
+        rfbPrintLatencyHistogram(encBuf, ptr->encodeLatency);
+    }
+
+    rfbPrintEncodingCost(cl);
 } 
 
+
+
+
+uint64_t rfbLatencyClock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+void rfbLatencyRecord(rfbLatencyHistogram *h, uint64_t micros)
+{
+    uint32_t v = micros > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)micros;
+    int index = v, shift = 0;
+
+    if (h==NULL) return;
+    if (v >= 32) {
+        /* keep the 5 most significant bits, the top one is implied */
+#ifdef __GNUC__
+        shift = 27 - __builtin_clz(v);
+#else
+        while ((v >> shift) >= 32)
+            shift++;
+#endif
+        index = 32 + (shift - 1) * 16 + (int)(v >> shift) - 16;
+    }
+    h->buckets[index]++;
+    h->count++;
+    h->total += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+uint32_t rfbLatencyPercentile(const rfbLatencyHistogram *h, double percentile)
+{
+    uint32_t count, seen = 0;
+    int i, shift;
+
+    if (h==NULL || h->count==0) return 0;
+    count = h->count;
+    for (i = 0; i < RFB_LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= count * percentile / 100.0 && seen > 0) {
+            uint32_t highest;
+            if (i < 32) return i;
+            shift = (i - 32) / 16 + 1;
+            /* report the highest value of the bucket, but never above max */
+            highest = ((uint32_t)((i - 32) % 16 + 17) << shift) - 1;
+            return highest < h->max ? highest : h->max;
+        }
+    }
+    return h->max;
+}
+
+uint64_t rfbThreadCpuClock(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    return 0;
+}
+
+/* the stats of the encoding updates to the client are sent with */
+static rfbStatList *rfbStatLookupUpdateEncoding(rfbClientPtr cl)
+{
+    return rfbStatLookupEncoding(cl, cl->preferredEncoding == -1 ?
+                                 rfbEncodingRaw : (uint32_t)cl->preferredEncoding);
+}
+
+static void rfbStatRecordHistogram(rfbLatencyHistogram **h, uint64_t value)
+{
+    if (*h==NULL)
+        *h = (rfbLatencyHistogram *)calloc(1, sizeof(rfbLatencyHistogram));
+    rfbLatencyRecord(*h, value);
+}
+
+/*
+ * An update with the client's preferred encoding took micros to encode, of
+ * which cpuMicros were spent running, and was blocked writing for
+ * writeMicros besides
+ */
+void rfbRecordEncodeCost(rfbClientPtr cl, uint64_t micros, uint64_t cpuMicros, uint64_t writeMicros)
+{
+    rfbStatList *ptr;
+
+    rfbLatencyRecord(&cl->latency[RFB_LATENCY_ENCODE], micros);
+    ptr = rfbStatLookupUpdateEncoding(cl);
+    if (ptr!=NULL) {
+        rfbStatRecordHistogram(&ptr->encodeLatency, micros);
+        rfbStatRecordHistogram(&ptr->encodeCpu, cpuMicros);
+        ptr->writeMicros += writeMicros;
+    }
+}
+
+/* a rectangle of that many pixels went out with the preferred encoding */
+void rfbRecordRectPixels(rfbClientPtr cl, uint32_t pixels)
+{
+    rfbStatList *ptr = rfbStatLookupUpdateEncoding(cl);
+
+    if (ptr!=NULL)
+        rfbStatRecordHistogram(&ptr->rectPixels, pixels);
+}
+
+/* one more update went out at time now */
+void rfbRecordUpdateRate(rfbClientPtr cl, uint64_t now)
+{
+    if (cl->rateWindowStart == 0)
+        cl->rateWindowStart = now;
+    cl->rateWindowUpdates++;
+    if (now - cl->rateWindowStart >= RATE_WINDOW) {
+        cl->updateRate = cl->rateWindowUpdates * 1000000.0 / (now - cl->rateWindowStart);
+        cl->rateWindowStart = now;
+        cl->rateWindowUpdates = 0;
+    }
+}
+
+double rfbGetUpdateRate(rfbClientPtr cl)
+{
+    uint64_t elapsed;
+
+    if (cl==NULL || cl->rateWindowStart==0) return 0;
+    /* without updates for a while, the last full window is out of date */
+    elapsed = rfbLatencyClock() - cl->rateWindowStart;
+    if (elapsed >= 2 * RATE_WINDOW)
+        return cl->rateWindowUpdates * 1000000.0 / elapsed;
+    return cl->updateRate;
+}
+
+const char *rfbLatencyStageName(enum rfbLatencyStage stage)
+{
+    switch (stage) {
+    case RFB_LATENCY_FRAME_WAIT: return "frame wait";
+    case RFB_LATENCY_CONSUME:    return "consume";
+    case RFB_LATENCY_CONVERT:    return "convert";
+    case RFB_LATENCY_MARK:       return "mark";
+    case RFB_LATENCY_SCALE:      return "scale";
+    case RFB_LATENCY_ENCODE:     return "encode";
+    case RFB_LATENCY_WRITE:      return "write";
+    case RFB_LATENCY_DELIVER:    return "deliver";
+    default:                     return "unknown";
+    }
+}
+
+static void rfbPrintLatencyHistogram(const char *name, const rfbLatencyHistogram *h)
+{
+    if (h->count==0) return;
+    rfbLog(" %-20.20s: %6u | %9.2f %9.2f %9.2f\n", name, h->count,
+        rfbLatencyPercentile(h, 50) / 1000.0, rfbLatencyPercentile(h, 99) / 1000.0,
+        h->max / 1000.0);
+}
+
+/* time, CPU time and blocked writes of every encoding used, per update and per pixel */
+static void rfbPrintEncodingCost(rfbClientPtr cl)
+{
+    rfbStatList *ptr;
+    char encBuf[64];
+    uint64_t totalCpu = 0, totalPixels = 0;
+
+    rfbLog("%-21.21s  %-6.6s   %9.9s %9.9s %9.9s %9.9s %9.9s %9.9s\n", "Encoding cost", "events",
+        "total ms", "cpu ms", "cpu p99", "blocked", "Mpixels", "ns/pixel");
+    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+    {
+        uint64_t pixels;
+
+        if (ptr->encodeLatency==NULL || ptr->encodeCpu==NULL) continue;
+        pixels = ptr->rectPixels ? ptr->rectPixels->total : 0;
+        rfbLog(" %-20.20s: %6u | %9.1f %9.1f %9.2f %9.1f %9.2f %9.2f\n",
+            encodingName(ptr->type, encBuf, sizeof(encBuf)), ptr->encodeLatency->count,
+            ptr->encodeLatency->total / 1000.0, ptr->encodeCpu->total / 1000.0,
+            rfbLatencyPercentile(ptr->encodeCpu, 99) / 1000.0, ptr->writeMicros / 1000.0,
+            pixels / 1000000.0, pixels ? ptr->encodeCpu->total * 1000.0 / pixels : 0.0);
+        if (ptr->rectPixels)
+            rfbLog(" %-20.20s: %6u | pixels per rect p50 %u, p99 %u, max %u\n", "", ptr->rectPixels->count,
+                rfbLatencyPercentile(ptr->rectPixels, 50), rfbLatencyPercentile(ptr->rectPixels, 99),
+                ptr->rectPixels->max);
+        totalCpu += ptr->encodeCpu->total;
+        totalPixels += pixels;
+    }
+    rfbLog(" %-20.20s: %6.6s | %9.9s %9.1f %9.9s %9.1f %9.2f %9.2f\n", "TOTALS", "", "",
+        totalCpu / 1000.0, "", cl->writeMicros / 1000.0, totalPixels / 1000000.0,
+        totalPixels ? totalCpu * 1000.0 / totalPixels : 0.0);
+}
+
+void rfbPrintLatency(rfbScreenInfoPtr screen)
+{
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr cl;
+    char name[64];
+    int stage;
+
+    if (screen==NULL) return;
+
+    rfbLog("%-21.21s  %-6.6s   %9.9s %9.9s %9.9s\n", "Latency", "events", "p50 ms", "p99 ms", "max ms");
+    for (stage = 0; stage < RFB_LATENCY_SCALE; stage++)
+        rfbPrintLatencyHistogram(rfbLatencyStageName(stage), &screen->latency[stage]);
+
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        for (stage = RFB_LATENCY_SCALE; stage < RFB_LATENCY_STAGES; stage++) {
+            snprintf(name, sizeof(name), "%s %s", cl->host, rfbLatencyStageName(stage));
+            rfbPrintLatencyHistogram(name, &cl->latency[stage]);
+        }
+    }
+    rfbReleaseClientIterator(iterator);
+}
+
+
+
+
+
+/*
+ * The /metrics page of the HTTP server
+ */
+
+typedef struct {
+    char *text;
+    size_t len;
+    size_t size;
+} metricsBuf;
+
+static void metricsPrintf(metricsBuf *m, const char *format, ...)
+{
+    va_list args;
+    char *text;
+    int n;
+
+    while (m->text != NULL) {
+        va_start(args, format);
+        n = vsnprintf(m->text + m->len, m->size - m->len, format, args);
+        va_end(args);
+        if (n < 0)
+            return;
+        if (m->len + n < m->size) {
+            m->len += n;
+            return;
+        }
+        /* did not fit, try again with more room */
+        if ((text = (char *)realloc(m->text, m->size * 2 + n)) == NULL) {
+            free(m->text);
+            m->text = NULL;
+            return;
+        }
+        m->text = text;
+        m->size = m->size * 2 + n;
+    }
+}
+
+static void metricsFamily(metricsBuf *m, const char *name, const char *type, const char *help)
+{
+    metricsPrintf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metricsClientLabels(rfbClientPtr cl, char *buf, int len)
+{
+    snprintf(buf, len, "client=\"%s\",socket=\"%d\"", cl->host ? cl->host : "", cl->sock);
+}
+
+/* p50, p90, p99 and max (as quantile 1) of a histogram, in seconds */
+static void metricsSummary(metricsBuf *m, const char *name, const char *labels, const rfbLatencyHistogram *h)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 1 };
+    int i;
+
+    for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); i++)
+        metricsPrintf(m, "%s{%s,quantile=\"%g\"} %g\n", name, labels, quantiles[i],
+                      rfbLatencyPercentile(h, quantiles[i] * 100) / 1000000.0);
+    metricsPrintf(m, "%s_sum{%s} %g\n", name, labels, h->total / 1000000.0);
+    metricsPrintf(m, "%s_count{%s} %u\n", name, labels, h->count);
+}
+
+char *rfbGetMetrics(rfbScreenInfoPtr screen)
+{
+    metricsBuf m;
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr cl;
+    rfbStatList *ptr;
+    char labels[128], encBuf[64];
+    int stage, clients = 0, bytes, droppedUpdates;
+
+    if (screen==NULL) return NULL;
+    m.len = 0;
+    m.size = 16384;
+    if ((m.text = (char *)malloc(m.size)) == NULL)
+        return NULL;
+    m.text[0] = '\0';
+
+    metricsFamily(&m, "vnc_frames_captured_total", "counter", "Frames taken from the capture source.");
+    metricsPrintf(&m, "vnc_frames_captured_total %u\n", screen->framesCaptured);
+    metricsFamily(&m, "vnc_frames_converted_total", "counter", "Frames copied into the framebuffer.");
+    metricsPrintf(&m, "vnc_frames_converted_total %u\n", screen->framesConverted);
+    metricsFamily(&m, "vnc_frames_dropped_total", "counter", "Frames skipped or lost before reaching the framebuffer.");
+    metricsPrintf(&m, "vnc_frames_dropped_total %u\n", screen->framesDropped);
+
+    metricsFamily(&m, "vnc_stage_latency_seconds", "summary", "Time spent in each stage of a frame.");
+    for (stage = 0; stage < RFB_LATENCY_SCALE; stage++) {
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", rfbLatencyStageName(stage));
+        metricsSummary(&m, "vnc_stage_latency_seconds", labels, &screen->latency[stage]);
+    }
+
+    iterator = rfbGetClientIterator(screen);
+    while (rfbClientIteratorNext(iterator) != NULL)
+        clients++;
+    rfbReleaseClientIterator(iterator);
+    metricsFamily(&m, "vnc_clients", "gauge", "Connected clients.");
+    metricsPrintf(&m, "vnc_clients %d\n", clients);
+
+    /* every family must be complete before the next one starts */
+    metricsFamily(&m, "vnc_client_updates_total", "counter", "Framebuffer updates sent.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        metricsClientLabels(cl, labels, sizeof(labels));
+        metricsPrintf(&m, "vnc_client_updates_total{%s} %d\n", labels,
+                      rfbStatGetMessageCountSent(cl, rfbFramebufferUpdate));
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_update_rate", "gauge", "Framebuffer updates sent per second, recently.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        metricsClientLabels(cl, labels, sizeof(labels));
+        metricsPrintf(&m, "vnc_client_update_rate{%s} %.2f\n", labels, rfbGetUpdateRate(cl));
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_sent_bytes_total", "counter", "Bytes of rectangles sent, by encoding.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        metricsClientLabels(cl, labels, sizeof(labels));
+        for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+            if (ptr->sentCount > 0)
+                metricsPrintf(&m, "vnc_client_sent_bytes_total{%s,encoding=\"%s\"} %u\n", labels,
+                              encodingName(ptr->type, encBuf, sizeof(encBuf)), ptr->bytesSent);
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_raw_bytes_total", "counter", "Bytes the rectangles would have taken as raw pixels, by encoding.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        metricsClientLabels(cl, labels, sizeof(labels));
+        for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+            if (ptr->sentCount > 0)
+                metricsPrintf(&m, "vnc_client_raw_bytes_total{%s,encoding=\"%s\"} %u\n", labels,
+                              encodingName(ptr->type, encBuf, sizeof(encBuf)), ptr->bytesSentIfRaw);
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_sent_pixels_total", "counter", "Pixels of rectangles sent, by encoding.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        metricsClientLabels(cl, labels, sizeof(labels));
+        for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+            if (ptr->rectPixels != NULL)
+                metricsPrintf(&m, "vnc_client_sent_pixels_total{%s,encoding=\"%s\"} %llu\n", labels,
+                              encodingName(ptr->type, encBuf, sizeof(encBuf)),
+                              (unsigned long long)ptr->rectPixels->total);
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_encode_cpu_seconds", "summary", "CPU time of encoding an update, by encoding.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        char encLabels[192];
+        metricsClientLabels(cl, labels, sizeof(labels));
+        for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+            if (ptr->encodeCpu != NULL) {
+                snprintf(encLabels, sizeof(encLabels), "%s,encoding=\"%s\"", labels,
+                         encodingName(ptr->type, encBuf, sizeof(encBuf)));
+                metricsSummary(&m, "vnc_client_encode_cpu_seconds", encLabels, ptr->encodeCpu);
+            }
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_write_blocked_seconds_total", "counter", "Time spent blocked in synchronous writes.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        metricsClientLabels(cl, labels, sizeof(labels));
+        metricsPrintf(&m, "vnc_client_write_blocked_seconds_total{%s} %g\n", labels, cl->writeMicros / 1000000.0);
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_compression_ratio", "gauge", "Raw equivalent divided by bytes sent.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        bytes = rfbStatGetSentBytes(cl);
+        metricsClientLabels(cl, labels, sizeof(labels));
+        metricsPrintf(&m, "vnc_client_compression_ratio{%s} %.3f\n", labels,
+                      bytes > 0 ? (double)rfbStatGetSentBytesIfRaw(cl) / bytes : 0.0);
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_send_queue_bytes", "gauge", "Bytes waiting in the client's send queue.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        rfbSendQueueGetStats(cl, &bytes, &droppedUpdates);
+        metricsClientLabels(cl, labels, sizeof(labels));
+        metricsPrintf(&m, "vnc_client_send_queue_bytes{%s} %d\n", labels, bytes);
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_dropped_updates_total", "counter", "Queued updates discarded for a later one.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        rfbSendQueueGetStats(cl, &bytes, &droppedUpdates);
+        metricsClientLabels(cl, labels, sizeof(labels));
+        metricsPrintf(&m, "vnc_client_dropped_updates_total{%s} %d\n", labels, droppedUpdates);
+    }
+    rfbReleaseClientIterator(iterator);
+
+    metricsFamily(&m, "vnc_client_stage_latency_seconds", "summary", "Time spent in each stage of an update.");
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        char stageLabels[192];
+        metricsClientLabels(cl, labels, sizeof(labels));
+        for (stage = RFB_LATENCY_SCALE; stage < RFB_LATENCY_STAGES; stage++) {
+            snprintf(stageLabels, sizeof(stageLabels), "%s,stage=\"%s\"", labels, rfbLatencyStageName(stage));
+            metricsSummary(&m, "vnc_client_stage_latency_seconds", stageLabels, &cl->latency[stage]);
+        }
+    }
+    rfbReleaseClientIterator(iterator);
+
+    return m.text;
+}
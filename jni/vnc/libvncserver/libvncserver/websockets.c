@@ -50,6 +50,11 @@
 
 #include <string.h>
 #include <unistd.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "rfb/rfbconfig.h"
 #include "rfbssl.h"
 #include "rfbcrypto.h"
@@ -178,6 +183,69 @@ min (int a, int b) {
     return a < b ? a : b;
 }
 
+/*
+ * Unmask a frame payload in place.  The payload need not be aligned; the
+ * bulk is done 16 bytes at a time where SIMD is available, else 8 bytes.
+ */
+static void
+webSocketsUnmask(char *payload, int len, ws_mask_t mask)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(mask.u));
+
+    for (; i + 16 <= len; i += 16) {
+	uint8x16_t v = vld1q_u8((uint8_t *)payload + i);
+	vst1q_u8((uint8_t *)payload + i, veorq_u8(v, m));
+    }
+#elif defined(__SSE2__)
+    __m128i m = _mm_set1_epi32((int)mask.u);
+
+    for (; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((__m128i *)(payload + i));
+	_mm_storeu_si128((__m128i *)(payload + i), _mm_xor_si128(v, m));
+    }
+#endif
+    {
+	uint64_t m64 = ((uint64_t)mask.u << 32) | mask.u;
+
+	for (; i + 8 <= len; i += 8) {
+	    uint64_t v;
+	    memcpy(&v, payload + i, 8);
+	    v ^= m64;
+	    memcpy(payload + i, &v, 8);
+	}
+    }
+    /* i is a multiple of 4 here, so the mask is still in phase */
+    for (; i < len; i++) {
+	payload[i] ^= mask.c[i % 4];
+    }
+}
+
+/*
+ * Fill in the header of an unmasked server-to-client frame carrying blen
+ * bytes of payload.  hdr needs room for WEBSOCKETS_MAX_HEADER_LEN bytes.
+ */
+static int
+webSocketsFrameHeader(char *hdr, unsigned char opcode, int blen)
+{
+    ws_header_t *header = (ws_header_t *)hdr;
+
+    header->b0 = 0x80 | (opcode & 0x0f);
+    if (blen <= 125) {
+      header->b1 = (uint8_t)blen;
+      return 2;
+    } else if (blen <= 65535) {
+      header->b1 = 0x7e;
+      header->u.s16.l16 = WS_HTON16((uint16_t)blen);
+      return 4;
+    } else {
+      header->b1 = 0x7f;
+      header->u.s64.l64 = WS_HTON64(blen);
+      return 10;
+    }
+}
+
 static void webSocketsGenSha1Key(char *target, int size, char *key)
 {
     struct iovec iov[2];
@@ -628,12 +696,10 @@ static int
 webSocketsDecodeHybi(rfbClientPtr cl, char *dst, int len)
 {
     char *buf, *payload;
-    uint32_t *payload32;
     int ret = -1, result = -1;
     int total = 0;
     ws_mask_t mask;
     ws_header_t *header;
-    int i;
     unsigned char opcode;
     ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
     int flength, fhlen;
@@ -726,15 +792,7 @@ webSocketsDecodeHybi(rfbClientPtr cl, char *dst, int len)
       buf[ret] = '\0';
     }
 
-    /* process 1 frame (32 bit op) */
-    payload32 = (uint32_t *)payload;
-    for (i = 0; i < flength / 4; i++) {
-	payload32[i] ^= mask.u;
-    }
-    /* process the remaining bytes (if any) */
-    for (i*=4; i < flength; i++) {
-	payload[i] ^= mask.c[i % 4];
-    }
+    webSocketsUnmask(payload, flength, mask);
 
     switch (opcode) {
       case WS_OPCODE_CLOSE:
@@ -773,7 +831,6 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 {
     int blen, ret = -1, sz = 0;
     unsigned char opcode = '\0'; /* TODO: option! */
-    ws_header_t *header;
     ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
 
 
@@ -790,8 +847,6 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 	  return 0;
     }
 
-    header = (ws_header_t *)wsctx->codeBuf;
-
     if (wsctx->base64) {
 	opcode = WS_OPCODE_TEXT_FRAME;
 	/* calculate the resulting size */
@@ -801,19 +856,7 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 	blen = len;
     }
 
-    header->b0 = 0x80 | (opcode & 0x0f);
-    if (blen <= 125) {
-      header->b1 = (uint8_t)blen;
-      sz = 2;
-    } else if (blen <= 65536) {
-      header->b1 = 0x7e;
-      header->u.s16.l16 = WS_HTON16((uint16_t)blen);
-      sz = 4;
-    } else {
-      header->b1 = 0x7f;
-      header->u.s64.l64 = WS_HTON64(blen);
-      sz = 10;
-    }
+    sz = webSocketsFrameHeader(wsctx->codeBuf, opcode, blen);
 
     if (wsctx->base64) {
         if (-1 == (ret = __b64_ntop((unsigned char *)src, len, wsctx->codeBuf + sz, sizeof(wsctx->codeBuf) - sz))) {
@@ -838,6 +881,23 @@ webSocketsEncode(rfbClientPtr cl, const char *src, int len, char **dst)
     return ((ws_ctx_t *)cl->wsctx)->encode(cl, src, len, dst);
 }
 
+/*
+ * For binary HyBi frames the payload goes out unchanged, so only the frame
+ * header needs to be built: the caller writes hdr and then the payload
+ * itself, saving the copy into codeBuf.  Returns the header length, or 0 if
+ * the payload has to go through webSocketsEncode() (Hixie or base64).
+ */
+int
+webSocketsEncodeHeader(rfbClientPtr cl, int len, char *hdr)
+{
+    ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
+
+    if (wsctx->version != WEBSOCKETS_VERSION_HYBI || wsctx->base64 || !len)
+	return 0;
+
+    return webSocketsFrameHeader(hdr, WS_OPCODE_BINARY_FRAME, len);
+}
+
 int
 webSocketsDecode(rfbClientPtr cl, char *dst, int len)
 {
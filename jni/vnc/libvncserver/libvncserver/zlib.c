@@ -64,10 +64,12 @@ void rfbZlibCleanup(rfbScreenInfoPtr screen)
   if (zlibBeforeBufSize) {
     free(zlibBeforeBuf);
     zlibBeforeBufSize=0;
+    zlibBeforeBuf=NULL;
   }
   if (zlibAfterBufSize) {
     zlibAfterBufSize=0;
     free(zlibAfterBuf);
+    zlibAfterBuf=NULL;
   }
 }
 
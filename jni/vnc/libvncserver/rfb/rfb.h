@@ -140,6 +140,44 @@ enum rfbSocketState {
 	RFB_SOCKET_SHUTDOWN
 };
 
+enum rfbScaleFilter {
+	RFB_SCALE_AREA,
+	RFB_SCALE_BILINEAR,
+	RFB_SCALE_LANCZOS2
+};
+
+/** stages of getting a frame to the clients, see rfbLatencyRecord() */
+enum rfbLatencyStage {
+	/* recorded by the application, once for the whole screen */
+	RFB_LATENCY_FRAME_WAIT,	/**< frame available until the application took it */
+	RFB_LATENCY_CONSUME,	/**< getting the frame from the capture source */
+	RFB_LATENCY_CONVERT,	/**< copying it into the framebuffer */
+	RFB_LATENCY_MARK,	/**< rfbMarkRectAsModified() */
+	/* recorded by the library for every client */
+	RFB_LATENCY_SCALE,	/**< rescaling the client's scaled screen */
+	RFB_LATENCY_ENCODE,	/**< encoding an update, without blocking writes */
+	RFB_LATENCY_WRITE,	/**< handing a batch of data to the socket */
+	RFB_LATENCY_DELIVER,	/**< rfbMarkRegionAsModified() until the update left for the socket */
+	RFB_LATENCY_STAGES
+};
+
+/**
+ * Latency histogram in microseconds with a fixed relative error (HDR
+ * style): values below 32 have a bucket each, every higher power of two is
+ * split into 16 buckets, so a percentile is off by at most 1/16.
+ *
+ * A histogram is never locked.  Only one thread at a time records into it,
+ * readers take whatever counts they see.
+ */
+#define RFB_LATENCY_BUCKETS 464
+
+typedef struct _rfbLatencyHistogram {
+	uint32_t count;
+	uint32_t max;
+	uint64_t total;
+	uint32_t buckets[RFB_LATENCY_BUCKETS];
+} rfbLatencyHistogram;
+
 typedef void (*rfbKbdAddEventProcPtr) (rfbBool down, rfbKeySym keySym, struct _rfbClientRec* cl);
 typedef void (*rfbKbdReleaseAllKeysProcPtr) (struct _rfbClientRec* cl);
 typedef void (*rfbPtrAddEventProcPtr) (int buttonMask, int x, int y, struct _rfbClientRec* cl);
@@ -389,6 +427,34 @@ typedef struct _rfbScreenInfo
     SOCKET listen6Sock;
     int http6Port;
     SOCKET httpListen6Sock;
+    /** if not zero, every client gets its own writer thread (threaded mode
+     * only) and no new update is sent to it while more than this many
+     * bytes are waiting to be written */
+    int sendQueueLimit;
+
+    /** per-client socket policies (Linux only): keep at most this many
+     * unsent bytes in the kernel (TCP_NOTSENT_LOWAT, 0 = kernel default) */
+    int tcpNotSentLowat;
+    /** cork the socket while an update is being written (TCP_CORK) */
+    rfbBool tcpCork;
+    /** size SO_SNDBUF from the bandwidth-delay product reported by TCP_INFO */
+    rfbBool tcpAutoSndBuf;
+    /** if set, also accept clients on this Unix domain socket; a leading
+     * '@' selects the Linux abstract namespace */
+    char* unixSocketPath;
+    SOCKET listenUnixSock;
+    /** tiles of a scaled screen that still need rescaling, see scale.c */
+    struct _rfbScaleCache* scaleCache;
+    /** change tracking and 1/2, 1/4, 1/8 copies shared by the scaled screens */
+    struct _rfbScalePyramid* scalePyramid;
+    /** filter used to produce the scaled screens of this screen */
+    enum rfbScaleFilter scaleFilter;
+    /** the application's stages of every frame, up to RFB_LATENCY_MARK */
+    rfbLatencyHistogram latency[RFB_LATENCY_STAGES];
+    /** frame counters kept by the application, for the /metrics page */
+    uint32_t framesCaptured;   /**< taken from the capture source */
+    uint32_t framesConverted;  /**< copied into the framebuffer */
+    uint32_t framesDropped;    /**< skipped or lost */
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -432,6 +498,10 @@ typedef struct _rfbStatList {
     uint32_t rcvdCount;
     uint32_t bytesRcvd;
     uint32_t bytesRcvdIfRaw;
+    rfbLatencyHistogram *encodeLatency; /**< updates encoded with this encoding */
+    rfbLatencyHistogram *encodeCpu;     /**< CPU time of the same updates */
+    rfbLatencyHistogram *rectPixels;    /**< pixels per rectangle sent, not a time */
+    uint64_t writeMicros;               /**< time the same updates were blocked in rfbWriteExact() */
     struct _rfbStatList *Next;
 } rfbStatList;
 
@@ -590,6 +660,22 @@ typedef struct _rfbClientRec {
     struct _rfbStatList *statMsgList;
     int rawBytesEquivalent;
     int bytesSent;
+    /** the library's stages of every update, from RFB_LATENCY_SCALE on */
+    rfbLatencyHistogram latency[RFB_LATENCY_STAGES];
+    uint64_t writeMicros;      /**< time spent in synchronous writes */
+    uint64_t modifiedAt;       /**< when modifiedRegion got its oldest unsent change, 0 for none */
+    /* updates sent per second, measured over windows of about a second */
+    uint64_t rateWindowStart;
+    int rateWindowUpdates;
+    double updateRate;
+
+    /* socket tuning state, see rfbTuneClientSocket() */
+    rfbBool unixSocket;        /**< connected through the Unix domain listener */
+    rfbBool socketCorked;
+    int socketSndBuf;          /**< SO_SNDBUF as last set from the BDP, 0 if untouched */
+    int socketRtt;             /**< smoothed RTT in microseconds, from TCP_INFO */
+    int socketBdp;             /**< congestion window in bytes, from TCP_INFO */
+    time_t socketLastTuned;
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     /* zlib encoding -- necessary compression state info per client */
@@ -633,6 +719,11 @@ typedef struct _rfbClientRec {
 
     rfbBool useNewFBSize;             /**< client supports NewFBSize encoding */
     rfbBool newFBSizePending;         /**< framebuffer size was changed */
+    rfbBool useExtDesktopSize;        /**< client supports ExtDesktopSize encoding */
+    rfbBool extDesktopSizePending;    /**< an ExtDesktopSize rectangle is due */
+    int extDesktopSizeReason;         /**< ... with this reason and status */
+    int extDesktopSizeStatus;
+    rfbBool clientDesktopSize;        /**< the client chose its size with SetDesktopSize */
 
     struct _rfbClientRec *prev;
     struct _rfbClientRec *next;
@@ -650,6 +741,10 @@ typedef struct _rfbClientRec {
     MUTEX(outputMutex);
     MUTEX(updateMutex);
     COND(updateCond);
+
+    /** output queue drained by the client's writer thread, NULL when
+        writing synchronously */
+    struct _rfbSendQueue* sendQueue;
 #endif
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
@@ -707,7 +802,8 @@ typedef struct _rfbClientRec {
      (((cl)->enableCursorShapeUpdates == FALSE &&                          \
        ((cl)->cursorX != (cl)->screen->cursorX ||                          \
 	(cl)->cursorY != (cl)->screen->cursorY))) ||                       \
-     ((cl)->useNewFBSize && (cl)->newFBSizePending) ||                     \
+     (((cl)->useNewFBSize || (cl)->useExtDesktopSize) &&                   \
+      (cl)->newFBSizePending) || (cl)->extDesktopSizePending ||            \
      ((cl)->enableCursorPosUpdates && (cl)->cursorWasMoved) ||             \
      !sraRgnEmpty((cl)->copyRegion) || !sraRgnEmpty((cl)->modifiedRegion))
 
@@ -755,8 +851,12 @@ extern int rfbConnectToTcpAddr(char* host, int port);
 extern int rfbListenOnTCPPort(int port, in_addr_t iface);
 extern int rfbListenOnTCP6Port(int port, const char* iface);
 extern int rfbListenOnUDPPort(int port, in_addr_t iface);
+extern int rfbListenOnUnixSocket(const char* path);
 extern int rfbStringToAddr(char* string,in_addr_t* addr);
 extern rfbBool rfbSetNonBlocking(int sock);
+extern void rfbTuneClientSocket(rfbClientPtr cl);
+extern void rfbCorkClientSocket(rfbClientPtr cl, rfbBool cork);
+extern void rfbAutoTuneSendBuffer(rfbClientPtr cl);
 
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
 /* websockets.c */
@@ -764,6 +864,8 @@ extern rfbBool rfbSetNonBlocking(int sock);
 extern rfbBool webSocketsCheck(rfbClientPtr cl);
 extern rfbBool webSocketCheckDisconnect(rfbClientPtr cl);
 extern int webSocketsEncode(rfbClientPtr cl, const char *src, int len, char **dst);
+#define WEBSOCKETS_MAX_HEADER_LEN 10
+extern int webSocketsEncodeHeader(rfbClientPtr cl, int len, char *hdr);
 extern int webSocketsDecode(rfbClientPtr cl, char *dst, int len);
 extern rfbBool webSocketsHasDataInBuffer(rfbClientPtr cl);
 #endif
@@ -797,6 +899,7 @@ extern void rfbSendServerCutText(rfbScreenInfoPtr rfbScreen,char *str, int len);
 extern rfbBool rfbSendCopyRegion(rfbClientPtr cl,sraRegionPtr reg,int dx,int dy);
 extern rfbBool rfbSendLastRectMarker(rfbClientPtr cl);
 extern rfbBool rfbSendNewFBSize(rfbClientPtr cl, int w, int h);
+extern rfbBool rfbSendExtDesktopSize(rfbClientPtr cl, int w, int h, int reason, int status);
 extern rfbBool rfbSendSetColourMapEntries(rfbClientPtr cl, int firstColour, int nColours);
 extern void rfbSendBell(rfbScreenInfoPtr rfbScreen);
 
@@ -1085,6 +1188,28 @@ extern int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type);
 
+/* What an encoding cost: histograms (NULL until it was used) of the time
+   and the CPU time its updates took to encode and of its rectangle sizes,
+   and how long its updates were blocked writing */
+extern const rfbLatencyHistogram *rfbStatGetEncodingLatency(rfbClientPtr cl, uint32_t type);
+extern const rfbLatencyHistogram *rfbStatGetEncodingCpuTime(rfbClientPtr cl, uint32_t type);
+extern const rfbLatencyHistogram *rfbStatGetEncodingRectPixels(rfbClientPtr cl, uint32_t type);
+extern uint64_t rfbStatGetEncodingWriteMicros(rfbClientPtr cl, uint32_t type);
+/* all time the client's updates and messages were blocked in rfbWriteExact() */
+extern uint64_t rfbStatGetWriteMicros(rfbClientPtr cl);
+
+/* Latency */
+extern uint64_t rfbLatencyClock(void); /* monotonic, in microseconds */
+extern void rfbLatencyRecord(rfbLatencyHistogram *h, uint64_t micros);
+extern uint32_t rfbLatencyPercentile(const rfbLatencyHistogram *h, double percentile);
+extern const char *rfbLatencyStageName(enum rfbLatencyStage stage);
+/** log p50/p99/max of every stage of the screen and each of its clients */
+extern void rfbPrintLatency(rfbScreenInfoPtr screen);
+/** framebuffer updates sent to the client per second, recently */
+extern double rfbGetUpdateRate(rfbClientPtr cl);
+/** all counters in the Prometheus text format, to be freed by the caller */
+extern char *rfbGetMetrics(rfbScreenInfoPtr screen);
+
 /** Set which version you want to advertise 3.3, 3.6, 3.7 and 3.8 are currently supported*/
 extern void rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_);
 
@@ -94,6 +94,7 @@
 #endif
 
 #define rfbMax(a,b) (((a)>(b))?(a):(b))
+#define rfbMin(a,b) (((a)<(b))?(a):(b))
 #if !defined(WIN32) || defined(__MINGW32__)
 #ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
 #include <sys/time.h>
@@ -420,6 +421,8 @@ typedef struct {
 #define rfbPalmVNCSetScaleFactor 0xF
 /* Xvp message - bidirectional */
 #define rfbXvp 250
+/* ExtendedDesktopSize: the client asks for a framebuffer size of its own */
+#define rfbSetDesktopSize 251
 
 
 
@@ -498,6 +501,7 @@ typedef struct {
 
 #define rfbEncodingLastRect           0xFFFFFF20
 #define rfbEncodingNewFBSize          0xFFFFFF21
+#define rfbEncodingExtDesktopSize     0xFFFFFECC
 
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
@@ -1125,6 +1129,56 @@ typedef struct {
 
 #define sz_rfbXvpMsg (4)
 
+/*-----------------------------------------------------------------------------
+ * ExtendedDesktopSize / SetDesktopSize
+ *
+ * A client that announces the ExtDesktopSize pseudo-encoding may ask for a
+ * framebuffer size with SetDesktopSize, followed by numberOfScreens screen
+ * descriptions.  The server answers, and tells about size changes, with an
+ * ExtDesktopSize rectangle: x is the reason, y the status, w and h the new
+ * size; its body is an rfbExtDesktopSizeMsg followed by the screens.
+ */
+
+typedef struct {
+    uint32_t id;
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint32_t flags;
+} rfbExtDesktopScreen;
+
+#define sz_rfbExtDesktopScreen 16
+
+typedef struct {
+    uint8_t numberOfScreens;
+    uint8_t pad[3];
+} rfbExtDesktopSizeMsg;
+
+#define sz_rfbExtDesktopSizeMsg 4
+
+typedef struct {
+    uint8_t type;			/* always rfbSetDesktopSize */
+    uint8_t pad1;
+    uint16_t width;
+    uint16_t height;
+    uint8_t numberOfScreens;
+    uint8_t pad2;
+} rfbSetDesktopSizeMsg;
+
+#define sz_rfbSetDesktopSizeMsg 8
+
+/* reasons */
+#define rfbExtDesktopSize_GenericChange 0
+#define rfbExtDesktopSize_ClientRequestedChange 1
+#define rfbExtDesktopSize_OtherClientRequestedChange 2
+
+/* status codes */
+#define rfbExtDesktopSize_Success 0
+#define rfbExtDesktopSize_ResizeProhibited 1
+#define rfbExtDesktopSize_OutOfResources 2
+#define rfbExtDesktopSize_InvalidScreenLayout 3
+
 /* server message codes */
 #define rfbXvp_Fail 0
 #define rfbXvp_Init 1
@@ -1444,6 +1498,7 @@ typedef union {
 	rfbSetSWMsg sw;
 	rfbTextChatMsg tc;
         rfbXvpMsg xvp;
+	rfbSetDesktopSizeMsg sdm;
 } rfbClientToServerMsg;
 
 /* 
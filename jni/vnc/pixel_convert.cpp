@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "pixel_convert.hpp"
+
+void convertRowToRgb(unsigned char *out, const unsigned char *in, unsigned int width, unsigned int bpp,
+                     Minicap::Format format) {
+    unsigned int j = 0;
+
+    switch (bpp) {
+    case 1:
+        // RGB 332, red in the low bits
+        for (; j < width; j++) {
+            uint8_t pixel = in[j], r = pixel & 7, g = (pixel >> 3) & 7;
+            *out++ = (r << 5) | (r << 2) | (r >> 1);
+            *out++ = (g << 5) | (g << 2) | (g >> 1);
+            *out++ = (pixel >> 6) * 85;
+        }
+        break;
+    case 2: {
+        const uint16_t *p = (const uint16_t *) in;
+
+        switch (format) {
+        case Minicap::FORMAT_TRANSLUCENT:
+        case Minicap::FORMAT_RGBA_4444:
+            for (; j < width; j++) {
+                uint16_t pixel = p[j];
+                *out++ = (pixel & 15) * 17;
+                *out++ = ((pixel >> 4) & 15) * 17;
+                *out++ = ((pixel >> 8) & 15) * 17;
+            }
+            break;
+        case Minicap::FORMAT_TRANSPARENT:
+        case Minicap::FORMAT_RGBA_5551:
+            for (; j < width; j++) {
+                uint16_t pixel = p[j];
+                uint8_t r = pixel & 31, g = (pixel >> 5) & 31, b = (pixel >> 10) & 31;
+                *out++ = (r << 3) | (r >> 2);
+                *out++ = (g << 3) | (g >> 2);
+                *out++ = (b << 3) | (b >> 2);
+            }
+            break;
+        default:
+            // RGB 565, also what 32 bit frames are downgraded to
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+            for (; j + 8 <= width; j += 8, out += 24) {
+                uint16x8_t v = vld1q_u16(p + j);
+                uint8x8x3_t rgb;
+                rgb.val[0] = vshl_n_u8(vmovn_u16(v), 3);
+                rgb.val[1] = vand_u8(vshrn_n_u16(v, 3), vdup_n_u8(0xfc));
+                rgb.val[2] = vand_u8(vshrn_n_u16(v, 8), vdup_n_u8(0xf8));
+                rgb.val[0] = vorr_u8(rgb.val[0], vshr_n_u8(rgb.val[0], 5));
+                rgb.val[1] = vorr_u8(rgb.val[1], vshr_n_u8(rgb.val[1], 6));
+                rgb.val[2] = vorr_u8(rgb.val[2], vshr_n_u8(rgb.val[2], 5));
+                vst3_u8(out, rgb);
+            }
+#endif
+            for (; j < width; j++) {
+                uint16_t pixel = p[j];
+                uint8_t r = pixel & 31, g = (pixel >> 5) & 63, b = pixel >> 11;
+                *out++ = (r << 3) | (r >> 2);
+                *out++ = (g << 2) | (g >> 4);
+                *out++ = (b << 3) | (b >> 2);
+            }
+            break;
+        }
+        break;
+    }
+    case 3:
+        memcpy(out, in, width * 3);
+        break;
+    case 4: {
+        // RGBX, or BGRX for BGRA captures
+        int r = format == Minicap::FORMAT_BGRA_8888 ? 2 : 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+        for (; j + 16 <= width; j += 16, out += 48) {
+            uint8x16x4_t v = vld4q_u8(in + 4 * j);
+            uint8x16x3_t rgb;
+            rgb.val[0] = r ? v.val[2] : v.val[0];
+            rgb.val[1] = v.val[1];
+            rgb.val[2] = r ? v.val[0] : v.val[2];
+            vst3q_u8(out, rgb);
+        }
+#endif
+        for (; j < width; j++, out += 3) {
+            out[0] = in[4 * j + r];
+            out[1] = in[4 * j + 1];
+            out[2] = in[4 * j + 2 - r];
+        }
+        break;
+    }
+    case 8:
+        // 16 bits per channel, keep the high bytes
+        for (; j < width; j++, in += 8) {
+            *out++ = in[1];
+            *out++ = in[3];
+            *out++ = in[5];
+        }
+        break;
+    }
+}
+
+bool scaleArea(unsigned char *out, unsigned int outWidth, unsigned int outHeight, const unsigned char *in,
+               unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format) {
+    std::vector<unsigned char> rgb(width * 3);
+    std::vector<uint32_t> sums(width * 3);
+    std::vector<unsigned int> left(outWidth + 1);
+    unsigned int x, y, i;
+
+    if (outWidth == 0 || outHeight == 0 || outWidth > width || outHeight > height)
+        return false;
+
+    // Each output pixel covers whole source pixels, from left[x] up to
+    // left[x + 1], which keeps the filter to sums and one division
+    for (x = 0; x <= outWidth; x++)
+        left[x] = (unsigned long long) x * width / outWidth;
+
+    for (y = 0; y < outHeight; y++) {
+        unsigned int top = (unsigned long long) y * height / outHeight;
+        unsigned int bottom = (unsigned long long) (y + 1) * height / outHeight;
+
+        // Add up the columns of the source rows this output row covers
+        memset(&sums[0], 0, sums.size() * sizeof(sums[0]));
+        for (unsigned int row = top; row < bottom; row++) {
+            convertRowToRgb(&rgb[0], in + (size_t) row * stride * bpp, width, bpp, format);
+            for (i = 0; i < width * 3; i++)
+                sums[i] += rgb[i];
+        }
+
+        for (x = 0; x < outWidth; x++, out += 4) {
+            unsigned int count = (left[x + 1] - left[x]) * (bottom - top);
+            uint32_t r = 0, g = 0, b = 0;
+
+            for (i = left[x] * 3; i < left[x + 1] * 3; i += 3) {
+                r += sums[i];
+                g += sums[i + 1];
+                b += sums[i + 2];
+            }
+            out[0] = (r + count / 2) / count;
+            out[1] = (g + count / 2) / count;
+            out[2] = (b + count / 2) / count;
+            out[3] = 255;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef PIXEL_CONVERT_HPP
+#define PIXEL_CONVERT_HPP
+
+#include "Minicap.hpp"
+
+// Expand width pixels of bpp bytes, laid out as setupScreen*() describes
+// them for format, into 8 bit RGB
+void convertRowToRgb(unsigned char *out, const unsigned char *in, unsigned int width, unsigned int bpp,
+                     Minicap::Format format);
+
+// Shrink width x height pixels, stride pixels apart, to outWidth x
+// outHeight (no larger) RGBX 8888 pixels by averaging the source pixels
+// each output pixel covers
+bool scaleArea(unsigned char *out, unsigned int outWidth, unsigned int outHeight, const unsigned char *in,
+               unsigned int width, unsigned int height, unsigned int stride, unsigned int bpp, Minicap::Format format);
+
+#endif
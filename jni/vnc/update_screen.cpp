@@ -166,3 +166,43 @@ void setupScreen42() {
 #undef OUT_BYTES_PER_PIXEL
 #undef IN_TYPE
 #undef OUT_TYPE
+
+template <typename T>
+static void copyRegion(T *out, int rotation, unsigned int left, unsigned int top, unsigned int width, unsigned int height) {
+    unsigned int stride = frame.stride, frameWidth = frame.width, frameHeight = frame.height;
+    const T *data = (const T *) frame.data;
+
+    for (y = top; y < top + height; y++) {
+        if (rotation == 0) {
+            memcpy(out, data + y * stride + left, width * sizeof(T));
+            out += width;
+            continue;
+        }
+        for (x = left; x < left + width; x++) {
+            // Invert the mapping of updateScreen*()
+            if (rotation == 90)
+                *out++ = data[(frameHeight - 1 - x) * stride + y];
+            else if (rotation == 180)
+                *out++ = data[(frameHeight - 1 - y) * stride + (frameWidth - 1 - x)];
+            else // if (rotation == 270)
+                *out++ = data[x * stride + (frameWidth - 1 - y)];
+        }
+    }
+}
+
+void copyScreenRegion(int rotation, unsigned int left, unsigned int top, unsigned int width, unsigned int height) {
+    switch (frame.bpp) {
+    case 1:
+        copyRegion((uint8_t *) vncbuf, rotation, left, top, width, height);
+        break;
+    case 2:
+        copyRegion((uint16_t *) vncbuf, rotation, left, top, width, height);
+        break;
+    case 4:
+        copyRegion((uint32_t *) vncbuf, rotation, left, top, width, height);
+        break;
+    case 8:
+        copyRegion((uint64_t *) vncbuf, rotation, left, top, width, height);
+        break;
+    }
+}
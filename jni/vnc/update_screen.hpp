@@ -15,4 +15,8 @@ void updateScreen4(int);
 void updateScreen8(int);
 void updateScreen42(int);
 
+// Copy the left, top, width x height region of the screen as rotated by
+// updateScreen*(rotation) from the frame into vncbuf, width pixels apart
+void copyScreenRegion(int rotation, unsigned int left, unsigned int top, unsigned int width, unsigned int height);
+
 #endif
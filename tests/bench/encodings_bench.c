@@ -0,0 +1,589 @@
+/*
+ * Encoder benchmark: replays frame sequences through every libvncserver
+ * encoder at every client pixel format and reports bytes per frame, encode
+ * time per frame and the frame rate that would be reached at a few link
+ * speeds.
+ *
+ * A sequence is a file of concatenated binary PPM (P6) frames of one size,
+ * as written by e.g.
+ *
+ *   ffmpeg -i game.mp4 -vf scale=720:-1 -f image2pipe -vcodec ppm game.ppm
+ *
+ * Without files, synthetic static UI, scrolling, video and game sequences
+ * are generated.
+ *
+ * Every frame is marked modified as a whole, as droidvncserver does; -d
+ * only marks the 16x16 tiles which changed since the previous frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#define TILE_SIZE 16
+
+typedef struct {
+    const char *name;
+    uint32_t encoding;
+    int compress;   /* -1 for the encoder's default */
+    int quality;    /* -1 for lossless */
+} EncoderConfig;
+
+static const EncoderConfig encoders[] = {
+    { "raw",          rfbEncodingRaw,      -1, -1 },
+    { "hextile",      rfbEncodingHextile,  -1, -1 },
+    { "zlib",         rfbEncodingZlib,     -1, -1 },
+    { "zrle",         rfbEncodingZRLE,     -1, -1 },
+    { "zywrle-q9",    rfbEncodingZYWRLE,   -1,  9 },
+    { "zywrle-q5",    rfbEncodingZYWRLE,   -1,  5 },
+    { "zywrle-q0",    rfbEncodingZYWRLE,   -1,  0 },
+    { "tight-c0",     rfbEncodingTight,     0, -1 },
+    { "tight-c1",     rfbEncodingTight,     1, -1 },
+    { "tight-c2",     rfbEncodingTight,     2, -1 },
+    { "tight-c3",     rfbEncodingTight,     3, -1 },
+    { "tight-c4",     rfbEncodingTight,     4, -1 },
+    { "tight-c5",     rfbEncodingTight,     5, -1 },
+    { "tight-c6",     rfbEncodingTight,     6, -1 },
+    { "tight-c7",     rfbEncodingTight,     7, -1 },
+    { "tight-c8",     rfbEncodingTight,     8, -1 },
+    { "tight-c9",     rfbEncodingTight,     9, -1 },
+    { "tight-q0",     rfbEncodingTight,    -1,  0 },
+    { "tight-q1",     rfbEncodingTight,    -1,  1 },
+    { "tight-q2",     rfbEncodingTight,    -1,  2 },
+    { "tight-q3",     rfbEncodingTight,    -1,  3 },
+    { "tight-q4",     rfbEncodingTight,    -1,  4 },
+    { "tight-q5",     rfbEncodingTight,    -1,  5 },
+    { "tight-q6",     rfbEncodingTight,    -1,  6 },
+    { "tight-q7",     rfbEncodingTight,    -1,  7 },
+    { "tight-q8",     rfbEncodingTight,    -1,  8 },
+    { "tight-q9",     rfbEncodingTight,    -1,  9 },
+    { "tightpng",     rfbEncodingTightPng, -1, -1 },
+    { "tightpng-q5",  rfbEncodingTightPng, -1,  5 },
+    { "ultra",        rfbEncodingUltra,    -1, -1 },
+};
+
+#define ENCODER_COUNT ((int)(sizeof(encoders) / sizeof(encoders[0])))
+
+typedef struct {
+    const char *name;
+    int bitsPerPixel, depth;
+    int redMax, greenMax, blueMax;
+    int redShift, greenShift, blueShift;
+} ClientFormat;
+
+static const ClientFormat formats[] = {
+    { "32", 32, 24, 255, 255, 255, 16, 8, 0 },
+    { "16", 16, 16, 31, 63, 31, 11, 5, 0 },
+    { "8",  8,  8,  7, 7, 3, 0, 3, 6 },
+};
+
+#define FORMAT_COUNT ((int)(sizeof(formats) / sizeof(formats[0])))
+
+typedef struct {
+    char name[64];
+    int width, height, count;
+    uint32_t **frames;   /* in the screen's pixel format */
+} Sequence;
+
+static int diffTiles = FALSE;
+static int maxFrames = 30;
+static int runs = 3;
+static double linkMbits[8] = { 1, 10, 100 };
+static int linkCount = 3;
+
+
+/*
+ * Sequences
+ */
+
+static uint32_t rgb(int r, int g, int b)
+{
+    /* rfbGetScreen(..., 8, 3, 4) puts red in the lowest byte */
+    return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16);
+}
+
+static unsigned int lcg(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+static uint32_t *newFrame(Sequence *seq)
+{
+    uint32_t *frame = (uint32_t *)malloc(seq->width * seq->height * 4);
+    if (frame == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    seq->frames[seq->count++] = frame;
+    return frame;
+}
+
+static void fillRect(uint32_t *frame, int stride, int x, int y, int w, int h, uint32_t colour)
+{
+    int i, j;
+    for (j = y; j < y + h; j++)
+        for (i = x; i < x + w; i++)
+            frame[j * stride + i] = colour;
+}
+
+/* rows of glyph-like 6x10 cells, dark on the background */
+static void drawText(uint32_t *frame, int stride, int x, int y, int chars, unsigned int seed)
+{
+    int c, i, j;
+    for (c = 0; c < chars; c++) {
+        unsigned int bits = lcg(&seed) | (lcg(&seed) << 16);
+        if ((bits & 7) == 0)
+            continue; /* a space */
+        for (j = 1; j < 9; j++)
+            for (i = 0; i < 5; i++)
+                if ((bits >> ((j * 5 + i) % 31)) & 1)
+                    frame[(y + j) * stride + x + c * 6 + i] = rgb(40, 40, 48);
+    }
+}
+
+/* a settings-like screen: title bar, list rows with icons and text */
+static void drawUi(uint32_t *frame, int width, int height, int scroll)
+{
+    int y, row;
+
+    fillRect(frame, width, 0, 0, width, height, rgb(250, 250, 250));
+    for (y = 0; y < height; y++) {
+        int pageY = y + scroll;
+        row = pageY / 72;
+        if (pageY % 72 == 71) {
+            fillRect(frame, width, 0, y, width, 1, rgb(220, 220, 224));
+        } else if (pageY % 72 == 20 && y + 42 < height) {
+            fillRect(frame, width, 16, y, 32, 32, rgb((row * 53) & 255, (row * 97) & 255, 200));
+            drawText(frame, width, 64, y + 2, (width - 80) / 6, row * 7 + 1);
+            drawText(frame, width, 64, y + 18, (width - 120) / 12, row * 7 + 2);
+        }
+    }
+    fillRect(frame, width, 0, 0, width, 48, rgb(33, 150, 243));
+    drawText(frame, width, 16, 19, 12, 4711);
+}
+
+static void makeStatic(Sequence *seq)
+{
+    int n;
+    for (n = 0; n < maxFrames; n++) {
+        uint32_t *frame = newFrame(seq);
+        drawUi(frame, seq->width, seq->height, 0);
+        /* a blinking cursor and a clock ticking every 10 frames */
+        if (n & 1)
+            fillRect(frame, seq->width, 64, 96, 2, 12, rgb(0, 0, 0));
+        drawText(frame, seq->width, seq->width - 48, 19, 5, 100 + n / 10);
+    }
+}
+
+static void makeScroll(Sequence *seq)
+{
+    int n;
+    for (n = 0; n < maxFrames; n++)
+        drawUi(newFrame(seq), seq->width, seq->height, n * 12);
+}
+
+/* moving gradients with sensor noise: every pixel changes every frame */
+static void makeVideo(Sequence *seq)
+{
+    unsigned int seed = 1;
+    int n, x, y;
+    for (n = 0; n < maxFrames; n++) {
+        uint32_t *frame = newFrame(seq);
+        for (y = 0; y < seq->height; y++)
+            for (x = 0; x < seq->width; x++) {
+                int noise = (int)(lcg(&seed) & 7) - 4;
+                int r = (x + n * 3) * 255 / (seq->width + 90) + noise;
+                int g = (y + n * 2) * 255 / (seq->height + 60) + noise;
+                int b = ((x + y) / 4 + n * 5) & 255;
+                frame[y * seq->width + x] = rgb(r < 0 ? 0 : r > 255 ? 255 : r,
+                                                g < 0 ? 0 : g > 255 ? 255 : g, b);
+            }
+    }
+}
+
+/* a side scroller: textured background and solid sprites moving over it */
+static void makeGame(Sequence *seq)
+{
+    int n, x, y, s;
+    for (n = 0; n < maxFrames; n++) {
+        uint32_t *frame = newFrame(seq);
+        for (y = 0; y < seq->height; y++)
+            for (x = 0; x < seq->width; x++) {
+                int tx = (x + n * 4) & 31, ty = y & 31;
+                int shade = ((tx ^ ty) & 8) ? 40 : 0;
+                frame[y * seq->width + x] = y > seq->height * 3 / 4
+                    ? rgb(90 + shade, 60 + shade, 30)
+                    : rgb(60 + shade / 2, 120 + shade / 2, 220);
+            }
+        for (s = 0; s < 8; s++) {
+            int w = 24 + s * 4;
+            int sx = (s * 97 + n * (3 + s)) % (seq->width - w);
+            int sy = (s * 131 + n * (s % 3)) % (seq->height - w);
+            fillRect(frame, seq->width, sx, sy, w, w, rgb(255, 40 * s, 0));
+        }
+    }
+}
+
+static void makeSynthetic(Sequence *seq, const char *name, int width, int height,
+                          void (*make)(Sequence *))
+{
+    snprintf(seq->name, sizeof(seq->name), "%s", name);
+    seq->width = width;
+    seq->height = height;
+    seq->count = 0;
+    seq->frames = (uint32_t **)calloc(maxFrames, sizeof(uint32_t *));
+    make(seq);
+}
+
+static int readPpmNumber(FILE *f)
+{
+    int c, n = 0;
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(f)) != EOF && c != '\n')
+                ;
+        } else if (c >= '0' && c <= '9') {
+            break;
+        }
+    }
+    if (c == EOF)
+        return -1;
+    do {
+        n = n * 10 + c - '0';
+    } while ((c = fgetc(f)) >= '0' && c <= '9');
+    return n;
+}
+
+static void freeSequence(Sequence *seq)
+{
+    int i;
+    for (i = 0; i < seq->count; i++)
+        free(seq->frames[i]);
+    free(seq->frames);
+}
+
+static rfbBool loadPpm(Sequence *seq, const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    const char *base = strrchr(filename, '/');
+    unsigned char *row;
+    uint32_t *frame;
+    int width, height, maxval, x, y;
+
+    snprintf(seq->name, sizeof(seq->name), "%s", base ? base + 1 : filename);
+    seq->count = 0;
+    seq->frames = (uint32_t **)calloc(maxFrames, sizeof(uint32_t *));
+    if (f == NULL) {
+        perror(filename);
+        return FALSE;
+    }
+
+    while (seq->count < maxFrames && fgetc(f) == 'P' && fgetc(f) == '6') {
+        width = readPpmNumber(f);
+        height = readPpmNumber(f);
+        maxval = readPpmNumber(f);
+        if (width <= 0 || height <= 0 || maxval != 255 ||
+            (seq->count > 0 && (width != seq->width || height != seq->height))) {
+            fprintf(stderr, "%s: frame %d is not an 8 bit PPM the size of the first\n",
+                    filename, seq->count + 1);
+            break;
+        }
+        seq->width = width;
+        seq->height = height;
+
+        frame = newFrame(seq);
+        row = (unsigned char *)malloc(width * 3);
+        for (y = 0; y < height; y++) {
+            if (fread(row, 3, width, f) != (size_t)width)
+                break;
+            for (x = 0; x < width; x++)
+                frame[y * width + x] = rgb(row[x * 3], row[x * 3 + 1], row[x * 3 + 2]);
+        }
+        free(row);
+        if (y < height) {
+            fprintf(stderr, "%s: frame %d is truncated\n", filename, seq->count);
+            free(seq->frames[--seq->count]);
+            break;
+        }
+    }
+    fclose(f);
+
+    if (seq->count == 0) {
+        fprintf(stderr, "%s: no frames\n", filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/*
+ * Running the encoders
+ */
+
+static void *drainClient(void *data)
+{
+    int sock = *(int *)data;
+    char buf[65536];
+
+    while (read(sock, buf, sizeof(buf)) > 0)
+        ;
+    close(sock);
+    return NULL;
+}
+
+/* talk to the server as a viewer would: pixel format, then encodings */
+static void negotiate(rfbClientPtr cl, int sock, const ClientFormat *format,
+                      const EncoderConfig *config)
+{
+    rfbSetPixelFormatMsg spf;
+    char buf[sz_rfbSetEncodingsMsg + 4 * 4];
+    rfbSetEncodingsMsg *se = (rfbSetEncodingsMsg *)buf;
+    uint32_t *encs = (uint32_t *)(buf + sz_rfbSetEncodingsMsg);
+    int n = 0;
+
+    memset(&spf, 0, sizeof(spf));
+    spf.type = rfbSetPixelFormat;
+    spf.format.bitsPerPixel = format->bitsPerPixel;
+    spf.format.depth = format->depth;
+    spf.format.bigEndian = 0;
+    spf.format.trueColour = 1;
+    spf.format.redMax = Swap16IfLE(format->redMax);
+    spf.format.greenMax = Swap16IfLE(format->greenMax);
+    spf.format.blueMax = Swap16IfLE(format->blueMax);
+    spf.format.redShift = format->redShift;
+    spf.format.greenShift = format->greenShift;
+    spf.format.blueShift = format->blueShift;
+
+    encs[n++] = Swap32IfLE(config->encoding);
+    if (config->compress >= 0)
+        encs[n++] = Swap32IfLE(rfbEncodingCompressLevel0 + config->compress);
+    if (config->quality >= 0)
+        encs[n++] = Swap32IfLE(rfbEncodingQualityLevel0 + config->quality);
+    encs[n++] = Swap32IfLE(rfbEncodingLastRect);
+    se->type = rfbSetEncodings;
+    se->pad = 0;
+    se->nEncodings = Swap16IfLE(n);
+
+    if (write(sock, &spf, sz_rfbSetPixelFormatMsg) != sz_rfbSetPixelFormatMsg ||
+        write(sock, buf, sz_rfbSetEncodingsMsg + n * 4) != sz_rfbSetEncodingsMsg + n * 4) {
+        perror("negotiate");
+        exit(1);
+    }
+    rfbProcessClientMessage(cl);
+    rfbProcessClientMessage(cl);
+}
+
+/* the tiles of the screen which differ between the frames */
+static sraRegionPtr changedTiles(const Sequence *seq, const uint32_t *prev, const uint32_t *frame)
+{
+    sraRegionPtr region = sraRgnCreate();
+    int tx, ty, y;
+
+    for (ty = 0; ty < seq->height; ty += TILE_SIZE) {
+        int th = seq->height - ty < TILE_SIZE ? seq->height - ty : TILE_SIZE;
+        for (tx = 0; tx < seq->width; tx += TILE_SIZE) {
+            int tw = seq->width - tx < TILE_SIZE ? seq->width - tx : TILE_SIZE;
+            for (y = ty; y < ty + th; y++)
+                if (memcmp(prev + y * seq->width + tx, frame + y * seq->width + tx, tw * 4))
+                    break;
+            if (y < ty + th) {
+                sraRegionPtr tile = sraRgnCreateRect(tx, ty, tx + tw, ty + th);
+                sraRgnOr(region, tile);
+                sraRgnDestroy(tile);
+            }
+        }
+    }
+    return region;
+}
+
+/* one pass over the sequence with a fresh client, so no encoder state carries over */
+static void encodeSequence(rfbScreenInfoPtr screen, const Sequence *seq,
+                           const ClientFormat *format, const EncoderConfig *config,
+                           int *bytes, uint64_t *encodeMicros)
+{
+    sraRegionPtr all = sraRgnCreateRect(0, 0, seq->width, seq->height);
+    rfbClientPtr cl;
+    pthread_t drainer;
+    int sv[2], i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    /* this waits a moment for a WebSockets handshake which never comes */
+    if ((cl = rfbNewClient(screen, sv[0])) == NULL) {
+        fprintf(stderr, "Could not create a client\n");
+        exit(1);
+    }
+    cl->state = RFB_NORMAL;
+    negotiate(cl, sv[1], format, config);
+    pthread_create(&drainer, NULL, drainClient, &sv[1]);
+
+    memset(cl->latency, 0, sizeof(cl->latency));
+    *bytes = rfbStatGetSentBytes(cl);
+    for (i = 0; i < seq->count; i++) {
+        sraRegionPtr region = diffTiles && i > 0
+            ? changedTiles(seq, seq->frames[i - 1], seq->frames[i])
+            : sraRgnCreateRgn(all);
+
+        memcpy(screen->frameBuffer, seq->frames[i], seq->width * seq->height * 4);
+        sraRgnOr(cl->requestedRegion, all);
+        if (!sraRgnEmpty(region))
+            rfbSendFramebufferUpdate(cl, region);
+        sraRgnDestroy(region);
+    }
+    *bytes = rfbStatGetSentBytes(cl) - *bytes;
+    /* this leaves out the time spent blocked on the socket */
+    *encodeMicros = cl->latency[RFB_LATENCY_ENCODE].total;
+
+    rfbCloseClient(cl);
+    rfbClientConnectionGone(cl);
+    pthread_join(drainer, NULL);
+    sraRgnDestroy(all);
+}
+
+static void runEncoder(rfbScreenInfoPtr screen, const Sequence *seq,
+                       const ClientFormat *format, const EncoderConfig *config)
+{
+    uint64_t encodeMicros, bestMicros = 0;
+    double bytesPerFrame, msPerFrame;
+    int bytes, run, i;
+
+    /* the output is the same every run, the fastest run is least disturbed */
+    for (run = 0; run < runs; run++) {
+        encodeSequence(screen, seq, format, config, &bytes, &encodeMicros);
+        if (run == 0 || encodeMicros < bestMicros)
+            bestMicros = encodeMicros;
+    }
+
+    bytesPerFrame = (double)bytes / seq->count;
+    msPerFrame = (double)bestMicros / 1000.0 / seq->count;
+    printf("%-16.16s %3s %-12s %12.0f %7.1f %9.2f", seq->name, format->name, config->name,
+           bytesPerFrame, seq->width * seq->height * (format->bitsPerPixel / 8) / bytesPerFrame,
+           msPerFrame);
+    for (i = 0; i < linkCount; i++) {
+        double linkFps = linkMbits[i] * 1000000.0 / 8 / bytesPerFrame;
+        double encodeFps = msPerFrame > 0 ? 1000.0 / msPerFrame : linkFps;
+        printf(" %9.1f", linkFps < encodeFps ? linkFps : encodeFps);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void runSequence(const Sequence *seq, const char *onlyEncoder, const char *onlyFormat)
+{
+    int argc = 0;
+    rfbScreenInfoPtr screen = rfbGetScreen(&argc, NULL, seq->width, seq->height, 8, 3, 4);
+    int e, f;
+
+    screen->frameBuffer = (char *)malloc(seq->width * seq->height * 4);
+    screen->cursor = NULL;
+
+    for (f = 0; f < FORMAT_COUNT; f++) {
+        if (onlyFormat && strcmp(onlyFormat, formats[f].name))
+            continue;
+        for (e = 0; e < ENCODER_COUNT; e++) {
+            if (onlyEncoder && strncmp(onlyEncoder, encoders[e].name, strlen(onlyEncoder)))
+                continue;
+            runEncoder(screen, seq, &formats[f], &encoders[e]);
+        }
+    }
+
+    free(screen->frameBuffer);
+    rfbScreenCleanup(screen);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [sequence.ppm ...]\n"
+            "  -n <frames>\t\t Frames of every sequence to use (default 30)\n"
+            "  -r <runs>\t\t Encode every sequence this often, report the fastest (default 3)\n"
+            "  -s <width>x<height>\t Size of the synthetic sequences (default 540x960)\n"
+            "  -e <encoder>\t\t Only run encoders whose name starts with this\n"
+            "  -f <bpp>\t\t Only run this client pixel format (32, 16, 8)\n"
+            "  -l <Mbit/s,...>\t Link speeds to report frame rates for (default 1,10,100)\n"
+            "  -d\t\t\t Only mark the 16x16 tiles which changed\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *onlyEncoder = NULL, *onlyFormat = NULL;
+    int width = 540, height = 960, c, i;
+    Sequence seq;
+
+    while ((c = getopt(argc, argv, "n:r:s:e:f:l:d")) != -1) {
+        switch (c) {
+        case 'n':
+            if ((maxFrames = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if ((runs = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 64 || height < 64)
+                usage(argv[0]);
+            break;
+        case 'e':
+            onlyEncoder = optarg;
+            break;
+        case 'f':
+            onlyFormat = optarg;
+            break;
+        case 'l': {
+            char *s = optarg;
+            for (linkCount = 0; linkCount < 8 && *s; linkCount++) {
+                linkMbits[linkCount] = strtod(s, &s);
+                if (*s == ',')
+                    s++;
+            }
+            break;
+        }
+        case 'd':
+            diffTiles = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    rfbLogEnable(0);
+    printf("%-16s %3s %-12s %12s %7s %9s", "sequence", "bpp", "encoder", "bytes/frame",
+           "ratio", "ms/frame");
+    for (i = 0; i < linkCount; i++) {
+        char title[32];
+        snprintf(title, sizeof(title), "fps@%gM", linkMbits[i]);
+        printf(" %9s", title);
+    }
+    printf("\n");
+
+    if (optind == argc) {
+        static const struct { const char *name; void (*make)(Sequence *); } synthetic[] = {
+            { "static", makeStatic }, { "scroll", makeScroll },
+            { "video", makeVideo }, { "game", makeGame },
+        };
+        for (i = 0; i < (int)(sizeof(synthetic) / sizeof(synthetic[0])); i++) {
+            makeSynthetic(&seq, synthetic[i].name, width, height, synthetic[i].make);
+            runSequence(&seq, onlyEncoder, onlyFormat);
+            freeSequence(&seq);
+        }
+    } else {
+        for (i = optind; i < argc; i++) {
+            if (loadPpm(&seq, argv[i]))
+                runSequence(&seq, onlyEncoder, onlyFormat);
+            freeSequence(&seq);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+LOCAL_PATH:= $(call my-dir)
+BENCH_PATH:= $(LOCAL_PATH)
+include $(CLEAR_VARS)
+
+VNC_ROOT:=../../../jni/vnc
+
+LOCAL_SRC_FILES := \
+										../update_screen_bench.cpp \
+										$(VNC_ROOT)/update_screen.cpp
+
+LOCAL_C_INCLUDES += \
+										$(LOCAL_PATH)/$(VNC_ROOT) \
+										$(LOCAL_PATH)/$(VNC_ROOT)/libvncserver/common \
+										$(LOCAL_PATH)/$(VNC_ROOT)/libvncserver/libvncserver \
+										$(LOCAL_PATH)/$(VNC_ROOT)/libvncserver/rfb \
+										$(LOCAL_PATH)/$(VNC_ROOT)/libvncserver/ \
+										$(LOCAL_PATH)/../../../jni/minicap-shared/aosp/include
+
+LOCAL_MODULE := update_screen_bench
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LIBVNCSERVER_ROOT:=$(VNC_ROOT)/libvncserver
+
+# As in ../../../jni/vnc/Android.mk, but without OpenSSL
+LOCAL_SRC_FILES := \
+	../encodings_bench.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/main.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/rfbserver.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/rfbregion.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/auth.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/sockets.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/sendqueue.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/stats.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/corre.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/rfbssl_none.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/rfbcrypto_included.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/hextile.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/rre.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/translate.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/cutpaste.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/httpd.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/cursor.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/font.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/draw.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/websockets.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/selbox.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/cargs.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/ultra.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/scale.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/zlib.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/zrle.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/zrleoutstream.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/zrlepalettehelper.c \
+	$(LIBVNCSERVER_ROOT)/libvncserver/tight.c \
+	$(LIBVNCSERVER_ROOT)/common/d3des.c \
+	$(LIBVNCSERVER_ROOT)/common/vncauth.c \
+	$(LIBVNCSERVER_ROOT)/common/minilzo.c \
+	$(LIBVNCSERVER_ROOT)/common/zywrletemplate.c \
+	$(LIBVNCSERVER_ROOT)/common/md5.c \
+	$(LIBVNCSERVER_ROOT)/common/sha1.c
+
+LOCAL_CFLAGS += \
+  -Wall \
+  -Wno-unused-variable \
+  -Wno-maybe-uninitialized \
+  -Wno-unused-but-set-variable \
+  -DLIBVNCSERVER_HAVE_LIBPNG \
+  -DLIBVNCSERVER_HAVE_ZLIB \
+  -DNOAPP
+
+LOCAL_C_INCLUDES += \
+										$(LOCAL_PATH)/../../../jni/libpng \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/common \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/libvncserver \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/rfb \
+										$(LOCAL_PATH)/$(LIBVNCSERVER_ROOT)/
+
+LOCAL_LDLIBS += -llog -lz -ldl
+
+LOCAL_STATIC_LIBRARIES := libjpeg-turbo libpng
+
+LOCAL_MODULE := encodings_bench
+
+include $(BUILD_EXECUTABLE)
+
+include $(BENCH_PATH)/../../../jni/libjpeg-turbo/Android.mk
+include $(BENCH_PATH)/../../../jni/libpng/Android.mk
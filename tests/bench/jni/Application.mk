@@ -0,0 +1,22 @@
+# The kernels are built as in ../../../jni/Application.mk, so the numbers
+# match what ships
+NDK_TOOLCHAIN_VERSION=4.9
+APP_CPPFLAGS += -std=c++11 -fexceptions
+APP_STL := gnustl_static
+
+APP_CFLAGS += \
+	-Ofast \
+	-funroll-loops \
+	-fno-strict-aliasing
+
+APP_CFLAGS += \
+	-march=armv7-a \
+	-mfpu=neon \
+	-mfloat-abi=softfp \
+	-marm \
+	-fprefetch-loop-arrays \
+	-DHAVE_NEON=1
+
+APP_ABI:=armeabi-v7a 
+APP_OPTIM := debug
+APP_PLATFORM := android-18
@@ -0,0 +1,536 @@
+/*
+ * Loopback load test: starts a libvncserver fed by a synthetic frame
+ * source in a child process, connects a number of headless libvncclient
+ * viewers to it and reports, per viewer, the frames delivered per second
+ * and the latency from a frame being published to it being decoded, plus
+ * the CPU the server used.
+ *
+ * Every frame carries its sequence number as a row of black and white
+ * blocks in the top left corner, large enough to survive lossy encodings,
+ * 8 bit pixel formats and scaling, and its complement in a second row.
+ * The server notes when it published each frame in memory shared with the
+ * viewers.  An update whose rows disagree was encoded while the server was
+ * writing the next frame; those are counted as torn.
+ *
+ * The viewers are given a mix of encodings, pixel formats and scales, the
+ * viewer n gets encoding n, pixel format n / encodings and scale
+ * n / (encodings * formats) of the lists, each taken modulo its length.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+/* the sequence number and its complement, one bit per block */
+#define STAMP_BITS 16
+#define STAMP_BLOCK 16
+#define STAMP_WIDTH (STAMP_BITS * STAMP_BLOCK)
+#define STAMP_HEIGHT (2 * STAMP_BLOCK)
+#define STAMP_FRAMES (1 << STAMP_BITS)
+
+#define MAX_MIX 16
+
+typedef struct {
+    const char *name;
+    int bitsPerPixel, depth;
+    int redMax, greenMax, blueMax;
+    int redShift, greenShift, blueShift;
+} ClientFormat;
+
+static const ClientFormat formats[] = {
+    { "32", 32, 24, 255, 255, 255, 16, 8, 0 },
+    { "16", 16, 16, 31, 63, 31, 11, 5, 0 },
+    { "8",  8,  8,  7, 7, 3, 0, 3, 6 },
+};
+
+#define FORMAT_COUNT ((int)(sizeof(formats) / sizeof(formats[0])))
+
+typedef struct {
+    int index;
+    const char *encoding;
+    const ClientFormat *format;
+    int scale;
+    pthread_t thread;
+
+    /* counted between the end of the warm up and the end of the run */
+    unsigned int updates, frames, torn;
+    int lastFrame;
+    rfbLatencyHistogram latency;
+    rfbBool connected, failed;
+} Viewer;
+
+static int width = 720, height = 1280, port = 5977;
+static int frameRate = 30, duration = 10, warmUp = 2;
+static int qualityLevel = -1, compressLevel = -1;
+static const char *content = "ui";
+
+/* written by the server process, read by the viewers */
+typedef struct {
+    uint64_t publishedAt[STAMP_FRAMES];   /* when each frame was published */
+    uint64_t sourceMicros;                /* CPU time spent drawing frames */
+} Shared;
+
+static volatile Shared *shared;
+static volatile int measuring, stopping;
+static Viewer *viewers;
+
+
+/*
+ * Server
+ */
+
+static uint32_t rgb(int r, int g, int b)
+{
+    return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16);
+}
+
+static void fillRect(uint32_t *fb, int x, int y, int w, int h, uint32_t colour)
+{
+    int i, j;
+    for (j = y; j < y + h && j < height; j++)
+        for (i = x; i < x + w && i < width; i++)
+            fb[j * width + i] = colour;
+}
+
+static void drawStamp(uint32_t *fb, unsigned int frame)
+{
+    int bit;
+    for (bit = 0; bit < STAMP_BITS; bit++) {
+        int set = (frame >> bit) & 1;
+        fillRect(fb, bit * STAMP_BLOCK, 0, STAMP_BLOCK, STAMP_BLOCK,
+                 set ? rgb(255, 255, 255) : 0);
+        fillRect(fb, bit * STAMP_BLOCK, STAMP_BLOCK, STAMP_BLOCK, STAMP_BLOCK,
+                 set ? 0 : rgb(255, 255, 255));
+    }
+}
+
+/* a list scrolling by a band of rows per frame, the rest stays put */
+static void drawUi(uint32_t *fb, unsigned int frame)
+{
+    int y, scroll = frame * 8;
+
+    if (frame == 0)
+        fillRect(fb, 0, 0, width, height, rgb(250, 250, 250));
+    for (y = height / 4; y < height * 3 / 4; y++) {
+        int row = (y + scroll) / 64, inRow = (y + scroll) % 64;
+        uint32_t colour = inRow == 63 ? rgb(220, 220, 224)
+            : inRow >= 16 && inRow < 48 ? rgb((row * 53) & 255, (row * 97) & 255, 200)
+            : rgb(250, 250, 250);
+        fillRect(fb, 0, y, 64, 1, colour);
+        fillRect(fb, 64, y, width - 64, 1, inRow >= 20 && inRow < 28 && (row & 1)
+                 ? rgb(40, 40, 48) : rgb(250, 250, 250));
+    }
+}
+
+/* every pixel changes every frame */
+static void drawVideo(uint32_t *fb, unsigned int frame)
+{
+    int x, y;
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            fb[y * width + x] = rgb((x + frame * 3) & 255, (y + frame * 2) & 255,
+                                    ((x + y) / 4 + frame * 5) & 255);
+}
+
+static uint64_t threadCpuMicros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void runServer(int readyFd)
+{
+    int argc = 0;
+    rfbScreenInfoPtr screen = rfbGetScreen(&argc, NULL, width, height, 8, 3, 4);
+    uint32_t *fb = (uint32_t *)calloc(width * height, 4);
+    uint32_t *back = (uint32_t *)calloc(width * height, 4);
+    uint64_t next;
+    unsigned int frame;
+    char ready = 1;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    rfbLogEnable(0);
+
+    /* as droidvncserver sets its screen up */
+    screen->frameBuffer = (char *)fb;
+    screen->deferUpdateTime = 5;
+    screen->sendQueueLimit = width * height * 4;
+    screen->port = port;
+    screen->ipv6port = port;
+    screen->alwaysShared = TRUE;
+    screen->desktopName = "loadtest";
+    rfbInitServer(screen);
+    if (screen->listenSock < 0) {
+        fprintf(stderr, "Could not listen on port %d\n", port);
+        exit(1);
+    }
+    rfbRunEventLoop(screen, -1, TRUE);
+    if (write(readyFd, &ready, 1) != 1)
+        exit(1);
+    close(readyFd);
+
+    next = rfbLatencyClock();
+    for (frame = 0;; frame++) {
+        uint64_t cpu = threadCpuMicros();
+
+        /* the encoders read the framebuffer while it is written, keep
+           that short as droidvncserver does by converting in one pass */
+        if (strcmp(content, "video") == 0)
+            drawVideo(back, frame);
+        else
+            drawUi(back, frame);
+        drawStamp(back, frame % STAMP_FRAMES);
+        shared->sourceMicros += threadCpuMicros() - cpu;
+
+        /* an encoder may pick the frame up while it is being copied */
+        shared->publishedAt[frame % STAMP_FRAMES] = rfbLatencyClock();
+        memcpy(fb, back, width * height * 4);
+        rfbMarkRectAsModified(screen, 0, 0, width, height);
+
+        next += 1000000 / frameRate;
+        {
+            uint64_t now = rfbLatencyClock();
+            if (next > now)
+                usleep(next - now);
+            else
+                next = now;
+        }
+    }
+}
+
+/* CPU time of the process in clock ticks, -1 if unknown */
+static long processTicks(pid_t pid)
+{
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *f;
+    size_t n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    /* the command may contain spaces, the fields after it do not */
+    if ((p = strrchr(buf, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2)
+        return -1;
+    return (long)(utime + stime);
+}
+
+
+/*
+ * Viewers
+ */
+
+/* the brightness of a pixel of the viewer's framebuffer, 0 to 765 */
+static int brightness(rfbClient *client, int x, int y)
+{
+    const rfbPixelFormat *f = &client->format;
+    int bpp = f->bitsPerPixel / 8;
+    uint8_t *p = client->frameBuffer + (y * client->width + x) * bpp;
+    uint32_t pixel = bpp == 4 ? *(uint32_t *)p : bpp == 2 ? *(uint16_t *)p : *p;
+
+    return ((pixel >> f->redShift) & f->redMax) * 255 / f->redMax
+        + ((pixel >> f->greenShift) & f->greenMax) * 255 / f->greenMax
+        + ((pixel >> f->blueShift) & f->blueMax) * 255 / f->blueMax;
+}
+
+/* the sequence number stamped on the frame, -1 if it does not check out */
+static int readStamp(rfbClient *client, int scale)
+{
+    int bit, frame = 0, check = 0;
+
+    if (client->width < STAMP_WIDTH / scale || client->height < STAMP_HEIGHT / scale)
+        return -1;
+    for (bit = 0; bit < STAMP_BITS; bit++) {
+        int x = (bit * STAMP_BLOCK + STAMP_BLOCK / 2) / scale;
+        if (brightness(client, x, STAMP_BLOCK / 2 / scale) > 382)
+            frame |= 1 << bit;
+        if (brightness(client, x, (STAMP_BLOCK + STAMP_BLOCK / 2) / scale) <= 382)
+            check |= 1 << bit;
+    }
+    return frame == check ? frame : -1;
+}
+
+static void onUpdateDone(rfbClient *client)
+{
+    Viewer *v = (Viewer *)rfbClientGetClientData(client, &viewers);
+    int frame = readStamp(client, v->scale);
+    uint64_t now = rfbLatencyClock();
+
+    if (!measuring)
+        return;
+    v->updates++;
+    if (frame < 0) {
+        v->torn++;
+    } else if (frame != v->lastFrame) {
+        uint64_t published = shared->publishedAt[frame];
+        v->lastFrame = frame;
+        v->frames++;
+        if (published && published <= now)
+            rfbLatencyRecord(&v->latency, now - published);
+    }
+}
+
+static void *runViewer(void *data)
+{
+    Viewer *v = (Viewer *)data;
+    const ClientFormat *f = v->format;
+    rfbClient *client = rfbGetClient(8, 3, f->bitsPerPixel / 8);
+
+    client->format.bitsPerPixel = f->bitsPerPixel;
+    client->format.depth = f->depth;
+    client->format.redMax = f->redMax;
+    client->format.greenMax = f->greenMax;
+    client->format.blueMax = f->blueMax;
+    client->format.redShift = f->redShift;
+    client->format.greenShift = f->greenShift;
+    client->format.blueShift = f->blueShift;
+    client->appData.encodingsString = v->encoding;
+    client->appData.compressLevel = compressLevel;
+    client->appData.qualityLevel = qualityLevel;
+    client->appData.enableJPEG = qualityLevel >= 0;
+    client->FinishedFrameBufferUpdate = onUpdateDone;
+    free(client->serverHost);
+    client->serverHost = strdup("127.0.0.1");
+    client->serverPort = port;
+    rfbClientSetClientData(client, &viewers, v);
+
+    /* rfbInitClient() frees the client when it fails */
+    if (!rfbInitClient(client, NULL, NULL)) {
+        v->failed = TRUE;
+        return NULL;
+    }
+    if (v->scale > 1) {
+        rfbSetScaleMsg msg;
+        msg.type = rfbSetScale;
+        msg.scale = v->scale;
+        msg.pad = 0;
+        if (!WriteToRFBServer(client, (char *)&msg, sz_rfbSetScaleMsg))
+            v->failed = TRUE;
+    }
+    v->connected = TRUE;
+
+    while (!stopping && !v->failed) {
+        int n = WaitForMessage(client, 100000);
+        if (n < 0 || (n > 0 && !HandleRFBServerMessage(client)))
+            v->failed = TRUE;
+    }
+    free(client->frameBuffer);
+    rfbClientCleanup(client);
+    return NULL;
+}
+
+
+/*
+ * Main
+ */
+
+static int splitList(char *list, const char **items)
+{
+    int n = 0;
+    char *item = strtok(list, ",");
+    for (; item && n < MAX_MIX; item = strtok(NULL, ","))
+        items[n++] = item;
+    return n;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n <viewers>\t\t Number of viewers (default 8)\n"
+            "  -e <encoding,...>\t Encodings to hand out (default tight,zrle,hextile,raw)\n"
+            "  -f <bpp,...>\t\t Pixel formats to hand out: 32, 16, 8 (default 32)\n"
+            "  -x <scale,...>\t Scales to hand out, 2 is half size (default 1)\n"
+            "  -q <quality>\t\t JPEG/ZYWRLE quality level, 0-9 (default lossless)\n"
+            "  -z <level>\t\t Compression level, 0-9 (default the encoder's)\n"
+            "  -s <width>x<height>\t Screen size (default 720x1280)\n"
+            "  -c ui|video\t\t Screen content (default ui)\n"
+            "  -r <fps>\t\t Frames the server publishes per second (default 30)\n"
+            "  -t <seconds>\t\t Time to measure for (default 10)\n"
+            "  -w <seconds>\t\t Time to let the viewers settle first (default 2)\n"
+            "  -p <port>\t\t Port for the server (default 5977)\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char encodingList[256] = "tight,zrle,hextile,raw", formatList[64] = "32", scaleList[64] = "1";
+    const char *encodings[MAX_MIX], *formatNames[MAX_MIX], *scales[MAX_MIX];
+    int viewerCount = 8, encodingCount, formatCount, scaleCount;
+    int readyPipe[2], c, i, connected = 0;
+    long ticksBefore, ticksAfter;
+    uint64_t sourceBefore, sourceAfter;
+    uint64_t start, elapsed;
+    rfbLatencyHistogram all;
+    unsigned int frames = 0;
+    pid_t server;
+    char ready;
+
+    while ((c = getopt(argc, argv, "n:e:f:x:q:z:s:c:r:t:w:p:")) != -1) {
+        switch (c) {
+        case 'n':
+            if ((viewerCount = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'e':
+            snprintf(encodingList, sizeof(encodingList), "%s", optarg);
+            break;
+        case 'f':
+            snprintf(formatList, sizeof(formatList), "%s", optarg);
+            break;
+        case 'x':
+            snprintf(scaleList, sizeof(scaleList), "%s", optarg);
+            break;
+        case 'q':
+            qualityLevel = atoi(optarg);
+            break;
+        case 'z':
+            compressLevel = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 ||
+                width < STAMP_WIDTH || height < STAMP_HEIGHT)
+                usage(argv[0]);
+            break;
+        case 'c':
+            content = optarg;
+            break;
+        case 'r':
+            if ((frameRate = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 't':
+            if ((duration = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'w':
+            warmUp = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    encodingCount = splitList(encodingList, encodings);
+    formatCount = splitList(formatList, formatNames);
+    scaleCount = splitList(scaleList, scales);
+    if (encodingCount == 0 || formatCount == 0 || scaleCount == 0)
+        usage(argv[0]);
+
+    viewers = (Viewer *)calloc(viewerCount, sizeof(Viewer));
+    for (i = 0; i < viewerCount; i++) {
+        const char *formatName = formatNames[(i / encodingCount) % formatCount];
+        int f;
+
+        viewers[i].index = i;
+        viewers[i].encoding = encodings[i % encodingCount];
+        viewers[i].scale = atoi(scales[(i / (encodingCount * formatCount)) % scaleCount]);
+        viewers[i].lastFrame = -1;
+        for (f = 0; f < FORMAT_COUNT && strcmp(formats[f].name, formatName); f++)
+            ;
+        if (f == FORMAT_COUNT || viewers[i].scale < 1) {
+            fprintf(stderr, "Unknown pixel format %s or bad scale\n", formatName);
+            return 1;
+        }
+        viewers[i].format = &formats[f];
+    }
+
+    shared = (volatile Shared *)mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED || pipe(readyPipe) < 0) {
+        perror("loadtest");
+        return 1;
+    }
+    if ((server = fork()) == 0) {
+        close(readyPipe[0]);
+        runServer(readyPipe[1]);
+        return 0;
+    }
+    close(readyPipe[1]);
+    if (server < 0 || read(readyPipe[0], &ready, 1) != 1) {
+        fprintf(stderr, "The server did not start\n");
+        return 1;
+    }
+
+    rfbEnableClientLogging = FALSE;
+    for (i = 0; i < viewerCount; i++)
+        pthread_create(&viewers[i].thread, NULL, runViewer, &viewers[i]);
+
+    sleep(warmUp);
+    ticksBefore = processTicks(server);
+    sourceBefore = shared->sourceMicros;
+    start = rfbLatencyClock();
+    measuring = TRUE;
+
+    sleep(duration);
+
+    measuring = FALSE;
+    elapsed = rfbLatencyClock() - start;
+    ticksAfter = processTicks(server);
+    sourceAfter = shared->sourceMicros;
+    for (i = 0; i < viewerCount; i++)
+        connected += viewers[i].connected && !viewers[i].failed;
+    stopping = TRUE;
+    for (i = 0; i < viewerCount; i++)
+        pthread_join(viewers[i].thread, NULL);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+
+    printf("%-6s %-10s %3s %5s %8s %8s %6s %8s %8s %8s %8s\n", "viewer", "encoding", "bpp",
+           "scale", "fps", "updates", "torn", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    memset(&all, 0, sizeof(all));
+    for (i = 0; i < viewerCount; i++) {
+        Viewer *v = &viewers[i];
+        int b;
+
+        printf("%-6d %-10s %3s %5d %8.1f %8u %6u %8.1f %8.1f %8.1f %8.1f%s\n", v->index,
+               v->encoding, v->format->name, v->scale, v->frames * 1e6 / elapsed, v->updates,
+               v->torn,
+               rfbLatencyPercentile(&v->latency, 50) / 1000.0,
+               rfbLatencyPercentile(&v->latency, 90) / 1000.0,
+               rfbLatencyPercentile(&v->latency, 99) / 1000.0,
+               v->latency.max / 1000.0,
+               v->failed ? "  failed" : "");
+
+        frames += v->frames;
+        all.count += v->latency.count;
+        all.total += v->latency.total;
+        if (v->latency.max > all.max)
+            all.max = v->latency.max;
+        for (b = 0; b < RFB_LATENCY_BUCKETS; b++)
+            all.buckets[b] += v->latency.buckets[b];
+    }
+
+    printf("\n%d of %d viewers still connected, %.1f fps each on average (server publishes %d)\n",
+           connected, viewerCount, frames * 1e6 / elapsed / viewerCount, frameRate);
+    printf("latency p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           rfbLatencyPercentile(&all, 50) / 1000.0, rfbLatencyPercentile(&all, 99) / 1000.0,
+           all.max / 1000.0);
+    if (ticksBefore >= 0 && ticksAfter >= 0) {
+        double total = (ticksAfter - ticksBefore) * 100.0 / sysconf(_SC_CLK_TCK) / (elapsed / 1e6);
+        double source = (sourceAfter - sourceBefore) * 100.0 / elapsed;
+        printf("server CPU %.0f%% of one core, not counting %.0f%% for drawing the frames\n",
+               total - source, source);
+    }
+    return 0;
+}
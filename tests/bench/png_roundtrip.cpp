@@ -0,0 +1,174 @@
+// Round trip check for PngEncoder: encodes frames with the serial and the
+// parallel (strip) encoder, decodes both with libpng and compares them with
+// each other and with the source pixels. The widths give strips starting on
+// both odd and even rows, every filter type is tried on its own and all
+// together. The 8 and 16 bit formats are checked against convertRowToRgb(),
+// which the encoder shares with the rest of the server.
+//
+// Exits with 1 on the first mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "droidvncserver.hpp"
+#include "PngEncoder.hpp"
+#include "pixel_convert.hpp"
+
+// What PngEncoder.cpp expects from droidvncserver.cpp
+void print(int logPriority, FILE* stream, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stream, format, args);
+    va_end(args);
+    fprintf(stream, "\n");
+}
+
+void cleanup(int exitCode) {
+    exit(exitCode);
+}
+
+// Same as PngEncoder.cpp
+#define PNG_STRIP_BYTES (256 * 1024)
+#define PNG_MIN_STRIPS 4
+
+static const unsigned int widths[] = { 64, 333, 720, 1000, 1080, 1440 };
+
+static const struct {
+    const char *name;
+    int filters;
+} filterSets[] = {
+    { "none", PNG_FILTER_NONE },
+    { "sub", PNG_FILTER_SUB },
+    { "up", PNG_FILTER_UP },
+    { "avg", PNG_FILTER_AVG },
+    { "paeth", PNG_FILTER_PAETH },
+    { "all", PNG_ALL_FILTERS },
+};
+
+// Smooth gradients with noise and some flat areas, so every filter wins
+// somewhere and deflate finds matches across strip borders
+static void fillFrame(std::vector<unsigned char> *data, unsigned int width, unsigned int height) {
+    unsigned int seed = width;
+
+    data->resize((size_t) width * height * 4);
+    for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned char *p = &(*data)[((size_t) y * width + x) * 4];
+            seed = seed * 1103515245 + 12345;
+            if ((y / 37) % 3 == 0) {
+                p[0] = x * 3;
+                p[1] = y;
+                p[2] = (x + y) / 2;
+            } else if ((y / 37) % 3 == 1) {
+                p[0] = p[1] = p[2] = (x / 64) * 40;
+            } else {
+                p[0] = seed >> 24;
+                p[1] = x ^ y;
+                p[2] = (seed >> 16) & 0x0f;
+            }
+            p[3] = 0xff;
+        }
+    }
+}
+
+static const struct {
+    const char *name;
+    unsigned int bpp;
+    Minicap::Format format;
+} smallFormats[] = {
+    { "332", 1, Minicap::FORMAT_NONE },
+    { "565", 2, Minicap::FORMAT_RGB_565 },
+    { "4444", 2, Minicap::FORMAT_RGBA_4444 },
+    { "5551", 2, Minicap::FORMAT_RGBA_5551 },
+};
+
+static bool decode(const std::vector<unsigned char> &png, std::vector<unsigned char> *rgb,
+                   unsigned int width, unsigned int height) {
+    png_image image;
+
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, png.data(), png.size())) {
+        fprintf(stderr, "  %s\n", image.message);
+        return false;
+    }
+    if (image.width != width || image.height != height) {
+        fprintf(stderr, "  decoded %ux%u\n", image.width, image.height);
+        png_image_free(&image);
+        return false;
+    }
+    image.format = PNG_FORMAT_RGB;
+    rgb->resize(PNG_IMAGE_SIZE(image));
+    if (!png_image_finish_read(&image, NULL, rgb->data(), 0, NULL)) {
+        fprintf(stderr, "  %s\n", image.message);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    PngEncoder serial(1), parallel(4);
+    int failures = 0;
+
+    for (unsigned int width : widths) {
+        unsigned int rowsPerStrip = PNG_STRIP_BYTES / (width * 3 + 1) + 1;
+        // enough for the parallel path, and a short last strip
+        unsigned int height = (PNG_MIN_STRIPS + 1) * rowsPerStrip + 7;
+        std::vector<unsigned char> frame, expected((size_t) width * height * 3);
+
+        fillFrame(&frame, width, height);
+        for (size_t i = 0; i < (size_t) width * height; i++) {
+            memcpy(&expected[i * 3], &frame[i * 4], 3);
+        }
+
+        for (const auto &set : filterSets) {
+            std::vector<unsigned char> outSerial, outParallel, rgbSerial, rgbParallel;
+            bool ok;
+
+            ok = serial.encode(&outSerial, frame.data(), width, height, width, 4, Minicap::FORMAT_RGBX_8888, 3,
+                               set.filters) &&
+                 parallel.encode(&outParallel, frame.data(), width, height, width, 4, Minicap::FORMAT_RGBX_8888, 3,
+                                 set.filters);
+            ok = ok && decode(outSerial, &rgbSerial, width, height) && rgbSerial == expected;
+            ok = ok && decode(outParallel, &rgbParallel, width, height) && rgbParallel == expected;
+
+            printf("%-5u %-6s strips of %3u rows (%s) %8zu/%8zu bytes  %s\n", width, set.name, rowsPerStrip,
+                   rowsPerStrip & 1 ? "odd" : "even", outSerial.size(), outParallel.size(), ok ? "ok" : "FAILED");
+            if (!ok) {
+                failures++;
+            }
+        }
+    }
+
+    // The same bytes read as smaller pixels
+    for (const auto &f : smallFormats) {
+        unsigned int width = 720;
+        unsigned int rowsPerStrip = PNG_STRIP_BYTES / (width * 3 + 1) + 1;
+        unsigned int height = (PNG_MIN_STRIPS + 1) * rowsPerStrip + 7;
+        std::vector<unsigned char> frame, expected((size_t) width * height * 3);
+        std::vector<unsigned char> outSerial, outParallel, rgbSerial, rgbParallel;
+        bool ok;
+
+        fillFrame(&frame, width, height);
+        for (unsigned int y = 0; y < height; y++) {
+            convertRowToRgb(&expected[(size_t) y * width * 3], &frame[(size_t) y * width * f.bpp], width, f.bpp,
+                            f.format);
+        }
+
+        ok = serial.encode(&outSerial, frame.data(), width, height, width, f.bpp, f.format, 3, PNG_ALL_FILTERS) &&
+             parallel.encode(&outParallel, frame.data(), width, height, width, f.bpp, f.format, 3, PNG_ALL_FILTERS);
+        ok = ok && decode(outSerial, &rgbSerial, width, height) && rgbSerial == expected;
+        ok = ok && decode(outParallel, &rgbParallel, width, height) && rgbParallel == expected;
+
+        printf("%-5u %-6s %8zu/%8zu bytes  %s\n", width, f.name, outSerial.size(), outParallel.size(),
+               ok ? "ok" : "FAILED");
+        if (!ok) {
+            failures++;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Scaling check: runs every scaling filter over hard edges between one
+ * fully lit channel and black on the packed true colour formats and checks
+ * that no channel bleeds into its neighbours.  The other channels have to
+ * stay 0, and the lit one has to be at least a third on, and at most two
+ * thirds on off, the side of the edge a scaled pixel's centre falls on
+ * (pixels within half a scaled pixel of the edge are only checked for
+ * bleeding).  Lanczos-2 overshoots next to the edge, which must be clamped
+ * to the channel's maximum.
+ *
+ * Exits with 1 if any case failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rfb/rfb.h>
+#include "scale.h"
+
+#define SRC_WIDTH 96
+#define SRC_HEIGHT 64
+#define EDGE_X 37
+#define EDGE_Y 29
+
+typedef struct {
+    const char *name;
+    int bitsPerPixel;
+    int max[3], shift[3];  /* red, green, blue */
+} Format;
+
+static const Format formats[] = {
+    { "rgb565", 16, { 31, 63, 31 }, { 0, 5, 11 } },
+    { "bgr565", 16, { 31, 63, 31 }, { 11, 5, 0 } },
+    { "rgb332", 8, { 7, 7, 3 }, { 0, 3, 6 } },
+    { "bgr233", 8, { 3, 7, 7 }, { 6, 3, 0 } },
+};
+
+static const struct {
+    const char *name;
+    int filter;
+} filters[] = {
+    { "area", RFB_SCALE_AREA },
+    { "bilinear", RFB_SCALE_BILINEAR },
+    { "lanczos2", RFB_SCALE_LANCZOS2 },
+};
+
+static const int sizes[][2] = { { 48, 32 }, { 37, 25 }, { 150, 100 } };
+
+static void setupScreen(rfbScreenInfo *s, const Format *f, int width, int height)
+{
+    memset(s, 0, sizeof(*s));
+    s->width = width;
+    s->height = height;
+    s->bitsPerPixel = f->bitsPerPixel;
+    s->depth = f->bitsPerPixel;
+    s->paddedWidthInBytes = width * (f->bitsPerPixel / 8);
+    s->sizeInBytes = s->paddedWidthInBytes * height;
+    s->frameBuffer = calloc(1, s->sizeInBytes);
+    s->serverFormat.bitsPerPixel = f->bitsPerPixel;
+    s->serverFormat.depth = f->bitsPerPixel;
+    s->serverFormat.trueColour = TRUE;
+    s->serverFormat.redMax = f->max[0];
+    s->serverFormat.greenMax = f->max[1];
+    s->serverFormat.blueMax = f->max[2];
+    s->serverFormat.redShift = f->shift[0];
+    s->serverFormat.greenShift = f->shift[1];
+    s->serverFormat.blueShift = f->shift[2];
+}
+
+static uint32_t getPixel(const rfbScreenInfo *s, int x, int y)
+{
+    const unsigned char *p = (const unsigned char *)s->frameBuffer +
+        y * s->paddedWidthInBytes + x * (s->bitsPerPixel / 8);
+    return s->bitsPerPixel == 16 ? *(const uint16_t *)p : *p;
+}
+
+static void putPixel(rfbScreenInfo *s, int x, int y, uint32_t v)
+{
+    unsigned char *p = (unsigned char *)s->frameBuffer +
+        y * s->paddedWidthInBytes + x * (s->bitsPerPixel / 8);
+    if (s->bitsPerPixel == 16)
+        *(uint16_t *)p = v;
+    else
+        *p = v;
+}
+
+/* channel lit on the left of (vertical) or above (horizontal) the edge */
+static int checkEdge(const Format *f, int filter, int dstWidth, int dstHeight, int channel, rfbBool vertical)
+{
+    rfbScreenInfo screen, scaled;
+    int x, y, c, bad = 0;
+
+    setupScreen(&screen, f, SRC_WIDTH, SRC_HEIGHT);
+    setupScreen(&scaled, f, dstWidth, dstHeight);
+    screen.scaleFilter = filter;
+    for (y = 0; y < SRC_HEIGHT; y++)
+        for (x = 0; x < SRC_WIDTH; x++)
+            if (vertical ? x < EDGE_X : y < EDGE_Y)
+                putPixel(&screen, x, y, (uint32_t)f->max[channel] << f->shift[channel]);
+
+    rfbScaledScreenUpdateRect(&screen, &scaled, 0, 0, SRC_WIDTH, SRC_HEIGHT);
+
+    for (y = 0; y < dstHeight; y++)
+        for (x = 0; x < dstWidth; x++) {
+            uint32_t v = getPixel(&scaled, x, y);
+            /* distance of the pixel's centre from the edge, in scaled pixels */
+            double d = vertical ? x + 0.5 - (double)EDGE_X * dstWidth / SRC_WIDTH
+                                : y + 0.5 - (double)EDGE_Y * dstHeight / SRC_HEIGHT;
+            int lit = (v >> f->shift[channel]) & f->max[channel];
+
+            for (c = 0; c < 3; c++)
+                if (c != channel && ((v >> f->shift[c]) & f->max[c]) != 0)
+                    bad++;
+            if (v >> f->bitsPerPixel != 0 ||
+                (d <= -0.5 && 3 * lit < f->max[channel]) ||
+                (d >= 0.5 && 3 * lit > 2 * f->max[channel]))
+                bad++;
+        }
+
+    free(screen.frameBuffer);
+    free(scaled.frameBuffer);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    int failures = 0;
+    size_t f, i, s;
+
+    for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+        for (i = 0; i < sizeof(filters) / sizeof(filters[0]); i++)
+            for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                int bad = 0, channel;
+
+                for (channel = 0; channel < 3; channel++) {
+                    bad += checkEdge(&formats[f], filters[i].filter, sizes[s][0], sizes[s][1], channel, TRUE);
+                    bad += checkEdge(&formats[f], filters[i].filter, sizes[s][0], sizes[s][1], channel, FALSE);
+                }
+                printf("%-7s %-9s %3dx%-3d  %s", formats[f].name, filters[i].name, sizes[s][0], sizes[s][1],
+                       bad ? "FAILED" : "ok");
+                if (bad)
+                    printf(" (%d pixels)", bad);
+                printf("\n");
+                if (bad)
+                    failures++;
+            }
+
+    return failures ? 1 : 0;
+}
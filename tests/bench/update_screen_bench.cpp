@@ -0,0 +1,171 @@
+// Microbenchmark for the updateScreen*() kernels of update_screen.cpp: every
+// kernel, rotation, typical phone and tablet resolution, and both a packed
+// and a padded (stride != width) frame, on synthetic frames.
+//
+// GB/s counts the bytes read from the frame plus the bytes written to the
+// framebuffer, ns/px is per screen pixel.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <vector>
+
+#include "droidvncserver.hpp"
+#include "update_screen.hpp"
+
+// What update_screen.cpp expects from droidvncserver.cpp
+Minicap::Frame frame;
+rfbScreenInfoPtr vncscr;
+unsigned char *vncbuf;
+
+static rfbScreenInfo screen;
+
+void print(int logPriority, FILE* stream, const char *format, ...) {
+}
+
+void cleanup(int exitCode) {
+    exit(exitCode);
+}
+
+const char *getImageFormatName() {
+    return "synthetic";
+}
+
+struct Kernel {
+    const char *name;
+    void (*setup)(void);
+    void (*update)(int);
+    unsigned int inBpp, outBpp;
+    Minicap::Format format;
+};
+
+static const Kernel kernels[] = {
+    { "1", setupScreen1, updateScreen1, 1, 1, Minicap::FORMAT_RGBA_8888 },
+    { "2", setupScreen2, updateScreen2, 2, 2, Minicap::FORMAT_RGB_565 },
+    { "4", setupScreen4, updateScreen4, 4, 4, Minicap::FORMAT_RGBA_8888 },
+    { "8", setupScreen8, updateScreen8, 8, 8, Minicap::FORMAT_RGBA_8888 },
+    { "42", setupScreen42, updateScreen42, 4, 2, Minicap::FORMAT_RGBA_8888 },
+};
+
+struct Size {
+    unsigned int width, height;
+};
+
+// Portrait, as the capture source delivers them
+static const Size sizes[] = {
+    { 720, 1280 },   // HD phone
+    { 1080, 1920 },  // FHD phone
+    { 1440, 2560 },  // QHD phone
+    { 1200, 1920 },  // WUXGA tablet
+    { 1536, 2048 },  // QXGA tablet
+};
+
+static const int rotations[] = { 0, 90, 180, 270 };
+
+// Gralloc pads rows to a multiple of 32 or 64 pixels; a width that already
+// is one still gets 16 pixels of padding so every size has a padded case
+static unsigned int paddedStride(unsigned int width) {
+    unsigned int stride = (width + 63) & ~63u;
+    return stride == width ? width + 16 : stride;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-t <ms>] [-k <kernel>] [-s <width>x<height>]\n"
+            "  -t <ms>\t\t Time to run every case for (default 100)\n"
+            "  -k <kernel>\t\t Only run updateScreen<kernel> (1, 2, 4, 8, 42)\n"
+            "  -s <width>x<height>\t Only run this frame size\n", name);
+    exit(1);
+}
+
+// Run the kernel for at least minMillis and return ns per call
+static double timeKernel(const Kernel &k, int rotation, unsigned int minMillis) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start, now;
+    unsigned long calls = 0;
+
+    k.update(rotation); // warm the caches and fault the pages in
+    start = clock::now();
+    do {
+        k.update(rotation);
+        calls++;
+        now = clock::now();
+    } while (now - start < std::chrono::milliseconds(minMillis));
+
+    return std::chrono::duration<double, std::nano>(now - start).count() / calls;
+}
+
+int main(int argc, char **argv) {
+    unsigned int minMillis = 100, onlyWidth = 0, onlyHeight = 0;
+    const char *onlyKernel = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:k:s:")) != -1) {
+        switch (c) {
+        case 't':
+            minMillis = atoi(optarg);
+            break;
+        case 'k':
+            onlyKernel = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%ux%u", &onlyWidth, &onlyHeight) != 2)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    vncscr = &screen;
+    printf("%-8s %-10s %6s %4s %8s %8s\n", "kernel", "size", "stride", "rot", "ns/px", "GB/s");
+
+    for (const Kernel &k : kernels) {
+        if (onlyKernel && strcmp(onlyKernel, k.name))
+            continue;
+
+        for (const Size &size : sizes) {
+            if (onlyWidth && (size.width != onlyWidth || size.height != onlyHeight))
+                continue;
+
+            unsigned int strides[] = { size.width, paddedStride(size.width) };
+            for (unsigned int stride : strides) {
+                std::vector<unsigned char> data(stride * size.height * k.inBpp);
+                std::vector<unsigned char> out(size.width * size.height * k.outBpp);
+                unsigned int seed = 1;
+
+                // Noise rather than a constant, so nothing can take a shortcut
+                for (size_t i = 0; i < data.size(); i++) {
+                    seed = seed * 1103515245 + 12345;
+                    data[i] = seed >> 16;
+                }
+
+                frame.data = data.data();
+                frame.format = k.format;
+                frame.width = size.width;
+                frame.height = size.height;
+                frame.stride = stride;
+                frame.bpp = k.inBpp;
+                frame.size = data.size();
+                vncbuf = out.data();
+                k.setup();
+
+                for (int rotation : rotations) {
+                    double ns = timeKernel(k, rotation, minMillis);
+                    double pixels = (double) size.width * size.height;
+                    char sizeName[24];
+
+                    snprintf(sizeName, sizeof(sizeName), "%ux%u", size.width, size.height);
+                    printf("%-8s %-10s %6u %4d %8.3f %8.2f\n", k.name, sizeName, stride, rotation,
+                           ns / pixels, pixels * (k.inBpp + k.outBpp) / ns);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    return 0;
+}